@@ -0,0 +1,188 @@
+//
+//  bench.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+template <typename T>
+inline void do_not_optimize(const T& value) {
+  asm volatile("" : : "m"(value) : "memory");
+}
+
+inline double now() {
+  using namespace std::chrono;
+  return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Two-sided 95% quantile of Student's t distribution
+inline double t95(size_t df) {
+  static const double table[] = {
+      0,     12.71, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+      2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+      2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+      2.042};
+  return df < std::size(table) ? table[df] : 1.96;
+}
+
+struct Stats {
+  size_t samples = 0;
+  size_t batch = 0;  // operations per sample
+  double median = 0;
+  double mean = 0;
+  double stddev = 0;
+  double mad = 0;  // median absolute deviation
+  double min = 0;
+  double max = 0;
+  double ci95 = 0;  // half width of the 95% confidence interval of the mean
+};
+
+inline double median(std::vector<double> xs) {
+  std::sort(xs.begin(), xs.end());
+  auto n = xs.size();
+  return n % 2 ? xs[n / 2] : (xs[n / 2 - 1] + xs[n / 2]) / 2;
+}
+
+inline Stats summarize(const std::vector<double>& xs, size_t batch) {
+  Stats s;
+  s.samples = xs.size();
+  s.batch = batch;
+  if (xs.empty()) {
+    return s;
+  }
+
+  s.median = median(xs);
+  s.min = *std::min_element(xs.begin(), xs.end());
+  s.max = *std::max_element(xs.begin(), xs.end());
+
+  for (auto x : xs) {
+    s.mean += x;
+  }
+  s.mean /= xs.size();
+
+  if (xs.size() > 1) {
+    auto var = 0.0;
+    for (auto x : xs) {
+      var += (x - s.mean) * (x - s.mean);
+    }
+    s.stddev = std::sqrt(var / (xs.size() - 1));
+    s.ci95 = t95(xs.size() - 1) * s.stddev / std::sqrt(xs.size());
+  }
+
+  std::vector<double> devs;
+  for (auto x : xs) {
+    devs.push_back(std::fabs(x - s.median));
+  }
+  s.mad = median(devs);
+  return s;
+}
+
+inline void print_json(std::ostream& out, const char* key, const Stats& s,
+                       const char* unit) {
+  out << "\"" << key << "\": {\"samples\": " << s.samples
+      << ", \"batch\": " << s.batch << ", \"unit\": \"" << unit
+      << "\", \"median\": " << s.median << ", \"mean\": " << s.mean
+      << ", \"stddev\": " << s.stddev << ", \"mad\": " << s.mad
+      << ", \"min\": " << s.min << ", \"max\": " << s.max
+      << ", \"ci95\": " << s.ci95 << "}";
+}
+
+inline std::string json_escape(std::string_view s) {
+  std::string r;
+  for (auto c : s) {
+    if (c == '"' || c == '\\') {
+      r += '\\';
+    }
+    r += c;
+  }
+  return r;
+}
+
+// Repeats each benchmark in batches long enough to be timed reliably and
+// reports per-operation statistics over the batches.
+struct Runner {
+  size_t samples = 30;
+  double min_time = 0.01;  // seconds per sample
+  std::string filter;
+
+  std::vector<std::pair<std::string, Stats>> results;
+
+  // Accepts --samples=N, --min-time=SEC and --filter=SUBSTRING.
+  bool parse_args(int argc, const char** argv) {
+    for (auto i = 1; i < argc; i++) {
+      auto arg = std::string_view(argv[i]);
+      if (arg.substr(0, 10) == "--samples=") {
+        samples = std::stoul(std::string(arg.substr(10)));
+      } else if (arg.substr(0, 11) == "--min-time=") {
+        min_time = std::stod(std::string(arg.substr(11)));
+      } else if (arg.substr(0, 9) == "--filter=") {
+        filter = arg.substr(9);
+      } else {
+        std::cerr << "unknown option '" << arg << "'." << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename F>
+  void run(const std::string& name, F&& f) {
+    if (!filter.empty() && name.find(filter) == std::string::npos) {
+      return;
+    }
+
+    auto time = [&](size_t batch) {
+      auto start = now();
+      for (size_t i = 0; i < batch; i++) {
+        f();
+      }
+      return now() - start;
+    };
+
+    // Grow the batch until a sample takes at least `min_time`.
+    size_t batch = 1;
+    for (;;) {
+      auto t = time(batch);
+      if (t >= min_time || batch >= (size_t(1) << 32)) {
+        break;
+      }
+      auto scale = t > 0 ? min_time / t * 1.2 : 100;
+      batch = size_t(batch * std::clamp(scale, 2.0, 100.0));
+    }
+
+    std::vector<double> xs;
+    for (size_t i = 0; i < samples; i++) {
+      xs.push_back(time(batch) / batch * 1e9);
+    }
+
+    auto s = summarize(xs, batch);
+    std::cerr << name << ": " << s.median << " ns (+/- " << s.ci95 << ")"
+              << std::endl;
+    results.emplace_back(name, s);
+  }
+
+  void print_json(std::ostream& out) const {
+    out << "{" << std::endl << "  \"benchmarks\": [" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+      const auto& [name, s] = results[i];
+      out << "    {\"name\": \"" << json_escape(name) << "\", ";
+      bench::print_json(out, "time", s, "ns");
+      out << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    out << "  ]" << std::endl << "}" << std::endl;
+  }
+};
+
+}  // namespace bench
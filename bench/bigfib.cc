@@ -0,0 +1,268 @@
+//
+//  Big integer benchmark: exact Fibonacci numbers by fast doubling
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <cmath>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <x86intrin.h>
+
+#include "bench/bench.h"
+#include "bigint.h"
+
+using namespace std;
+using namespace fiblang;
+
+struct NullBuffer : streambuf {
+  int overflow(int c) override { return c; }
+  streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+// F(n) with F(0) = 0, F(1) = 1, using
+//   F(2k)     = F(k) * (2 F(k+1) - F(k))
+//   F(2k + 1) = F(k)^2 + F(k+1)^2
+BigInt fibonacci(unsigned long n) {
+  BigInt a(0L), b(1L);
+  for (auto bit = 63 - __builtin_clzl(n | 1); bit >= 0; bit--) {
+    auto c = a * (b + b - a);
+    auto d = a * a + b * b;
+    if ((n >> bit) & 1) {
+      a = d;
+      b = c + d;
+    } else {
+      a = move(c);
+      b = move(d);
+    }
+  }
+  return a;
+}
+
+// F(n) mod 2^64
+uint64_t fibonacci_low(unsigned long n) {
+  uint64_t a = 0, b = 1;
+  for (unsigned long i = 0; i < n; i++) {
+    auto c = a + b;
+    a = b;
+    b = c;
+  }
+  return a;
+}
+
+int main(int argc, const char** argv) {
+  vector<unsigned long> ns = {100000, 1000000, 10000000};
+  size_t samples = 3;
+  auto threads = bigint::thread_count();
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 4) == "--n=") {
+      ns = {stoul(string(arg.substr(4)))};
+    } else if (arg.substr(0, 10) == "--samples=") {
+      samples = stoul(string(arg.substr(10)));
+    } else if (arg.substr(0, 10) == "--threads=") {
+      threads = stoul(string(arg.substr(10)));
+    } else {
+      cerr << "usage: bigfib [--n=N] [--samples=N] [--threads=N]" << endl;
+      return -1;
+    }
+  }
+
+  cout << "{" << endl << "  \"multiplication\": [" << endl;
+
+  // Algorithm crossovers for balanced operands
+  mt19937_64 rng(42);
+  auto first = true;
+  for (size_t limbs = 64; limbs <= 65536; limbs *= 4) {
+    bigint::Limbs a(limbs), b(limbs);
+    for (auto& x : a) {
+      x = rng();
+    }
+    for (auto& x : b) {
+      x = rng();
+    }
+
+    auto time = [&](auto mul) {
+      vector<double> xs;
+      for (size_t i = 0; i < samples; i++) {
+        auto start = bench::now();
+        auto r = mul(a.data(), limbs, b.data(), limbs);
+        xs.push_back(bench::now() - start);
+        bench::do_not_optimize(r);
+      }
+      return bench::summarize(xs, 1);
+    };
+
+    cout << (first ? "" : ",\n") << "    {\"limbs\": " << limbs << ", ";
+    if (limbs <= 4096) {
+      bench::print_json(cout, "schoolbook", time(bigint::mul_schoolbook), "s");
+      cout << ", ";
+    }
+    bench::print_json(cout, "karatsuba", time(bigint::mul_karatsuba), "s");
+    cout << ", ";
+    bench::print_json(cout, "ntt", time(bigint::mul_ntt), "s");
+    cout << "}";
+    first = false;
+  }
+  cout << endl << "  ]," << endl << "  \"fibonacci\": [" << endl;
+
+  first = true;
+  for (auto n : ns) {
+    vector<double> xs;
+    BigInt f;
+    for (size_t i = 0; i < samples; i++) {
+      auto start = bench::now();
+      f = fibonacci(n);
+      xs.push_back(bench::now() - start);
+    }
+    auto s = bench::summarize(xs, 1);
+
+    auto ok = !f.limbs.empty() && f.limbs[0] == fibonacci_low(n);
+    auto digits = size_t(f.bit_length() * log10(2.0)) + 1;
+    cerr << "F(" << n << "): " << s.median << " s, " << digits << " digits"
+         << (ok ? "" : " (WRONG)") << endl;
+
+    cout << (first ? "" : ",\n") << "    {\"n\": " << n
+         << ", \"bits\": " << f.bit_length() << ", \"digits\": " << digits
+         << ", \"verified\": " << (ok ? "true" : "false") << ", ";
+    bench::print_json(cout, "time", s, "s");
+    cout << "}";
+    first = false;
+  }
+  cout << endl << "  ]," << endl << "  \"print\": {" << endl;
+
+  // Printing F(10^6): the first conversion also builds the cached powers of
+  // ten, later ones only divide.
+  {
+    auto f = fibonacci(1000000);
+    auto start = bench::now();
+    auto s = f.str();
+    auto cold = bench::now() - start;
+
+    ostringstream ss;
+    f.write(ss);
+    auto ok = s == bigint::to_decimal_naive(f.limbs, 0) && s == ss.str();
+
+    NullBuffer null_buffer;
+    ostream null(&null_buffer);
+    vector<pair<const char*, function<void()>>> ops = {
+        {"naive",
+         [&] { bench::do_not_optimize(bigint::to_decimal_naive(f.limbs, 0)); }},
+        {"str", [&] { bench::do_not_optimize(f.str()); }},
+        {"stream", [&] { null << f; }},
+    };
+
+    cerr << "print F(1000000): " << cold << " s cold" << (ok ? "" : " (WRONG)")
+         << endl;
+    cout << "    \"digits\": " << s.size()
+         << ", \"verified\": " << (ok ? "true" : "false")
+         << ", \"cold\": " << cold;
+    for (const auto& [name, op] : ops) {
+      vector<double> xs;
+      for (size_t i = 0; i < samples; i++) {
+        auto start = bench::now();
+        op();
+        xs.push_back(bench::now() - start);
+      }
+      auto stats = bench::summarize(xs, 1);
+      cerr << "print F(1000000) " << name << ": " << stats.median << " s"
+           << endl;
+      cout << ", ";
+      bench::print_json(cout, name, stats, "s");
+    }
+  }
+  cout << endl << "  }," << endl << "  \"add_n\": [" << endl;
+
+  // Throughput of the addition kernels in limbs per TSC cycle, for every
+  // instruction set the CPU supports
+  first = true;
+  auto detected = bigint::simd;
+  const char* simd_names[] = {"scalar", "avx2", "avx512"};
+  for (size_t limbs = 16; limbs <= 65536; limbs *= 16) {
+    bigint::Limbs a(limbs), b(limbs), r(limbs);
+    for (auto& x : a) {
+      x = rng();
+    }
+    for (auto& x : b) {
+      x = rng();
+    }
+    auto reps = max<size_t>(1, (size_t(1) << 22) / limbs);
+
+    for (auto op : {"add", "sub"}) {
+      cout << (first ? "" : ",\n") << "    {\"op\": \"" << op
+           << "\", \"limbs\": " << limbs;
+      cerr << op << " " << limbs << " limbs:";
+      for (auto level : {bigint::Simd::None, bigint::Simd::Avx2,
+                         bigint::Simd::Avx512}) {
+        if (level > detected) {
+          break;
+        }
+        bigint::simd = level;
+        vector<double> xs;
+        for (size_t i = 0; i < samples; i++) {
+          auto start = __rdtsc();
+          for (size_t j = 0; j < reps; j++) {
+            auto c = op[0] == 'a'
+                         ? bigint::add_n(r.data(), a.data(), b.data(), limbs)
+                         : bigint::sub_n(r.data(), a.data(), b.data(), limbs);
+            bench::do_not_optimize(c);
+          }
+          xs.push_back(double(__rdtsc() - start));
+        }
+        auto throughput = limbs * reps / bench::summarize(xs, 1).median;
+        cerr << " " << simd_names[int(level)] << " " << throughput;
+        cout << ", \"" << simd_names[int(level)] << "\": " << throughput;
+      }
+      cerr << " limbs/cycle" << endl;
+      cout << "}";
+      first = false;
+    }
+  }
+  bigint::simd = detected;
+  cout << endl << "  ]," << endl << "  \"parallel\": [" << endl;
+
+  // Single-threaded against multi-threaded kernels on huge operands
+  auto f = fibonacci(1000000);
+  auto g = f * f;
+  BigInt h;
+  h.limbs.resize(bigint::parallel_add_threshold * 4);
+  for (auto& x : h.limbs) {
+    x = rng();
+  }
+  vector<pair<const char*, function<void()>>> ops = {
+      {"add", [&] { bench::do_not_optimize(h + h); }},
+      {"mul", [&] { bench::do_not_optimize(g * g); }},
+      {"str", [&] { bench::do_not_optimize(g.str()); }},
+  };
+
+  first = true;
+  for (const auto& [name, op] : ops) {
+    bench::Stats results[2];
+    for (auto parallel : {false, true}) {
+      bigint::threads = parallel ? threads : 1;
+      vector<double> xs;
+      for (size_t i = 0; i < samples; i++) {
+        auto start = bench::now();
+        op();
+        xs.push_back(bench::now() - start);
+      }
+      results[parallel] = bench::summarize(xs, 1);
+    }
+    auto speedup = results[0].median / results[1].median;
+    cerr << name << ": " << speedup << "x with " << threads << " threads"
+         << endl;
+
+    cout << (first ? "" : ",\n") << "    {\"op\": \"" << name
+         << "\", \"threads\": " << threads << ", ";
+    bench::print_json(cout, "single", results[0], "s");
+    cout << ", ";
+    bench::print_json(cout, "parallel", results[1], "s");
+    cout << ", \"speedup\": " << speedup << "}";
+    first = false;
+  }
+  cout << endl << "  ]" << endl << "}" << endl;
+  return 0;
+}
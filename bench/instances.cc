@@ -0,0 +1,142 @@
+//
+//  Instance stress test: many interpreters running concurrently
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <atomic>
+#include <thread>
+
+#include "bench/bench.h"
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+// Each instance parses and runs its own program, which prints fib(1..n)
+// offset by the instance number through a private definition. Half of the
+// instances read `fib` from globals shared by all of them, the other half
+// define everything themselves.
+string source(size_t id, size_t n, bool shared) {
+  auto s = shared ? ""s
+                  : "def fib(x)\n  x < 2 ? 1 : fib(x - 2) + fib(x - 1)\n";
+  s += "def offset(x) x + " + to_string(id) + "\n";
+  s += "for i from 1 to " + to_string(n) + "\n  puts(offset(fib(i)))\n";
+  return s;
+}
+
+string expected(size_t id, size_t n) {
+  string s;
+  long a = 1, b = 1;
+  for (size_t i = 1; i <= n; i++) {
+    s += to_string(b + long(id)) + "\n";
+    auto c = a + b;
+    a = b;
+    b = c;
+  }
+  return s;
+}
+
+int main(int argc, const char** argv) {
+  size_t instances = 512;
+  size_t threads = 16;
+  size_t n = 18;
+  string metrics_address;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 12) == "--instances=") {
+      instances = stoul(string(arg.substr(12)));
+    } else if (arg.substr(0, 10) == "--threads=") {
+      threads = max(1ul, stoul(string(arg.substr(10))));
+    } else if (arg.substr(0, 4) == "--n=") {
+      n = stoul(string(arg.substr(4)));
+    } else if (arg.substr(0, 10) == "--metrics=") {
+      metrics_address = arg.substr(10);
+    } else {
+      cerr << "usage: instances [--instances=N] [--threads=N] [--n=N] "
+              "[--metrics=port|socket path]"
+           << endl;
+      return -1;
+    }
+  }
+
+  auto fib = "def fib(x)\n  x < 2 ? 1 : fib(x - 2) + fib(x - 1)\n"s;
+  auto fib_program = parse(fib, cerr);
+  Globals globals(Environment::builtins());
+  {
+    Interpreter loader(globals);
+    loader.run(*fib_program->root);
+    loader.publish();
+  }
+
+  atomic<size_t> next{0};
+  atomic<size_t> failures{0};
+
+  // Served while the instances run, as a service would
+  Metrics metrics;
+  metrics.gauge("fiblang_instances_queued", "Instances waiting for a thread.",
+                [&] {
+                  return double(instances - min(instances, next.load()));
+                });
+  unique_ptr<MetricsServer> server;
+  if (!metrics_address.empty()) {
+    server = make_unique<MetricsServer>(metrics, metrics_address);
+    cerr << "serving metrics on " << server->url << endl;
+  }
+  atomic<size_t> calls{0};
+  atomic<size_t> environments{0};
+
+  auto start = bench::now();
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&] {
+      for (size_t id; (id = next++) < instances;) {
+        auto shared = id % 2 == 0;
+        auto s = source(id, n, shared);
+        ostringstream log, out;
+        auto program = parse(s, log);
+        if (!program) {
+          cerr << "instance " << id << ": " << log.str();
+          failures++;
+          continue;
+        }
+
+        auto interpreter = shared ? make_unique<Interpreter>(globals, out)
+                                  : make_unique<Interpreter>(out);
+        if (server) {
+          interpreter->metrics = &metrics;
+        }
+        try {
+          interpreter->run(*program->root);
+        } catch (const exception& e) {
+          cerr << "instance " << id << ": " << e.what() << endl;
+          failures++;
+          continue;
+        }
+
+        if (out.str() != expected(id, n) || interpreter->stats.outputs != n) {
+          cerr << "instance " << id << ": wrong output" << endl;
+          failures++;
+        }
+        calls += interpreter->stats.calls;
+        environments += interpreter->stats.environments;
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  auto wall = bench::now() - start;
+
+  cerr << instances << " instances on " << threads << " threads: " << wall
+       << " s, " << failures << " failures" << endl;
+
+  cout << "{\"instances\": " << instances << ", \"threads\": " << threads
+       << ", \"n\": " << n << ", \"failures\": " << failures
+       << ", \"calls\": " << calls << ", \"environments\": " << environments
+       << ", \"time\": " << wall
+       << ", \"instances_per_second\": " << instances / wall << "}" << endl;
+  return failures ? -2 : 0;
+}
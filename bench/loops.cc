@@ -0,0 +1,147 @@
+//
+//  Loop benchmark: FOR-heavy programs with and without loop optimizations
+//  and on-stack replacement
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include "bench/bench.h"
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+struct NullBuffer : streambuf {
+  int overflow(int c) override { return c; }
+};
+
+vector<pair<const char*, string>> programs = {
+    // fib(12) doesn't depend on the loop variable
+    {"invariant",
+     "def fib(x) x < 2 ? 1 : fib(x - 2) + fib(x - 1)\n"
+     "for i from 1 to 20000 puts(i + fib(12))\n"},
+    // A cheap body, dominated by the loop itself
+    {"wide",
+     "def f(x) x + 1\n"
+     "for i from 1 to 2000000 f(i)\n"},
+    // g(i) only depends on the outer loop
+    {"nested",
+     "def g(x) x - 1\n"
+     "def h(x) x < 0 ? 0 : x\n"
+     "for i from 1 to 1000 for j from 1 to 1000 h(j + g(i))\n"},
+    {"output", "for i from 1 to 1000000 puts(i)\n"},
+    // The loop in `g` is entered 1500 times and moves to the IR each time,
+    // compiled once
+    {"reentered",
+     "def g(x) for j from 1 to 1200 (j < x ? j + x : j - x) + (x < 5 ? 1 : 2)\n"
+     "for i from 1 to 1500 g(i)\n"},
+    // Not compiled, since `f` reads the loop variable of its caller
+    {"dynamic",
+     "def f(x) x + i\n"
+     "for i from 1 to 2000000 f(i)\n"},
+    // Not compiled, since `f` is defined twice
+    {"redefined",
+     "def f(x) x\n"
+     "def f(x) x + 1\n"
+     "for i from 1 to 3000000 i - 1 < 0 ? 0 : i + 1 - 2\n"},
+};
+
+// eval() without and with on-stack replacement, then the IR without the
+// loop pass, peeled only and unrolled
+struct Mode {
+  const char* name;
+  bool compile;
+  size_t unroll;
+  size_t osr_after;
+};
+vector<Mode> modes = {
+    {"ast", false, 4, 0},     {"osr", false, 4, 1000}, {"ir", true, 0, 0},
+    {"peel", true, 1, 0},     {"unroll4", true, 4, 0}, {"unroll8", true, 8, 0},
+};
+
+int main(int argc, const char** argv) {
+  size_t samples = 5;
+  string filter;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 10) == "--samples=") {
+      samples = stoul(string(arg.substr(10)));
+    } else if (arg.substr(0, 9) == "--filter=") {
+      filter = arg.substr(9);
+    } else {
+      cerr << "usage: loops [--samples=N] [--filter=name]" << endl;
+      return -1;
+    }
+  }
+
+  NullBuffer null;
+  ostream null_out(&null);
+
+  cout << "{" << endl << "  \"results\": [" << endl;
+  auto first = true;
+  for (const auto& [name, source] : programs) {
+    if (string_view(name).find(filter) == string_view::npos) {
+      continue;
+    }
+    auto program = parse(source, cerr);
+    if (!program) {
+      return -2;
+    }
+
+    ostringstream expected;
+    Interpreter reference(expected);
+    reference.config.osr_after = 0;
+    reference.run(*program->root);
+
+    double baseline = 0;
+    for (const auto& [mode, compile, unroll, osr_after] : modes) {
+      program->module = nullptr;
+      Config config;
+      config.unroll_factor = unroll;
+      config.osr_after = osr_after;
+      auto stats = ir::Stats();
+      if (compile) {
+        if (!ir::compile(*program, config)) {
+          cerr << name << " " << mode << ": not compiled" << endl;
+          continue;
+        }
+        stats = program->module->stats;
+      }
+
+      ostringstream out;
+      Interpreter check(out);
+      check.config = config;
+      check.run(*program);
+      auto ok = out.str() == expected.str();
+
+      vector<double> times;
+      for (size_t i = 0; i < samples; i++) {
+        Interpreter interpreter(null_out);
+        interpreter.config = config;
+        auto start = bench::now();
+        interpreter.run(*program);
+        times.push_back(bench::now() - start);
+      }
+      auto s = bench::summarize(times, 1);
+      if (!baseline) {
+        baseline = s.median;
+      }
+      cerr << name << " " << mode << ": " << s.median << " s ("
+           << baseline / s.median << "x)" << (ok ? "" : " (WRONG)") << endl;
+
+      cout << (first ? "" : ",\n") << "    {\"program\": \"" << name
+           << "\", \"mode\": \"" << mode << "\", \"verified\": "
+           << (ok ? "true" : "false") << ", \"hoisted\": " << stats.hoisted
+           << ", \"loops\": " << stats.loops
+           << ", \"osr\": " << check.stats.osr
+           << ", \"speedup\": " << baseline / s.median << ", ";
+      bench::print_json(cout, "run", s, "s");
+      cout << "}";
+      first = false;
+    }
+  }
+  cout << endl << "  ]" << endl << "}" << endl;
+  return 0;
+}
@@ -0,0 +1,208 @@
+//
+//  Microbenchmarks for the FibLang runtime internals
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <list>
+#include <random>
+
+#include "bench/bench.h"
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+struct NullBuffer : streambuf {
+  int overflow(int c) override { return c; }
+};
+
+// `def fN(x) ...` repeated `n` times
+string definitions(size_t n) {
+  string s;
+  for (size_t i = 0; i < n; i++) {
+    auto name = "f" + to_string(i);
+    s += "def " + name + "(x)\n  x < 2 ? 1 : " + name + "(x - 2) + " + name +
+         "(x - 1)\n";
+  }
+  return s;
+}
+
+// `open` repeated `depth` times around `1`
+string nested(size_t depth, const string& open) {
+  string s;
+  for (size_t i = 0; i < depth; i++) {
+    s += open;
+  }
+  s += "1";
+  s += string(depth, ')');
+  return s;
+}
+
+int main(int argc, const char** argv) {
+  bench::Runner runner;
+  if (!runner.parse_args(argc, argv)) {
+    return -1;
+  }
+
+  // Grammar construction
+  runner.run("grammar", [] {
+    parser pg(grammar);
+    bench::do_not_optimize(pg);
+  });
+
+  // Parsing with a prebuilt grammar, so `grammar` is not counted again
+  parser pg(grammar);
+  pg.log = [](size_t ln, size_t col, const string& msg) {
+    cerr << ln << ":" << col << ": " << msg << endl;
+  };
+  pg.enable_ast();
+
+  auto bench_parse = [&](const string& name, const string& source) {
+    runner.run(name, [&] {
+      shared_ptr<Ast> ast;
+      pg.parse(source, ast);
+      ast = AstOptimizer(true).optimize(ast);
+      Program program(source);
+      Lowering(program).lower_program(*ast);
+      bench::do_not_optimize(program.root);
+    });
+  };
+  auto bench_stack_parse = [&](const string& name, const string& source) {
+    runner.run(name, [&] { bench::do_not_optimize(parse(source, cerr)); });
+  };
+  for (auto n : {10, 100, 1000}) {
+    bench_parse("parse_peg/definitions=" + to_string(n), definitions(n));
+    bench_stack_parse("parse/definitions=" + to_string(n), definitions(n));
+  }
+  for (auto depth : {10, 100, 1000}) {
+    bench_parse("parse_peg/parens=" + to_string(depth), nested(depth, "("));
+    bench_parse("parse_peg/calls=" + to_string(depth), nested(depth, "f("));
+    bench_stack_parse("parse/parens=" + to_string(depth), nested(depth, "("));
+    bench_stack_parse("parse/calls=" + to_string(depth), nested(depth, "f("));
+  }
+
+  // Variable lookup through environment chains
+  for (auto depth : {1, 4, 16, 64}) {
+    auto env = make_rc<Environment>();
+    env->set_value("x", Value(1L));
+    for (auto i = 1; i < depth; i++) {
+      env = make_rc<Environment>(env);
+      env->set_value("y", Value(2L));
+    }
+    runner.run("get_value/depth=" + to_string(depth), [&] {
+      bench::do_not_optimize(env->get_value("x"));
+    });
+  }
+
+  // Value construction and casting
+  volatile long n = 42;
+  runner.run("value/long", [&] {
+    auto l = Value(long(n)).to_long();
+    bench::do_not_optimize(l);
+  });
+  runner.run("value/bool", [&] {
+    auto b = Value(n < 100).to_bool();
+    bench::do_not_optimize(b);
+  });
+  auto fn = Value(Function("x", [](Rc<Environment>) { return Value(); }));
+  runner.run("value/function", [&] {
+    auto f = fn.to_function();
+    bench::do_not_optimize(f);
+  });
+
+  // `puts` formatting and the builtin itself with output discarded
+  runner.run("puts/str", [&] {
+    auto s = Value(long(n) * 1234567).str();
+    bench::do_not_optimize(s);
+  });
+
+  NullBuffer null;
+  ostream null_out(&null);
+  {
+    Interpreter interpreter(null_out);
+    auto puts = interpreter.env()->get_value("puts").to_function();
+    auto call_env = make_rc<Environment>(interpreter.env());
+    call_env->set_value(puts.param, Value(1346269L));
+    runner.run("puts/builtin", [&] { puts.eval(call_env); });
+  }
+
+  // A single `CALL` of a trivial user-defined function
+  {
+    auto source = "def id(x) x\nid(1)"s;
+    auto program = parse(source, cerr);
+    Interpreter interpreter;
+    interpreter.run(*program->root->nodes[0]);
+    const auto& call = *program->root->nodes[1];
+    runner.run("call",
+               [&] { bench::do_not_optimize(interpreter.run(call)); });
+  }
+
+  // Arithmetic and comparison on inline Longs, on the BigInt promotion and
+  // demotion path, and the whole fib.fib workload at a smaller size
+  {
+    // Tokens and definitions refer to the source text, which must outlive
+    // the environment
+    list<string> sources;
+    Interpreter interpreter;
+    auto bench_eval = [&](const string& name, const string& source) {
+      auto program = parse(sources.emplace_back(source), cerr);
+      const auto& expr = *program->root;
+      runner.run(name,
+                 [&] { bench::do_not_optimize(interpreter.run(expr)); });
+    };
+    bench_eval("infix/long", "1 + 2 - 3 + 4 - 5");
+    bench_eval("infix/promote", "9223372036854775807 + 1 - 1");
+    bench_eval("condition/long", "1 < 2");
+    bench_eval("condition/bigint", "9223372036854775807 + 1 < 1");
+
+    auto fib = parse(
+        sources.emplace_back("def fib(x)\n  x < 2 ? 1 : fib(x - 2) + fib(x - 1)"),
+        cerr);
+    interpreter.run(*fib->root);
+    bench_eval("fib/20", "fib(20)");
+  }
+
+  // Global lookups among 100k definitions: in a map, as without an index,
+  // through the perfect hash of the program's names in the outermost
+  // environment, and in a published snapshot. Lookups go through the names
+  // in a shuffled order, so that they miss the cache as a large program
+  // would.
+  {
+    const size_t n = 100000;
+    auto source = definitions(n);
+    auto program = parse(source, cerr);
+    vector<string_view> names;
+    for (auto node : program->root->nodes) {
+      names.push_back(node->nodes[0]->token);
+    }
+    runner.run("globals/index/definitions=100000",
+               [&] { bench::do_not_optimize(PerfectHash(names)); });
+
+    Interpreter mapped(null_out);
+    mapped.run(*program->root);
+    Interpreter indexed(null_out);
+    indexed.run(*program);
+    Globals globals(Environment::builtins());
+    Interpreter loader(globals);
+    loader.run(*program);
+    loader.publish();
+    auto snapshot = globals.pin();
+
+    shuffle(names.begin(), names.end(), mt19937_64(42));
+    size_t i = 0;
+    auto next = [&] { return names[i++ % n]; };
+    runner.run("globals/map/definitions=100000", [&] {
+      bench::do_not_optimize(mapped.env()->get_value(next()));
+    });
+    runner.run("globals/perfect_hash/definitions=100000", [&] {
+      bench::do_not_optimize(indexed.env()->get_value(next()));
+    });
+    runner.run("globals/snapshot/definitions=100000",
+               [&] { bench::do_not_optimize(snapshot->find(next())); });
+  }
+
+  runner.print_json(cout);
+  return 0;
+}
@@ -0,0 +1,147 @@
+//
+//  Nesting benchmark: parsing and running deeply nested programs
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include "bench/bench.h"
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+// Programs nested `depth` levels deep, with the value they print
+vector<tuple<const char*, function<string(size_t)>, function<string(size_t)>>>
+    shapes = {
+        {"parens",
+         [](size_t n) {
+           return "puts(" + string(n, '(') + "1" + string(n, ')') + ")\n";
+         },
+         [](size_t) { return "1"s; }},
+        {"calls",
+         [](size_t n) {
+           string s = "def f(x) x + 1\nputs(";
+           for (size_t i = 0; i < n; i++) {
+             s += "f(";
+           }
+           return s + "0" + string(n, ')') + ")\n";
+         },
+         [](size_t n) { return to_string(n); }},
+        {"ternary",
+         [](size_t n) {
+           string s = "puts(";
+           for (size_t i = 0; i < n; i++) {
+             s += "0 < 1 ? ";
+           }
+           s += "7";
+           for (size_t i = 0; i < n; i++) {
+             s += " : 0";
+           }
+           return s + ")\n";
+         },
+         [](size_t) { return "7"s; }},
+        {"infix",
+         [](size_t n) {
+           string s = "puts(";
+           for (size_t i = 0; i < n; i++) {
+             s += "1 + (";
+           }
+           return s + "1" + string(n, ')') + ")\n";
+         },
+         [](size_t n) { return to_string(n + 1); }},
+        {"for",
+         [](size_t n) {
+           string s;
+           for (size_t i = 0; i < n; i++) {
+             s += "for i from 1 to 1 ";
+           }
+           return s + "puts(i)\n";
+         },
+         [](size_t) { return "1"s; }},
+};
+
+int main(int argc, const char** argv) {
+  vector<size_t> depths = {1000, 10000, 100000, 1000000};
+  size_t samples = 3;
+  string write_dir;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 8) == "--depth=") {
+      depths = {stoul(string(arg.substr(8)))};
+    } else if (arg.substr(0, 10) == "--samples=") {
+      samples = stoul(string(arg.substr(10)));
+    } else if (arg.substr(0, 8) == "--write=") {
+      write_dir = arg.substr(8);
+    } else {
+      cerr << "usage: nesting [--depth=N] [--samples=N] [--write=dir]"
+           << endl;
+      return -1;
+    }
+  }
+
+  // `--write=dir` only writes the generated programs, to run them with ./fib
+  if (!write_dir.empty()) {
+    for (const auto& [name, generate, expected] : shapes) {
+      for (auto depth : depths) {
+        auto path = write_dir + "/" + name + "-" + to_string(depth) + ".fib";
+        ofstream(path) << generate(depth);
+        cerr << path << endl;
+      }
+    }
+    return 0;
+  }
+
+  cout << "{" << endl
+       << "  \"stack_per_level\": " << stack_per_level << "," << endl
+       << "  \"results\": [" << endl;
+
+  auto first = true;
+  for (const auto& [name, generate, expected] : shapes) {
+    for (auto depth : depths) {
+      auto source = generate(depth);
+
+      vector<double> parse_time, run_time;
+      size_t nesting = 0;
+      auto ok = true;
+      for (size_t i = 0; i < samples; i++) {
+        ostringstream log;
+        auto start = bench::now();
+        auto program = parse(source, log);
+        parse_time.push_back(bench::now() - start);
+        if (!program) {
+          cerr << name << " " << depth << ": " << log.str();
+          return -2;
+        }
+        nesting = program->depth;
+
+        ostringstream out;
+        start = bench::now();
+        with_stack(program->depth, [&] {
+          Interpreter interpreter(out);
+          interpreter.run(*program->root);
+        });
+        run_time.push_back(bench::now() - start);
+        ok = ok && out.str() == expected(depth) + "\n";
+      }
+
+      auto p = bench::summarize(parse_time, 1);
+      auto r = bench::summarize(run_time, 1);
+      cerr << name << " " << depth << ": parse " << p.median << " s, run "
+           << r.median << " s" << (ok ? "" : " (WRONG)") << endl;
+
+      cout << (first ? "" : ",\n") << "    {\"shape\": \"" << name
+           << "\", \"depth\": " << depth << ", \"tree_height\": " << nesting
+           << ", \"bytes\": " << source.size()
+           << ", \"verified\": " << (ok ? "true" : "false") << ", ";
+      bench::print_json(cout, "parse", p, "s");
+      cout << ", ";
+      bench::print_json(cout, "run", r, "s");
+      cout << "}";
+      first = false;
+    }
+  }
+  cout << endl << "  ]" << endl << "}" << endl;
+  return 0;
+}
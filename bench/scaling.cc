@@ -0,0 +1,287 @@
+//
+//  Parallel scaling benchmark
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+
+#include "bench/bench.h"
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+//-----------------------------------------------------------------------------
+// CPU topology
+//-----------------------------------------------------------------------------
+
+string read_line(const string& path) {
+  ifstream f{path};
+  string s;
+  getline(f, s);
+  return s;
+}
+
+// The process's Topology plus the hardware behind it
+struct Machine {
+  string model;
+  size_t hardware_concurrency = thread::hardware_concurrency();
+  set<string> packages;
+  set<string> cores;
+
+  Machine() {
+    ifstream cpuinfo{"/proc/cpuinfo"};
+    for (string line; getline(cpuinfo, line);) {
+      if (line.substr(0, 10) == "model name") {
+        model = line.substr(line.find(':') + 2);
+        break;
+      }
+    }
+
+    for (auto cpu : topology().online) {
+      auto dir = "/sys/devices/system/cpu/cpu" + to_string(cpu) + "/topology/";
+      auto package = read_line(dir + "physical_package_id");
+      if (package.empty()) {
+        continue;
+      }
+      packages.insert(package);
+      cores.insert(package + ":" + read_line(dir + "core_id"));
+    }
+  }
+
+  void print_json(ostream& out) const {
+    const auto& t = topology();
+    out << "\"topology\": {\"model\": \"" << bench::json_escape(model)
+        << "\", \"online\": \"" << format_cpulist(t.online)
+        << "\", \"hardware_concurrency\": " << hardware_concurrency
+        << ", \"affinity\": " << t.cpus.size()
+        << ", \"cgroup_quota\": " << t.quota
+        << ", \"concurrency\": " << t.concurrency()
+        << ", \"packages\": " << packages.size()
+        << ", \"cores\": " << cores.size() << ", \"numa_nodes\": [";
+    for (size_t i = 0; i < t.nodes.size(); i++) {
+      out << (i ? ", " : "") << "\"" << format_cpulist(t.nodes[i]) << "\"";
+    }
+    out << "]}";
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Workloads
+//-----------------------------------------------------------------------------
+
+// A program made of definitions followed by a single top-level FOR loop whose
+// iterations are independent of each other.
+struct Workload {
+  string name;
+  string definitions;
+  string body;
+  long iterations;  // per thread in weak scaling
+
+  string source(long n) const {
+    return definitions + "\nfor i from 1 to " + to_string(n) + "\n  " + body;
+  }
+};
+
+double thread_cpu_time() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct Run {
+  double wall = 0;
+  vector<double> cpu;  // per thread
+  size_t versions = 0;  // globals published while the threads ran
+};
+
+// Placement of the threads of run_parallel()
+Affinity affinity = Affinity::none;
+
+// Loads the definitions into shared globals once, then hands out blocks of
+// loop iterations to `threads` threads, placed on CPUs by --affinity. Each
+// thread reads the globals through its own pinned snapshot. With `publish`,
+// this thread keeps publishing new versions meanwhile.
+Run run_parallel(const Node& ast, size_t threads, bool publish) {
+  Globals globals(Environment::builtins());
+  Interpreter loader(globals);
+  for (size_t i = 0; i + 1 < ast.nodes.size(); i++) {
+    loader.run(*ast.nodes[i]);
+  }
+  loader.publish();
+
+  const auto& loop = *ast.nodes.back();
+  auto ident = loop.nodes[0]->token;
+  auto from = loop.nodes[1]->token_to_number<long>();
+  auto to = loop.nodes[2]->token_to_number<long>();
+  const auto& body = *loop.nodes[3];
+
+  auto block = max(1L, (to - from + 1) / long(threads * 16));
+  atomic<long> next{from};
+  atomic<size_t> done{0};
+
+  Run run;
+  run.cpu.resize(threads);
+
+  auto start = bench::now();
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      auto pin = affinity_cpu(topology(), affinity, t);
+      if (pin >= 0) {
+        pin_to_cpu(pin);
+      }
+      auto cpu = thread_cpu_time();
+      Interpreter interpreter(globals);
+      for (;;) {
+        auto first = next.fetch_add(block);
+        if (first > to) {
+          break;
+        }
+        auto last = min(to, first + block - 1);
+        for (auto i = first; i <= last; i++) {
+          auto call_env = make_rc<Environment>(interpreter.env());
+          call_env->set_value(ident, Value(i));
+          eval(body, call_env);
+        }
+      }
+      run.cpu[t] = thread_cpu_time() - cpu;
+      done++;
+    });
+  }
+  while (publish && done < threads) {
+    globals.publish({{"version"sv, Value(long(run.versions++))}});
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  run.wall = bench::now() - start;
+  return run;
+}
+
+double run_sequential(const Node& ast) {
+  Interpreter interpreter;
+  auto start = bench::now();
+  interpreter.run(ast);
+  return bench::now() - start;
+}
+
+int main(int argc, const char** argv) {
+  size_t samples = 5;
+  size_t max_threads = topology().concurrency();
+  auto scale = 1.0;
+  auto publish = false;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 10) == "--samples=") {
+      samples = stoul(string(arg.substr(10)));
+    } else if (arg.substr(0, 14) == "--max-threads=") {
+      max_threads = stoul(string(arg.substr(14)));
+    } else if (arg.substr(0, 8) == "--scale=") {
+      scale = stod(string(arg.substr(8)));
+    } else if (arg == "--publish") {
+      publish = true;
+    } else if (arg.substr(0, 11) == "--affinity=") {
+      if (!parse_affinity(arg.substr(11), affinity)) {
+        cerr << "--affinity must be none, compact or scatter." << endl;
+        return -1;
+      }
+    } else {
+      cerr << "usage: scaling [--samples=N] [--max-threads=N] [--scale=X] "
+              "[--affinity=none|compact|scatter] [--publish]"
+           << endl;
+      return -1;
+    }
+  }
+
+  vector<size_t> thread_counts;
+  for (size_t t = 1; t < max_threads; t *= 2) {
+    thread_counts.push_back(t);
+  }
+  thread_counts.push_back(max(max_threads, size_t(1)));
+
+  auto fib = "def fib(x)\n  x < 2 ? 1 : fib(x - 2) + fib(x - 1)"s;
+  vector<Workload> workloads = {
+      {"wide-for", fib, "fib(5) + i", long(20000 * scale)},
+      {"deep-recursion", fib, "fib(22)", long(8 * scale)},
+  };
+
+  Machine machine;
+
+  cout << "{" << endl << "  ";
+  machine.print_json(cout);
+  cout << "," << endl
+       << "  \"publish\": " << (publish ? "true" : "false") << "," << endl
+       << "  \"results\": [" << endl;
+
+  auto first = true;
+  for (const auto& w : workloads) {
+    for (auto weak : {false, true}) {
+      auto mode = weak ? "weak" : "strong";
+      auto total_1 = w.iterations * long(weak ? 1 : max_threads);
+
+      // Sequential eval() of the single-thread problem size
+      auto baseline_source = w.source(total_1);
+      auto baseline_program = parse(baseline_source, cerr);
+      vector<double> seq;
+      for (size_t i = 0; i < samples; i++) {
+        seq.push_back(run_sequential(*baseline_program->root));
+      }
+      auto baseline = bench::summarize(seq, 1);
+
+      for (auto threads : thread_counts) {
+        auto total = weak ? w.iterations * long(threads) : total_1;
+        auto source = w.source(total);
+        auto program = parse(source, cerr);
+
+        vector<double> walls;
+        vector<double> utilization(threads);
+        size_t versions = 0;
+        for (size_t i = 0; i < samples; i++) {
+          auto run = run_parallel(*program->root, threads, publish);
+          walls.push_back(run.wall);
+          versions += run.versions;
+          for (size_t t = 0; t < threads; t++) {
+            utilization[t] += run.cpu[t] / run.wall / samples;
+          }
+        }
+        auto s = bench::summarize(walls, 1);
+
+        // Weak scaling keeps the work per thread constant, so the ideal
+        // time stays at the baseline.
+        auto speedup = baseline.median / s.median * (weak ? threads : 1);
+        auto efficiency = speedup / threads;
+
+        cerr << w.name << " " << mode << " threads=" << threads
+             << ": speedup " << speedup << ", efficiency " << efficiency
+             << endl;
+
+        cout << (first ? "" : ",\n") << "    {\"workload\": \"" << w.name
+             << "\", \"mode\": \"" << mode << "\", \"threads\": " << threads
+             << ", \"iterations\": " << total << ", ";
+        bench::print_json(cout, "baseline", baseline, "s");
+        cout << ", ";
+        bench::print_json(cout, "time", s, "s");
+        cout << ", \"versions_published\": " << versions
+             << ", \"speedup\": " << speedup
+             << ", \"efficiency\": " << efficiency << ", \"utilization\": [";
+        for (size_t t = 0; t < threads; t++) {
+          cout << (t ? ", " : "") << utilization[t];
+        }
+        cout << "]}";
+        first = false;
+      }
+    }
+  }
+  cout << endl << "  ]" << endl << "}" << endl;
+  return 0;
+}
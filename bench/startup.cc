@@ -0,0 +1,211 @@
+//
+//  Startup latency benchmark
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include "bench/bench.h"
+
+using namespace std;
+
+extern char** environ;
+
+long monotonic_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+struct Sample {
+  long spawn = 0;
+  long first_byte = 0;  // first byte on the child's stdout
+  long exit = 0;
+  map<string, long> marks;  // reported by `fib --timing`
+};
+
+string read_all(int fd) {
+  string s;
+  char buf[4096];
+  for (;;) {
+    auto n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    s.append(buf, n);
+  }
+  return s;
+}
+
+bool run_once(const string& fib, const string& script, const string& flag,
+              Sample& sample) {
+  int out[2], err[2];
+  if (pipe(out) || pipe(err)) {
+    return false;
+  }
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+  posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+  posix_spawn_file_actions_addclose(&actions, out[0]);
+  posix_spawn_file_actions_addclose(&actions, err[0]);
+
+  vector<const char*> argv = {fib.c_str(), "--timing"};
+  if (!flag.empty()) {
+    argv.push_back(flag.c_str());
+  }
+  argv.push_back(script.c_str());
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  sample.spawn = monotonic_ns();
+  auto ret = posix_spawn(&pid, fib.c_str(), &actions, nullptr,
+                         const_cast<char**>(argv.data()), environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(out[1]);
+  close(err[1]);
+  if (ret) {
+    close(out[0]);
+    close(err[0]);
+    return false;
+  }
+
+  pollfd pfd{out[0], POLLIN, 0};
+  if (poll(&pfd, 1, -1) > 0) {
+    sample.first_byte = monotonic_ns();
+  }
+  read_all(out[0]);
+  auto timing = read_all(err[0]);
+  close(out[0]);
+  close(err[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  sample.exit = monotonic_ns();
+
+  istringstream ss(timing);
+  for (string line; getline(ss, line);) {
+    istringstream ls(line);
+    string tag, phase;
+    long ns;
+    if (ls >> tag >> phase >> ns && tag == "timing") {
+      sample.marks[phase] = ns;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// `n` definitions like fib, of which the script only calls one
+string library(size_t n) {
+  string s;
+  for (size_t i = 0; i < n; i++) {
+    auto name = "f" + to_string(i);
+    s += "def " + name + "(x)\n  x < 2 ? 1 : " + name + "(x - 2) + " + name +
+         "(x - 1)\n";
+  }
+  return s + "for n from 1 to 10\n  puts(f7(n))\n";
+}
+
+int main(int argc, const char** argv) {
+  auto fib = "./fib"s;
+  size_t runs = 300;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg.substr(0, 6) == "--fib=") {
+      fib = arg.substr(6);
+    } else if (arg.substr(0, 7) == "--runs=") {
+      runs = stoul(string(arg.substr(7)));
+    } else {
+      cerr << "usage: startup [--fib=path] [--runs=N]" << endl;
+      return -1;
+    }
+  }
+
+  // Name, source and flag. The library is parsed and compiled in full, and
+  // then lazily, parsing only the body it calls.
+  vector<tuple<string, string, string>> scripts = {
+      {"puts", "puts(1)\n", ""},
+      {"fib10",
+       "def fib(x)\n  x < 2 ? 1 : fib(x - 2) + fib(x - 1)\n\n"
+       "for n from 1 to 10\n  puts(fib(n))\n",
+       ""},
+      {"library", library(5000), ""},
+      {"library_lazy", library(5000), "--lazy"},
+  };
+
+  // Intervals between consecutive timestamps, in the order they happen
+  vector<tuple<const char*, const char*, const char*>> phases = {
+      {"exec", "spawn", "start"},  // fork/exec and dynamic loading
+      {"static_init", "start", "main"},  // static initializers (iostream, ...)
+      {"read", "main", "read"},
+      {"parse", "read", "parse"},
+      {"analyze", "parse", "analyze"},
+      {"compile", "analyze", "compile"},
+      {"builtins", "compile", "builtins"},
+      {"first_output", "builtins", "first_output"},
+      {"teardown", "exit", "reaped"},
+  };
+
+  cout << "{" << endl << "  \"runs\": " << runs << "," << endl
+       << "  \"scripts\": [" << endl;
+
+  for (size_t k = 0; k < scripts.size(); k++) {
+    const auto& [name, source, flag] = scripts[k];
+
+    auto path = "/tmp/fib-startup-" + to_string(getpid()) + "-" + name + ".fib";
+    ofstream(path) << source;
+
+    map<string, vector<double>> us;
+    vector<double> ttfo, total;
+    for (size_t i = 0; i < runs; i++) {
+      Sample s;
+      if (!run_once(fib, path, flag, s)) {
+        cerr << "failed to run '" << fib << "'." << endl;
+        unlink(path.c_str());
+        return -2;
+      }
+      s.marks["spawn"] = s.spawn;
+      s.marks["reaped"] = s.exit;
+
+      ttfo.push_back((s.first_byte - s.spawn) / 1e3);
+      total.push_back((s.exit - s.spawn) / 1e3);
+      for (const auto& [phase, from, to] : phases) {
+        if (s.marks.count(from) && s.marks.count(to)) {
+          us[phase].push_back((s.marks[to] - s.marks[from]) / 1e3);
+        }
+      }
+    }
+    unlink(path.c_str());
+
+    auto t = bench::summarize(ttfo, 1);
+    cerr << name << ": time to first output " << t.median << " us, total "
+         << bench::median(total) << " us" << endl;
+
+    cout << "    {\"name\": \"" << name << "\", ";
+    bench::print_json(cout, "time_to_first_output", t, "us");
+    cout << ", ";
+    bench::print_json(cout, "total", bench::summarize(total, 1), "us");
+    cout << ", \"phases\": {";
+    auto first = true;
+    for (const auto& [phase, from, to] : phases) {
+      cout << (first ? "" : ", ");
+      bench::print_json(cout, phase, bench::summarize(us[phase], 1), "us");
+      first = false;
+    }
+    cout << "}}" << (k + 1 < scripts.size() ? "," : "") << endl;
+  }
+
+  cout << "  ]" << endl << "}" << endl;
+  return 0;
+}
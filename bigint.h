@@ -0,0 +1,1113 @@
+//
+//  bigint.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "threads.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace fiblang {
+
+//-----------------------------------------------------------------------------
+// Limb kernels
+//-----------------------------------------------------------------------------
+
+namespace bigint {
+
+using Limb = uint64_t;
+using Limbs = std::vector<Limb>;
+using u128 = unsigned __int128;
+
+// Operand sizes (in limbs) at which multiplication switches algorithms
+inline size_t karatsuba_threshold = 48;
+inline size_t ntt_threshold = 1536;
+
+// Operand sizes (in limbs) from which work is split across threads
+inline size_t parallel_add_threshold = size_t(1) << 18;
+inline size_t parallel_mul_threshold = size_t(1) << 14;
+inline size_t parallel_str_threshold = size_t(1) << 12;
+
+// Size (in limbs) below which decimal conversion divides by 10^19 repeatedly
+inline size_t dc_str_threshold = 64;
+
+// Divisor size (in limbs) from which division uses a Newton reciprocal
+inline size_t newton_threshold = 128;
+
+inline void trim(Limbs& a) {
+  while (!a.empty() && a.back() == 0) {
+    a.pop_back();
+  }
+}
+
+inline int compare(const Limb* a, size_t na, const Limb* b, size_t nb) {
+  if (na != nb) {
+    return na < nb ? -1 : 1;
+  }
+  for (auto i = na; i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+// r[0..n) = a[0..n) +/- b[0..n) + carry, returns the carry (borrow) out.
+// On x86-64 this compiles to an adc / sbb chain.
+template <bool Sub>
+inline Limb add_n_scalar(Limb* r, const Limb* a, const Limb* b, size_t n,
+                         Limb carry = 0) {
+#if defined(__x86_64__)
+  auto c = static_cast<unsigned char>(carry);
+  for (size_t i = 0; i < n; i++) {
+    unsigned long long x;
+    c = Sub ? _subborrow_u64(c, a[i], b[i], &x)
+            : _addcarry_u64(c, a[i], b[i], &x);
+    r[i] = x;
+  }
+  return c;
+#else
+  for (size_t i = 0; i < n; i++) {
+    auto x = Sub ? u128(a[i]) - b[i] - carry : u128(a[i]) + b[i] + carry;
+    r[i] = Limb(x);
+    carry = Limb(x >> 64) & 1;
+  }
+  return carry;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Vectorized addition
+//-----------------------------------------------------------------------------
+
+// A block of lanes is added without carries first. Lane i generates a carry
+// (bit i of g) when its sum wrapped, and propagates one (bit i of p) when its
+// sum is all ones. With carry in c, the lanes receiving a carry are
+//   ((g << 1 | c) + p) ^ p
+// and bit `lanes` of the sum is the carry out of the block. Subtraction is
+// the same with borrows and all-zero differences.
+
+enum class Simd { None, Avx2, Avx512 };
+
+inline Simd detect_simd() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return Simd::Avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return Simd::Avx2;
+  }
+#endif
+  return Simd::None;
+}
+
+// Instruction set used by add_n and sub_n
+inline Simd simd = detect_simd();
+
+// Size (in limbs) from which add_n and sub_n use vector instructions
+inline size_t simd_threshold = 16;
+
+#if defined(__x86_64__)
+template <bool Sub>
+__attribute__((target("avx2"))) inline Limb add_n_avx2(Limb* r, const Limb* a,
+                                                       const Limb* b,
+                                                       size_t n) {
+  const auto sign = _mm256_set1_epi64x(INT64_MIN);
+  const auto rest = _mm256_set1_epi64x(Sub ? 0 : -1);
+  const auto lanes = _mm256_setr_epi64x(1, 2, 4, 8);
+  unsigned carry = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    auto x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    auto y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    auto s = Sub ? _mm256_sub_epi64(x, y) : _mm256_add_epi64(x, y);
+
+    // Unsigned comparisons by flipping the sign bits
+    auto xs = _mm256_xor_si256(x, sign);
+    auto g = Sub ? _mm256_cmpgt_epi64(_mm256_xor_si256(y, sign), xs)
+                 : _mm256_cmpgt_epi64(xs, _mm256_xor_si256(s, sign));
+    auto p = _mm256_cmpeq_epi64(s, rest);
+    unsigned gm = _mm256_movemask_pd(_mm256_castsi256_pd(g));
+    unsigned pm = _mm256_movemask_pd(_mm256_castsi256_pd(p));
+    auto c = ((gm << 1) | carry) + pm;
+    carry = c >> 4;
+
+    // All ones in the lanes receiving a carry
+    auto cm = _mm256_set1_epi64x((c ^ pm) & 0xf);
+    auto m = _mm256_cmpeq_epi64(_mm256_and_si256(cm, lanes), lanes);
+    s = Sub ? _mm256_add_epi64(s, m) : _mm256_sub_epi64(s, m);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + i), s);
+  }
+  return add_n_scalar<Sub>(r + i, a + i, b + i, n - i, carry);
+}
+
+template <bool Sub>
+__attribute__((target("avx512f"))) inline Limb add_n_avx512(Limb* r,
+                                                           const Limb* a,
+                                                           const Limb* b,
+                                                           size_t n) {
+  const auto rest = _mm512_set1_epi64(Sub ? 0 : -1);
+  const auto one = _mm512_set1_epi64(1);
+  unsigned carry = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    auto x = _mm512_loadu_si512(a + i);
+    auto y = _mm512_loadu_si512(b + i);
+    auto s = Sub ? _mm512_sub_epi64(x, y) : _mm512_add_epi64(x, y);
+
+    unsigned g = Sub ? _mm512_cmplt_epu64_mask(x, y)
+                     : _mm512_cmplt_epu64_mask(s, x);
+    unsigned p = _mm512_cmpeq_epu64_mask(s, rest);
+    auto c = ((g << 1) | carry) + p;
+    carry = c >> 8;
+
+    auto cm = static_cast<__mmask8>(c ^ p);
+    s = Sub ? _mm512_mask_sub_epi64(s, cm, s, one)
+            : _mm512_mask_add_epi64(s, cm, s, one);
+    _mm512_storeu_si512(r + i, s);
+  }
+  return add_n_scalar<Sub>(r + i, a + i, b + i, n - i, carry);
+}
+#endif
+
+template <bool Sub>
+inline Limb add_n_dispatch(Limb* r, const Limb* a, const Limb* b, size_t n) {
+#if defined(__x86_64__)
+  if (n >= simd_threshold) {
+    switch (simd) {
+      case Simd::Avx512:
+        return add_n_avx512<Sub>(r, a, b, n);
+      case Simd::Avx2:
+        return add_n_avx2<Sub>(r, a, b, n);
+      default:
+        break;
+    }
+  }
+#endif
+  return add_n_scalar<Sub>(r, a, b, n);
+}
+
+// r[0..n) = a[0..n) + b[0..n), returns the carry
+inline Limb add_n(Limb* r, const Limb* a, const Limb* b, size_t n) {
+  return add_n_dispatch<false>(r, a, b, n);
+}
+
+// r[0..n) = a[0..n) - b[0..n), returns the borrow
+inline Limb sub_n(Limb* r, const Limb* a, const Limb* b, size_t n) {
+  return add_n_dispatch<true>(r, a, b, n);
+}
+
+// r[0..n) = a[0..n) + carry, returns the carry out
+inline Limb add_1(Limb* r, const Limb* a, size_t n, Limb carry) {
+  for (size_t i = 0; i < n; i++) {
+    r[i] = a[i] + carry;
+    carry = r[i] < carry;
+  }
+  return carry;
+}
+
+// r[0..n) = a[0..n) - borrow, returns the borrow out
+inline Limb sub_1(Limb* r, const Limb* a, size_t n, Limb borrow) {
+  for (size_t i = 0; i < n; i++) {
+    auto x = a[i];
+    r[i] = x - borrow;
+    borrow = x < borrow;
+  }
+  return borrow;
+}
+
+//-----------------------------------------------------------------------------
+// Threads
+//-----------------------------------------------------------------------------
+
+// Threads that big integer operations of the calling thread may use in
+// total, or 0 for the CPUs that the affinity mask and the cgroup quota of the
+// process leave to it, detected on first use to keep it out of the startup
+// time, and the pool their workers come from. Both are set per thread, so
+// threads running with different settings don't see each other's, and pass
+// to the tasks of a parallel_for().
+inline thread_local size_t threads = 0;
+inline thread_local Affinity affinity = Affinity::none;
+
+inline size_t thread_count() {
+  return threads ? threads : topology().concurrency();
+}
+
+// Runs f(0) ... f(n - 1) on the calling thread and up to
+// thread_count() - 1 workers of the pool of `affinity`.
+template <typename F>
+void parallel_for(size_t n, F&& f) {
+  auto helpers = thread_count() - 1;
+  auto& workers = pool(affinity);
+  workers.reserve(helpers);
+  auto count = threads;
+  auto placed = affinity;
+  workers.parallel_for(n, helpers, [&](size_t i) {
+    auto saved_threads = threads;
+    auto saved_affinity = affinity;
+    threads = count;
+    affinity = placed;
+    f(i);
+    threads = saved_threads;
+    affinity = saved_affinity;
+  });
+}
+
+// Block carry-lookahead: every block is added with no carry in, then the
+// carries between blocks are resolved from each block's carry out and whether
+// it is all ones (propagates a carry), and the blocks that receive a carry
+// are fixed up in parallel. `Sub` selects subtraction, where an all-zero
+// block propagates a borrow.
+template <bool Sub>
+inline Limb add_n_parallel(Limb* r, const Limb* a, const Limb* b, size_t n) {
+  auto k = std::min(thread_count(), n / (parallel_add_threshold / 4) + 1);
+  auto block = (n + k - 1) / k;
+  std::vector<Limb> carry(k);
+  std::vector<Limb> propagate(k);  // not vector<bool>: set concurrently
+
+  parallel_for(k, [&](size_t i) {
+    auto lo = i * block, len = std::min(block, n - lo);
+    carry[i] = Sub ? sub_n(r + lo, a + lo, b + lo, len)
+                   : add_n(r + lo, a + lo, b + lo, len);
+    auto rest = Sub ? Limb(0) : ~Limb(0);
+    propagate[i] =
+        std::all_of(r + lo, r + lo + len, [=](Limb x) { return x == rest; });
+  });
+
+  std::vector<Limb> carry_in(k);
+  Limb c = 0;
+  for (size_t i = 0; i < k; i++) {
+    carry_in[i] = c;
+    c = carry[i] | (propagate[i] & c);
+  }
+
+  parallel_for(k, [&](size_t i) {
+    auto lo = i * block, len = std::min(block, n - lo);
+    if (carry_in[i]) {
+      Sub ? sub_1(r + lo, r + lo, len, 1) : add_1(r + lo, r + lo, len, 1);
+    }
+  });
+  return c;
+}
+
+inline Limbs add(const Limb* a, size_t na, const Limb* b, size_t nb) {
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  Limbs r(na + 1);
+  auto carry = nb >= parallel_add_threshold && thread_count() > 1
+                   ? add_n_parallel<false>(r.data(), a, b, nb)
+                   : add_n(r.data(), a, b, nb);
+  r[na] = add_1(r.data() + nb, a + nb, na - nb, carry);
+  trim(r);
+  return r;
+}
+
+// Requires a >= b
+inline Limbs sub(const Limb* a, size_t na, const Limb* b, size_t nb) {
+  Limbs r(na);
+  auto borrow = nb >= parallel_add_threshold && thread_count() > 1
+                    ? add_n_parallel<true>(r.data(), a, b, nb)
+                    : sub_n(r.data(), a, b, nb);
+  sub_1(r.data() + nb, a + nb, na - nb, borrow);
+  trim(r);
+  return r;
+}
+
+// r[0..) += a[0..na), the carry ripples as far as needed
+inline void add_into(Limb* r, const Limb* a, size_t na) {
+  auto carry = add_n(r, r, a, na);
+  for (auto p = r + na; carry; p++) {
+    *p += 1;
+    carry = *p == 0;
+  }
+}
+
+// r[0..) -= a[0..na), requires the result to be non-negative
+inline void sub_into(Limb* r, const Limb* a, size_t na) {
+  auto borrow = sub_n(r, r, a, na);
+  for (auto p = r + na; borrow; p++) {
+    borrow = *p == 0;
+    *p -= 1;
+  }
+}
+
+// a = a * m + c
+inline void mul_1_add(Limbs& a, Limb m, Limb c) {
+  for (auto& x : a) {
+    auto p = u128(x) * m + c;
+    x = Limb(p);
+    c = Limb(p >> 64);
+  }
+  if (c) {
+    a.push_back(c);
+  }
+}
+
+// a = a / d, returns the remainder
+inline Limb div_1(Limbs& a, Limb d) {
+  u128 rem = 0;
+  for (auto i = a.size(); i-- > 0;) {
+    auto cur = (rem << 64) | a[i];
+    a[i] = Limb(cur / d);
+    rem = cur % d;
+  }
+  trim(a);
+  return Limb(rem);
+}
+
+//-----------------------------------------------------------------------------
+// Number-theoretic transform
+//-----------------------------------------------------------------------------
+
+constexpr uint32_t pow_mod(uint64_t a, uint64_t e, uint32_t mod) {
+  uint64_t r = 1;
+  a %= mod;
+  while (e) {
+    if (e & 1) {
+      r = r * a % mod;
+    }
+    a = a * a % mod;
+    e >>= 1;
+  }
+  return uint32_t(r);
+}
+
+// Transforms modulo a prime `Mod` = c * 2^k + 1 with primitive root `G`.
+template <uint32_t Mod, uint32_t G>
+struct Ntt {
+  static constexpr uint32_t mod = Mod;
+
+  // roots[k + j] = w^j for the 2k-th root of unity w, k = 1, 2, 4, ...
+  static std::vector<uint32_t> roots(size_t n) {
+    std::vector<uint32_t> rt(std::max<size_t>(n, 2), 1);
+    for (size_t k = 2, s = 2; k < n; k *= 2, s++) {
+      uint64_t z = pow_mod(G, (Mod - 1) >> s, Mod);
+      for (auto i = k; i < 2 * k; i++) {
+        rt[i] = i & 1 ? rt[i / 2] * z % Mod : rt[i / 2];
+      }
+    }
+    return rt;
+  }
+
+  static void transform(std::vector<uint32_t>& a,
+                        const std::vector<uint32_t>& rt) {
+    auto n = a.size();
+    for (size_t i = 1, j = 0; i < n; i++) {
+      auto bit = n >> 1;
+      for (; j & bit; bit >>= 1) {
+        j ^= bit;
+      }
+      j ^= bit;
+      if (i < j) {
+        std::swap(a[i], a[j]);
+      }
+    }
+    for (size_t k = 1; k < n; k *= 2) {
+      for (size_t i = 0; i < n; i += 2 * k) {
+        for (size_t j = 0; j < k; j++) {
+          auto z = uint32_t(uint64_t(rt[j + k]) * a[i + j + k] % Mod);
+          auto& ai = a[i + j];
+          a[i + j + k] = ai >= z ? ai - z : ai + Mod - z;
+          ai = ai + z >= Mod ? ai + z - Mod : ai + z;
+        }
+      }
+    }
+  }
+
+  // Cyclic convolution of `a` and `b`, both already padded to size n
+  static std::vector<uint32_t> convolve(std::vector<uint32_t> a,
+                                        std::vector<uint32_t> b,
+                                        bool square) {
+    auto n = a.size();
+    auto rt = roots(n);
+    transform(a, rt);
+    if (!square) {
+      transform(b, rt);
+    }
+    const auto& fb = square ? a : b;
+
+    uint64_t inv = pow_mod(n, Mod - 2, Mod);
+    std::vector<uint32_t> out(n);
+    for (size_t i = 0; i < n; i++) {
+      out[-i & (n - 1)] = uint32_t(uint64_t(a[i]) * fb[i] % Mod * inv % Mod);
+    }
+    transform(out, rt);
+    return out;
+  }
+};
+
+using Ntt1 = Ntt<998244353, 3>;  // 119 * 2^23 + 1
+using Ntt2 = Ntt<167772161, 3>;  // 5 * 2^25 + 1
+using Ntt3 = Ntt<469762049, 3>;  // 7 * 2^26 + 1
+
+// Operands are split into 16-bit digits, so each convolution coefficient is
+// below n * 2^32 <= 2^55, well within the ~2^86 range of the three primes.
+constexpr size_t digit_bits = 16;
+constexpr size_t max_ntt_size = size_t(1) << 23;
+
+inline size_t ntt_size(size_t na, size_t nb) {
+  auto digits = (na + nb) * (64 / digit_bits);
+  size_t n = 1;
+  while (n < digits) {
+    n *= 2;
+  }
+  return n;
+}
+
+inline std::vector<uint32_t> to_digits(const Limb* a, size_t na, size_t n) {
+  std::vector<uint32_t> d(n);
+  for (size_t i = 0; i < na; i++) {
+    for (size_t j = 0; j < 64 / digit_bits; j++) {
+      d[i * 4 + j] = uint32_t(a[i] >> (j * digit_bits)) & 0xffff;
+    }
+  }
+  return d;
+}
+
+// Combines residues modulo the three primes with the Chinese remainder
+// theorem and propagates the carries into 64-bit limbs.
+inline Limbs from_residues(const std::vector<uint32_t>& r1,
+                           const std::vector<uint32_t>& r2,
+                           const std::vector<uint32_t>& r3, size_t nr) {
+  constexpr uint64_t m1 = Ntt1::mod, m2 = Ntt2::mod, m3 = Ntt3::mod;
+  constexpr uint64_t m1_inv_m2 = pow_mod(m1, m2 - 2, m2);
+  constexpr uint64_t m12_inv_m3 = pow_mod(m1 * m2 % m3, m3 - 2, m3);
+  constexpr uint64_t m12 = m1 * m2;
+
+  Limbs r(nr);
+  u128 carry = 0;
+  for (size_t i = 0; i < nr * 4; i++) {
+    auto a = r1[i];
+    auto t1 = (r2[i] + m2 - a % m2) % m2 * m1_inv_m2 % m2;
+    auto x12 = a + m1 * t1;
+    auto t2 = (r3[i] + m3 - x12 % m3) % m3 * m12_inv_m3 % m3;
+    carry += x12 + u128(m12) * t2;
+    r[i / 4] |= Limb(carry & 0xffff) << ((i % 4) * digit_bits);
+    carry >>= digit_bits;
+  }
+  return r;
+}
+
+inline Limbs mul_ntt(const Limb* a, size_t na, const Limb* b, size_t nb) {
+  auto n = ntt_size(na, nb);
+  auto square = a == b && na == nb;
+  auto da = to_digits(a, na, n);
+  auto db = square ? std::vector<uint32_t>() : to_digits(b, nb, n);
+
+  std::vector<uint32_t> r1, r2, r3;
+  auto convolve = [&](size_t i) {
+    switch (i) {
+      case 0:
+        r1 = Ntt1::convolve(da, db, square);
+        break;
+      case 1:
+        r2 = Ntt2::convolve(da, db, square);
+        break;
+      case 2:
+        r3 = Ntt3::convolve(da, db, square);
+        break;
+    }
+  };
+  if (nb >= parallel_mul_threshold && thread_count() > 1) {
+    parallel_for(3, convolve);
+  } else {
+    for (size_t i = 0; i < 3; i++) {
+      convolve(i);
+    }
+  }
+
+  auto r = from_residues(r1, r2, r3, na + nb);
+  trim(r);
+  return r;
+}
+
+//-----------------------------------------------------------------------------
+// Multiplication
+//-----------------------------------------------------------------------------
+
+inline Limbs mul(const Limb* a, size_t na, const Limb* b, size_t nb);
+
+inline Limbs mul_schoolbook(const Limb* a, size_t na, const Limb* b,
+                            size_t nb) {
+  Limbs r(na + nb);
+  for (size_t i = 0; i < na; i++) {
+    Limb carry = 0;
+    for (size_t j = 0; j < nb; j++) {
+      auto p = u128(a[i]) * b[j] + r[i + j] + carry;
+      r[i + j] = Limb(p);
+      carry = Limb(p >> 64);
+    }
+    r[i + nb] = carry;
+  }
+  trim(r);
+  return r;
+}
+
+// Requires na >= nb
+inline Limbs mul_karatsuba(const Limb* a, size_t na, const Limb* b,
+                           size_t nb) {
+  Limbs r(na + nb + 1);
+
+  // Unbalanced operands are multiplied in nb-sized slices of a.
+  if (nb * 2 <= na) {
+    for (size_t i = 0; i < na; i += nb) {
+      auto p = mul(a + i, std::min(nb, na - i), b, nb);
+      add_into(r.data() + i, p.data(), p.size());
+    }
+    trim(r);
+    return r;
+  }
+
+  // a = a1 * B^m + a0, b = b1 * B^m + b0
+  auto m = na / 2;
+  auto na0 = m, nb0 = std::min(m, nb);
+  Limbs z0, z1, z2;
+  auto product = [&](size_t i) {
+    switch (i) {
+      case 0:
+        z0 = mul(a, na0, b, nb0);
+        break;
+      case 1: {
+        auto sa = add(a, na0, a + m, na - m);
+        auto sb = add(b, nb0, b + nb0, nb - nb0);
+        z1 = mul(sa.data(), sa.size(), sb.data(), sb.size());
+        break;
+      }
+      case 2:
+        z2 = mul(a + m, na - m, b + nb0, nb - nb0);
+        break;
+    }
+  };
+  if (nb >= parallel_mul_threshold && thread_count() > 1) {
+    parallel_for(3, product);
+  } else {
+    for (size_t i = 0; i < 3; i++) {
+      product(i);
+    }
+  }
+  sub_into(z1.data(), z0.data(), z0.size());
+  sub_into(z1.data(), z2.data(), z2.size());
+  trim(z1);
+
+  add_into(r.data(), z0.data(), z0.size());
+  add_into(r.data() + m, z1.data(), z1.size());
+  add_into(r.data() + 2 * m, z2.data(), z2.size());
+  trim(r);
+  return r;
+}
+
+inline Limbs mul(const Limb* a, size_t na, const Limb* b, size_t nb) {
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  while (na && !a[na - 1]) {
+    na--;
+  }
+  while (nb && !b[nb - 1]) {
+    nb--;
+  }
+  if (!nb) {
+    return {};
+  }
+  if (nb < karatsuba_threshold) {
+    return mul_schoolbook(a, na, b, nb);
+  }
+  if (nb >= ntt_threshold && ntt_size(na, nb) <= max_ntt_size) {
+    return mul_ntt(a, na, b, nb);
+  }
+  return mul_karatsuba(a, na, b, nb);
+}
+
+//-----------------------------------------------------------------------------
+// Division
+//-----------------------------------------------------------------------------
+
+// q = a / b and r = a % b for a nonzero b, by Knuth's Algorithm D
+inline void divmod(const Limb* a, size_t na, const Limb* b, size_t nb,
+                   Limbs& q, Limbs& r) {
+  while (nb && !b[nb - 1]) {
+    nb--;
+  }
+  while (na && !a[na - 1]) {
+    na--;
+  }
+  if (compare(a, na, b, nb) < 0) {
+    q.clear();
+    r.assign(a, a + na);
+    return;
+  }
+  if (nb == 1) {
+    q.assign(a, a + na);
+    r.assign(1, div_1(q, b[0]));
+    trim(r);
+    return;
+  }
+
+  // Normalize so that the top bit of the divisor is set.
+  auto s = __builtin_clzll(b[nb - 1]);
+  auto shl = [s](const Limb* x, size_t n, Limb* out) {
+    Limb prev = 0;
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (x[i] << s) | (s ? prev >> (64 - s) : 0);
+      prev = x[i];
+    }
+    return s ? prev >> (64 - s) : 0;
+  };
+  Limbs v(nb), u(na + 1);
+  shl(b, nb, v.data());
+  u[na] = shl(a, na, u.data());
+
+  q.assign(na - nb + 1, 0);
+  for (auto j = na - nb + 1; j-- > 0;) {
+    auto num = (u128(u[j + nb]) << 64) | u[j + nb - 1];
+    auto qhat = num / v[nb - 1];
+    auto rhat = num % v[nb - 1];
+    while (qhat >> 64 ||
+           qhat * v[nb - 2] > ((rhat << 64) | u[j + nb - 2])) {
+      qhat--;
+      rhat += v[nb - 1];
+      if (rhat >> 64) {
+        break;
+      }
+    }
+
+    // u[j..j+nb] -= qhat * v
+    Limb carry = 0, borrow = 0;
+    for (size_t i = 0; i < nb; i++) {
+      auto p = u128(qhat) * v[i] + carry;
+      carry = Limb(p >> 64);
+      auto t = u128(u[i + j]) - Limb(p) - borrow;
+      u[i + j] = Limb(t);
+      borrow = Limb(t >> 64) & 1;
+    }
+    auto t = u128(u[j + nb]) - carry - borrow;
+    u[j + nb] = Limb(t);
+
+    // qhat was one too large
+    if (t >> 64) {
+      qhat--;
+      u[j + nb] += add_n(u.data() + j, u.data() + j, v.data(), nb);
+    }
+    q[j] = Limb(qhat);
+  }
+  trim(q);
+
+  r.resize(nb);
+  for (size_t i = 0; i < nb; i++) {
+    r[i] = (u[i] >> s) | (s ? u[i + 1] << (64 - s) : 0);
+  }
+  trim(r);
+}
+
+//-----------------------------------------------------------------------------
+// Newton division
+//-----------------------------------------------------------------------------
+
+// a * B^k, where B = 2^64
+inline Limbs shift_up(const Limbs& a, size_t k) {
+  if (a.empty()) {
+    return {};
+  }
+  Limbs r(k, 0);
+  r.insert(r.end(), a.begin(), a.end());
+  return r;
+}
+
+// floor(a / B^k)
+inline Limbs shift_down(const Limbs& a, size_t k) {
+  return a.size() > k ? Limbs(a.begin() + k, a.end()) : Limbs();
+}
+
+inline Limbs add(const Limbs& a, const Limbs& b) {
+  return add(a.data(), a.size(), b.data(), b.size());
+}
+
+inline Limbs sub(const Limbs& a, const Limbs& b) {
+  return sub(a.data(), a.size(), b.data(), b.size());
+}
+
+inline Limbs mul(const Limbs& a, const Limbs& b) {
+  return mul(a.data(), a.size(), b.data(), b.size());
+}
+
+inline int compare(const Limbs& a, const Limbs& b) {
+  return compare(a.data(), a.size(), b.data(), b.size());
+}
+
+// floor(B^(2n) / p) for an n-limb p. The reciprocal of the top half of p is
+// refined by one Newton step, x += x * (B^(2n) - p * x) / B^(2n), and the
+// last units are fixed up, so the cost is a few multiplications of size n.
+inline Limbs reciprocal(const Limbs& p) {
+  auto n = p.size();
+  auto one = shift_up({1}, 2 * n);
+  if (n <= newton_threshold) {
+    Limbs q, r;
+    divmod(one.data(), one.size(), p.data(), n, q, r);
+    return q;
+  }
+
+  // Two guard limbs keep the error of the step within a few units even when
+  // the top limb of p is small.
+  auto h = (n + 5) / 2;
+  auto x = shift_up(reciprocal(Limbs(p.end() - h, p.end())), n - h);
+
+  auto t = mul(p, x);
+  if (compare(t, one) <= 0) {
+    x = add(x, shift_down(mul(x, sub(one, t)), 2 * n));
+  } else {
+    x = sub(x, add(shift_down(mul(x, sub(t, one)), 2 * n), {1}));
+  }
+
+  t = mul(p, x);
+  while (compare(t, one) > 0) {
+    x = sub(x, {1});
+    t = sub(t, p);
+  }
+  for (auto r = sub(one, t); compare(r, p) >= 0; r = sub(r, p)) {
+    x = add(x, {1});
+  }
+  return x;
+}
+
+// q = a / p and r = a % p for a < B^(2n), given m = reciprocal(p). Only the
+// top n + 1 limbs of a enter the estimate, which is at most two below q
+// (Barrett reduction).
+inline void divmod(const Limbs& a, const Limbs& p, const Limbs& m, Limbs& q,
+                   Limbs& r) {
+  auto n = p.size();
+  q = shift_down(mul(shift_down(a, n - 1), m), n + 1);
+  r = sub(a, mul(q, p));
+  while (compare(r, p) >= 0) {
+    r = sub(r, p);
+    q = add(q, {1});
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Decimal conversion
+//-----------------------------------------------------------------------------
+
+constexpr Limb decimal_base = 10000000000000000000ULL;  // 10^19
+constexpr size_t decimal_base_digits = 19;
+
+// Decimal digits of `a` by repeated division by 10^19, zero-padded on the
+// left to `width`
+inline std::string to_decimal_naive(Limbs a, size_t width) {
+  std::vector<Limb> chunks;
+  while (!a.empty()) {
+    chunks.push_back(div_1(a, decimal_base));
+  }
+
+  std::string s = chunks.empty() ? "0" : std::to_string(chunks.back());
+  for (auto i = chunks.size(); i-- > 1;) {
+    auto c = std::to_string(chunks[i - 1]);
+    s += std::string(decimal_base_digits - c.size(), '0') + c;
+  }
+  if (s.size() < width) {
+    s.insert(0, width - s.size(), '0');
+  }
+  return s;
+}
+
+struct PowerOfTen {
+  Limbs value;  // 10^(19 * 2^k)
+  Limbs inverse;
+  std::once_flag inverted;
+
+  // reciprocal(value), computed on first use
+  const Limbs& reciprocal() {
+    std::call_once(inverted, [&] { inverse = bigint::reciprocal(value); });
+    return inverse;
+  }
+};
+
+struct PowerOfTenCache {
+  std::deque<PowerOfTen> powers;
+  std::mutex mutex;
+  std::atomic<uint64_t> hits{0};
+  std::atomic<uint64_t> misses{0};  // lookups that computed a power
+};
+
+// One cache per NUMA node
+inline std::deque<PowerOfTenCache>& power_of_ten_caches() {
+  static std::deque<PowerOfTenCache> caches(topology().nodes.size());
+  return caches;
+}
+
+// 10^(19 * 2^k), computed once per NUMA node by repeated squaring and shared
+// by all conversions running on the node, which read it over and over
+inline PowerOfTen& power_of_ten(size_t k) {
+  auto& caches = power_of_ten_caches();
+  auto& shard = caches[current_node() % caches.size()];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  auto& cache = shard.powers;
+  (cache.size() > k ? shard.hits : shard.misses)++;
+  if (cache.empty()) {
+    cache.emplace_back().value = {decimal_base};
+  }
+  while (cache.size() <= k) {
+    const auto& p = cache.back().value;
+    auto value = mul(p, p);
+    cache.emplace_back().value = std::move(value);
+  }
+  return cache[k];
+}
+
+// a = q * 10^(19 * 2^k) + r for the largest power with fewer limbs than a, so
+// that a single Barrett step does the division; r has 19 * 2^k digits.
+inline size_t split_decimal(const Limbs& a, Limbs& q, Limbs& r) {
+  size_t k = 0;
+  for (;;) {
+    // The next power has 2s - 1 or 2s limbs.
+    auto s = power_of_ten(k).value.size();
+    if (2 * s - 1 >= a.size() ||
+        power_of_ten(k + 1).value.size() >= a.size()) {
+      break;
+    }
+    k++;
+  }
+
+  auto& p = power_of_ten(k);
+  if (p.value.size() <= newton_threshold) {
+    divmod(a.data(), a.size(), p.value.data(), p.value.size(), q, r);
+  } else {
+    divmod(a, p.value, p.reciprocal(), q, r);
+  }
+  return decimal_base_digits << k;
+}
+
+// Divide-and-conquer conversion, zero-padded on the left to `width`. The two
+// halves are converted concurrently for large enough numbers.
+inline std::string to_decimal(const Limbs& a, size_t width) {
+  if (a.size() < dc_str_threshold) {
+    return to_decimal_naive(a, width);
+  }
+
+  Limbs q, r;
+  auto low_width = split_decimal(a, q, r);
+  if (q.empty() && width == 0) {
+    return to_decimal(r, 0);
+  }
+
+  std::string high, low;
+  auto convert = [&](size_t i) {
+    if (i == 0) {
+      high = to_decimal(q, width > low_width ? width - low_width : 0);
+    } else {
+      low = to_decimal(r, low_width);
+    }
+  };
+  if (a.size() >= parallel_str_threshold && thread_count() > 1) {
+    parallel_for(2, convert);
+  } else {
+    convert(0);
+    convert(1);
+  }
+  return high + low;
+}
+
+// Buffers digits and hands them to the stream in chunks.
+struct DecimalWriter {
+  std::ostream& out;
+  std::string buf;
+
+  explicit DecimalWriter(std::ostream& out) : out(out) {}
+  ~DecimalWriter() { flush(); }
+
+  void write(const std::string& s) {
+    buf += s;
+    if (buf.size() >= (size_t(1) << 16)) {
+      flush();
+    }
+  }
+
+  void flush() {
+    out.write(buf.data(), buf.size());
+    buf.clear();
+  }
+};
+
+// Same as to_decimal, but the digits go to `w` from the most significant end
+// as soon as they are known, so the whole string is never materialized.
+inline void write_decimal(const Limbs& a, size_t width, DecimalWriter& w) {
+  if (a.size() < dc_str_threshold) {
+    w.write(to_decimal_naive(a, width));
+    return;
+  }
+
+  Limbs q, r;
+  auto low_width = split_decimal(a, q, r);
+  if (q.empty() && width == 0) {
+    write_decimal(r, 0, w);
+    return;
+  }
+  write_decimal(q, width > low_width ? width - low_width : 0, w);
+  q.clear();
+  q.shrink_to_fit();
+  write_decimal(r, low_width, w);
+}
+
+}  // namespace bigint
+
+//-----------------------------------------------------------------------------
+// BigInt
+//-----------------------------------------------------------------------------
+
+struct BigInt {
+  using Limb = bigint::Limb;
+
+  bool negative = false;
+  std::vector<Limb> limbs;  // magnitude, least significant first
+
+  BigInt() = default;
+
+  BigInt(long v) : negative(v < 0) {
+    auto m = negative ? Limb(0) - Limb(v) : Limb(v);
+    if (m) {
+      limbs.push_back(m);
+    }
+  }
+
+  explicit BigInt(std::string_view decimal) {
+    if (!decimal.empty() && decimal[0] == '-') {
+      negative = true;
+      decimal.remove_prefix(1);
+    }
+    auto head = decimal.size() % 19;
+    for (size_t i = 0; i < decimal.size();) {
+      auto len = i == 0 && head ? head : 19;
+      Limb chunk = 0, scale = 1;
+      for (auto c : decimal.substr(i, len)) {
+        chunk = chunk * 10 + (c - '0');
+        scale *= 10;
+      }
+      bigint::mul_1_add(limbs, scale, chunk);
+      i += len;
+    }
+    bigint::trim(limbs);
+    negative = negative && !limbs.empty();
+  }
+
+  bool is_zero() const { return limbs.empty(); }
+
+  bool fits_long() const {
+    if (limbs.size() > 1) {
+      return false;
+    }
+    auto m = limbs.empty() ? Limb(0) : limbs[0];
+    return negative ? m <= Limb(1) << 63 : m < Limb(1) << 63;
+  }
+
+  long to_long() const {
+    auto m = limbs.empty() ? Limb(0) : limbs[0];
+    return negative ? long(Limb(0) - m) : long(m);
+  }
+
+  size_t bit_length() const {
+    if (limbs.empty()) {
+      return 0;
+    }
+    return limbs.size() * 64 - __builtin_clzll(limbs.back());
+  }
+
+  static int compare(const BigInt& a, const BigInt& b) {
+    if (a.negative != b.negative) {
+      return a.negative ? -1 : 1;
+    }
+    auto c = bigint::compare(a.limbs.data(), a.limbs.size(), b.limbs.data(),
+                             b.limbs.size());
+    return a.negative ? -c : c;
+  }
+
+  friend bool operator<(const BigInt& a, const BigInt& b) {
+    return compare(a, b) < 0;
+  }
+
+  friend bool operator==(const BigInt& a, const BigInt& b) {
+    return a.negative == b.negative && a.limbs == b.limbs;
+  }
+
+  friend BigInt operator+(const BigInt& a, const BigInt& b) {
+    return add(a, b, b.negative);
+  }
+
+  friend BigInt operator-(const BigInt& a, const BigInt& b) {
+    return add(a, b, !b.negative);
+  }
+
+  friend BigInt operator*(const BigInt& a, const BigInt& b) {
+    BigInt r;
+    r.limbs = bigint::mul(a.limbs.data(), a.limbs.size(), b.limbs.data(),
+                          b.limbs.size());
+    r.negative = a.negative != b.negative && !r.limbs.empty();
+    return r;
+  }
+
+  std::string str() const {
+    if (limbs.empty()) {
+      return "0";
+    }
+    return (negative ? "-" : "") + bigint::to_decimal(limbs, 0);
+  }
+
+  // Streams the digits instead of building the string
+  void write(std::ostream& out) const {
+    if (negative) {
+      out << '-';
+    }
+    bigint::DecimalWriter w(out);
+    bigint::write_decimal(limbs, 0, w);
+  }
+
+  friend std::ostream& operator<<(std::ostream& out, const BigInt& b) {
+    b.write(out);
+    return out;
+  }
+
+private:
+  // a + (b_negative ? -|b| : |b|)
+  static BigInt add(const BigInt& a, const BigInt& b, bool b_negative) {
+    using namespace bigint;
+    BigInt r;
+    if (a.negative == b_negative) {
+      r.limbs = bigint::add(a.limbs.data(), a.limbs.size(), b.limbs.data(),
+                            b.limbs.size());
+      r.negative = a.negative;
+    } else if (bigint::compare(a.limbs.data(), a.limbs.size(),
+                               b.limbs.data(), b.limbs.size()) >= 0) {
+      r.limbs =
+          sub(a.limbs.data(), a.limbs.size(), b.limbs.data(), b.limbs.size());
+      r.negative = a.negative;
+    } else {
+      r.limbs =
+          sub(b.limbs.data(), b.limbs.size(), a.limbs.data(), a.limbs.size());
+      r.negative = b_negative;
+    }
+    r.negative = r.negative && !r.limbs.empty();
+    return r;
+  }
+};
+
+}  // namespace fiblang
@@ -6,311 +6,251 @@
 //  MIT License
 //
 
-#include <fstream>
-#include <variant>
-
-#include "peglib.h"
+#include "fiblang.h"
 
 using namespace std;
-using namespace peg;
-using namespace peg::udl;
+using namespace fiblang;
 
 //-----------------------------------------------------------------------------
-// Parser
+// main
 //-----------------------------------------------------------------------------
 
-shared_ptr<Ast> parse(const string& source, ostream& out) {
-  parser pg(R"(
-    # Syntax
-    START             ← STATEMENTS
-    STATEMENTS        ← (DEFINITION / EXPRESSION)*
-    DEFINITION        ← 'def' Identifier '(' Identifier ')' EXPRESSION
-    EXPRESSION        ← TERNARY
-    TERNARY           ← CONDITION ('?' EXPRESSION ':' EXPRESSION)?
-    CONDITION         ← INFIX (ConditionOperator INFIX)?
-    INFIX             ← CALL (InfixOperator CALL)*
-    CALL              ← PRIMARY ('(' EXPRESSION ')')?
-    PRIMARY           ← FOR / Identifier / '(' EXPRESSION ')' / Number
-    FOR               ← 'for' Identifier 'from' Number 'to' Number EXPRESSION
-
-    # Token
-    ConditionOperator ← '<'
-    InfixOperator     ← '+' / '-'
-    Identifier        ← !Keyword < [a-zA-Z][a-zA-Z0-9_]* >
-    Number            ← < [0-9]+ >
-    Keyword           ← 'def' / 'for' / 'from' / 'to'
-
-    %whitespace       ← [ \t\r\n]*
-    %word             ← [a-zA-Z]
-  )");
-
-  pg.log = [&](size_t ln, size_t col, const string& msg) {
-    out << ln << ":" << col << ": " << msg << endl;
-  };
-
-  pg.enable_ast();
-
-  shared_ptr<Ast> ast;
-  if (pg.parse(source, ast)) {
-    return AstOptimizer(true).optimize(ast);
-  }
-  return nullptr;
+// Taken before the other static initializers run
+static long process_start = 0;
+__attribute__((constructor(101))) static void mark_process_start() {
+  process_start = Timeline::now();
 }
 
-//-----------------------------------------------------------------------------
-// Value
-//-----------------------------------------------------------------------------
-
-struct Value;
-struct Environment;
-
-struct Function {
-  string_view param;
-  function<Value(shared_ptr<Environment> env)> eval;
-
-  Function(string_view param,
-           function<Value(shared_ptr<Environment> env)>&& eval)
-      : param(param), eval(eval) {}
-};
-
-struct Value {
-  enum class Type { Nil, Bool, Long, Function };
-  Type type;
-  any v;
-  //variant<nullptr_t, bool, long, string_view, Function> v;
-
-  // Constructor
-  Value() : type(Type::Nil) {}
-  explicit Value(bool b) : type(Type::Bool), v(b) {}
-  explicit Value(long l) : type(Type::Long), v(l) {}
-  explicit Value(Function&& f) : type(Type::Function), v(f) {}
-
-  // Cast value
-  bool to_bool() const {
-    switch (type) {
-      case Type::Bool:
-        return any_cast<bool>(v);
-      case Type::Long:
-        return any_cast<long>(v) != 0;
-      default:
-        throw runtime_error("type error.");
+int main(int argc, const char** argv) {
+  Timeline tl;
+  tl.mark("start", process_start);
+  tl.mark("main");
+
+  auto path = ""s;
+  auto print_callgraph = false;
+  auto dot_path = ""s;
+  auto analyze = false;
+  auto max_cost = HUGE_VAL;
+  auto warn_cost = HUGE_VAL;
+  auto print_timing = false;
+  auto print_ast_stats = false;
+  auto use_peg = false;
+  auto lazy = false;
+  auto use_ir = true;
+  auto dump_ir = false;
+  auto print_profile = false;
+  auto print_topology = false;
+  auto metrics_address = ""s;
+  Config config;
+
+  for (auto i = 1; i < argc; i++) {
+    auto arg = string_view(argv[i]);
+    if (arg == "--callgraph") {
+      print_callgraph = true;
+    } else if (arg.substr(0, 16) == "--callgraph-dot=") {
+      dot_path = arg.substr(16);
+    } else if (arg == "--analyze") {
+      analyze = true;
+    } else if (arg.substr(0, 11) == "--max-cost=") {
+      max_cost = stod(string(arg.substr(11)));
+    } else if (arg.substr(0, 12) == "--warn-cost=") {
+      warn_cost = stod(string(arg.substr(12)));
+    } else if (arg == "--timing") {
+      print_timing = true;
+    } else if (arg == "--ast-stats") {
+      print_ast_stats = true;
+    } else if (arg == "--peg") {
+      use_peg = true;
+    } else if (arg == "--lazy") {
+      lazy = true;
+    } else if (arg == "--ast") {
+      use_ir = false;
+      config.osr_after = 0;
+    } else if (arg == "--dump-ir") {
+      dump_ir = true;
+    } else if (arg == "--profile") {
+      print_profile = true;
+    } else if (arg.substr(0, 19) == "--specialize-after=") {
+      config.specialize_after = stoul(string(arg.substr(19)));
+    } else if (arg.substr(0, 12) == "--osr-after=") {
+      config.osr_after = stoul(string(arg.substr(12)));
+    } else if (arg.substr(0, 14) == "--max-nesting=") {
+      config.max_nesting = stoul(string(arg.substr(14)));
+    } else if (arg.substr(0, 9) == "--unroll=") {
+      config.unroll_factor = stoul(string(arg.substr(9)));
+    } else if (arg.substr(0, 10) == "--threads=") {
+      config.threads = max(1ul, stoul(string(arg.substr(10))));
+    } else if (arg.substr(0, 11) == "--affinity=") {
+      if (!parse_affinity(arg.substr(11), config.affinity)) {
+        cerr << "--affinity must be none, compact or scatter." << endl;
+        return -1;
+      }
+    } else if (arg == "--topology") {
+      print_topology = true;
+    } else if (arg.substr(0, 10) == "--metrics=") {
+      metrics_address = arg.substr(10);
+    } else if (path.empty()) {
+      path = arg;
     }
   }
 
-  long to_long() const {
-    switch (type) {
-      case Type::Long:
-        return any_cast<long>(v);
-      default:
-        throw runtime_error("type error.");
+  if (print_topology) {
+    topology().print(cerr);
+    auto threads = config.threads ? config.threads : topology().concurrency();
+    cerr << "threads: " << threads
+         << ", affinity: " << affinity_name(config.affinity) << endl;
+    for (size_t i = 0; i + 1 < threads; i++) {
+      auto cpu = affinity_cpu(topology(), config.affinity, i);
+      if (cpu >= 0) {
+        cerr << "worker " << i << ": cpu " << cpu << ", node "
+             << topology().node_of(cpu) << endl;
+      }
     }
-  }
-
-  Function to_function() const {
-    switch (type) {
-      case Type::Function:
-        return any_cast<Function>(v);
-      default:
-        throw runtime_error("type error.");
+    if (path.empty()) {
+      return 0;
     }
   }
 
-  // Comparison
-  bool operator<(const Value& rhs) const {
-    switch (type) {
-      case Type::Nil:
-        return false;
-      case Type::Bool:
-        return to_bool() < rhs.to_bool();
-      case Type::Long:
-        return to_long() < rhs.to_long();
-      default:
-        throw logic_error("invalid internal condition.");
-    }
-    // NOTREACHED
-  }
-
-  // String representation
-  string str() const {
-    switch (type) {
-      case Type::Nil:
-        return "nil";
-      case Type::Bool:
-        return to_bool() ? "true" : "false";
-      case Type::Long:
-        return std::to_string(to_long());
-      case Type::Function:
-        return "[function]";
-      default:
-        throw logic_error("invalid internal condition.");
-    }
+  if (path.empty()) {
+    cerr << "usage: fib [--callgraph] [--callgraph-dot=path] [--analyze] "
+            "[--max-cost=calls] [--warn-cost=calls] [--timing] "
+            "[--ast-stats] [--peg] [--lazy] [--max-nesting=N] [--ast] [--dump-ir] "
+            "[--unroll=N] [--profile] [--specialize-after=calls] "
+            "[--osr-after=iterations] [--threads=N] "
+            "[--affinity=none|compact|scatter] [--topology] "
+            "[--metrics=port|socket path] [source file path]"
+         << endl;
+    return -1;
   }
-};
 
-//-----------------------------------------------------------------------------
-// Environment
-//-----------------------------------------------------------------------------
-
-struct Environment {
-  shared_ptr<Environment> outer;
-  map<string_view, Value> values;
-
-  Environment(shared_ptr<Environment> outer = nullptr) : outer(outer) {}
-
-  const Value& get_value(string_view s) const {
-    if (values.find(s) != values.end()) {
-      return values.at(s);
-    } else if (outer) {
-      return outer->get_value(s);
-    }
-    throw runtime_error("undefined variable '" + string(s) + "'...");
+  ifstream f{path};
+  if (!f) {
+    cerr << "can't open the source file." << endl;
+    return -2;
   }
+  auto s = string(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
 
-  void set_value(string_view s, Value&& val) { values.emplace(s, val); }
-
-  static shared_ptr<Environment> make_with_builtins() {
-    auto env = make_shared<Environment>();
-    env->set_value("puts"sv,
-                   Value(Function("arg", [](shared_ptr<Environment> env) {
-                     cout << env->get_value("arg").str() << endl;
-                     return Value();
-                   })));
-    return env;
+  if (print_timing) {
+    config.timeline = &tl;
+    tl.mark("read");
   }
-};
-
-//-----------------------------------------------------------------------------
-// Interpreter
-//-----------------------------------------------------------------------------
 
-Value eval(const Ast& ast, shared_ptr<Environment> env) {
-  switch (ast.tag) {
-    // Rules
-    case "STATEMENTS"_: {
-      // (DEFINITION / EXPRESSION)*
-      if (!ast.nodes.empty()) {
-        auto it = ast.nodes.begin();
-        while (it != ast.nodes.end() - 1) {
-          eval(**it, env);
-          ++it;
-        }
-        return eval(**it, env);
-      }
-      return Value();
-    }
-    case "DEFINITION"_: {
-      // 'def' Identifier '(' Identifier ')' EXPRESSION
-      auto name = ast.nodes[0]->token;
-      auto param = ast.nodes[1]->token;
-      auto body = ast.nodes[2];
-
-      env->set_value(
-          name, Value(Function(param, [=](shared_ptr<Environment> callEnv) {
-            return eval(*body, callEnv);
-          })));
-
-      return Value();
-    }
-    case "TERNARY"_: {
-      // CONDITION ('?' EXPRESSION ':' EXPRESSION)?
-      auto cond = eval(*ast.nodes[0], env).to_bool();
-      auto idx = cond ? 1 : 2;
-      return eval(*ast.nodes[idx], env);
+  shared_ptr<Program> program;
+  try {
+    program = use_peg ? parse_peg(s, cerr, config)
+                      : parse(s, cerr, lazy, config);
+    if (!program) {
+      return -3;
     }
-    case "CONDITION"_: {
-      // INFIX (ConditionOperator INFIX)?
-      auto lhs = eval(*ast.nodes[0], env);
-      auto rhs = eval(*ast.nodes[2], env);
-      auto ret = lhs < rhs;
-      return Value(ret);
+    if (print_ast_stats) {
+      const auto& stats = program->stats;
+      const auto& source_map = program->source_map;
+      cerr << "ast nodes: " << stats.nodes << ", unique: " << stats.unique
+           << ", dedup ratio: " << fixed << setprecision(2) << stats.ratio()
+           << endl
+           << "node size: " << sizeof(Node) << " bytes (peg::Ast "
+           << sizeof(Ast) << " bytes), source map: "
+           << double(source_map.bytes()) / source_map.size() << " bytes/node"
+           << defaultfloat << endl;
     }
-    case "INFIX"_: {
-      // CALL (InfixOperator CALL)*
-      auto l = eval(*ast.nodes[0], env).to_long();
-      for (size_t i = 1; i < ast.nodes.size(); i += 2) {
-        auto o = ast.nodes[i]->token;
-        auto r = eval(*ast.nodes[i + 1], env).to_long();
-        if (o == "+") {
-          l += r;
-        } else if (o == "-") {
-          l -= r;
-        }
+    // program->dump(cerr, *program->root);
+
+    // Analysis and evaluation recurse on the nesting of the program.
+    optional<int> ret;
+    with_stack(program->depth, [&] {
+      if (analyze) {
+        Analyzer(*program).report(cout);
+        ret = 0;
+        return;
       }
-      return Value(l);
-    }
-    case "CALL"_: {
-      // PRIMARY ('(' EXPRESSION ')')?
-      auto name = ast.nodes[0]->token;
-      auto fn = env->get_value(name).to_function();
-      auto val = eval(*ast.nodes[1], env);
-
-      auto callEnv = make_shared<Environment>(env);
-      callEnv->set_value(fn.param, move(val));
 
-      try {
-        return fn.eval(callEnv);
-      } catch (const Value& e) {
-        return e;
+      // Estimated only when a limit is set, and only until it is exceeded
+      if (max_cost < HUGE_VAL || warn_cost < HUGE_VAL) {
+        Analyzer analyzer(*program);
+        auto cost =
+            analyzer.estimate(max_cost < HUGE_VAL ? max_cost : warn_cost);
+        if (cost > max_cost) {
+          cerr << "estimated cost " << analyzer.format_cost(cost)
+               << " exceeds --max-cost." << endl;
+          ret = -6;
+          return;
+        }
+        if (cost > warn_cost) {
+          cerr << "warning: estimated cost " << analyzer.format_cost(cost)
+               << "." << endl;
+        }
+      }
+      if (config.timeline) {
+        config.timeline->mark("analyze");
       }
-    }
-    case "FOR"_: {
-      // 'for' Identifier 'from' Number 'to' Number EXPRESSION
-      auto ident = ast.nodes[0]->token;
-      auto from = eval(*ast.nodes[1], env).to_long();
-      auto to = eval(*ast.nodes[2], env).to_long();
-      auto& expr = *ast.nodes[3];
 
-      for (auto i = from; i <= to; i++) {
-        auto call_env = make_shared<Environment>(env);
-        call_env->set_value(ident, Value(i));
-        eval(expr, call_env);
+      if (use_ir && !ir::compile(*program, config) && dump_ir) {
+        cerr << (program->lazy
+                     ? "not compiled: the program is parsed lazily, its "
+                       "bodies are compiled on their first call."
+                     : "not compiled: the program relies on dynamic scoping.")
+             << endl;
+      }
+      if (dump_ir && program->module) {
+        program->module->dump(cerr);
       }
-      return Value();
-    }
 
-    // Tokens
-    case "Identifier"_: {
-      // !Keyword < [a-zA-Z][a-zA-Z0-9_]* >
-      return Value(env->get_value(ast.token));
-    }
-    case "Number"_: {
-      // < [0-9]+ >
-      return Value(ast.token_to_number<long>());
-    }
-  }
-  return Value();
-}
+      Interpreter interpreter;
+      interpreter.config = config;
 
-//-----------------------------------------------------------------------------
-// main
-//-----------------------------------------------------------------------------
+      CallGraph cg;
+      if (print_callgraph || !dot_path.empty()) {
+        interpreter.callgraph = &cg;
+      }
 
-int main(int argc, const char** argv) {
-  if (argc < 2) {
-    cerr << "usage: fib [source file path]" << endl;
-    return -1;
-  }
+      Metrics metrics;
+      unique_ptr<MetricsServer> server;
+      if (!metrics_address.empty()) {
+        server = make_unique<MetricsServer>(metrics, metrics_address);
+        cerr << "serving metrics on " << server->url << endl;
+        interpreter.metrics = &metrics;
+      }
+      if (config.timeline) {
+        config.timeline->mark("builtins");
+      }
 
-  ifstream f{argv[1]};
-  if (!f) {
-    cerr << "can't open the source file." << endl;
-    return -2;
-  }
-  auto s = string(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+      interpreter.run(*program);
 
-  try {
-    auto ast = parse(s, cerr);
-    if (!ast) {
-      return -3;
+      if (print_callgraph) {
+        cg.print(cerr);
+      }
+      if (print_profile) {
+        if (program->module) {
+          program->module->print_profile(cerr, program->source_map);
+        } else {
+          cerr << "no type feedback: the program was not compiled." << endl;
+        }
+      }
+      if (!dot_path.empty()) {
+        ofstream dot{dot_path};
+        if (!dot) {
+          cerr << "can't open the dot file." << endl;
+          ret = -5;
+          return;
+        }
+        cg.print_dot(dot);
+      }
+    });
+    if (ret) {
+      return *ret;
     }
-    // cerr << ast_to_s(ast) << endl;
-
-    auto env = Environment::make_with_builtins();
-    eval(*ast, env);
+  } catch (const Error& e) {
+    auto [line, column] = program->source_map.position(e.id, e.delta);
+    cerr << line << ":" << column << ": " << e.what() << endl;
+    return -4;
   } catch (const exception& e) {
     cerr << e.what() << endl;
     return -4;
   }
 
+  if (config.timeline) {
+    tl.mark("exit");
+    tl.print(cerr);
+  }
   return 0;
 }
@@ -0,0 +1,5486 @@
+//
+//  fiblang.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <climits>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <numeric>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
+
+#include "bigint.h"
+#include "peglib.h"
+
+namespace fiblang {
+
+using namespace std;
+using namespace peg;
+using namespace peg::udl;
+
+//-----------------------------------------------------------------------------
+// Timeline
+//-----------------------------------------------------------------------------
+
+// Monotonic timestamps of the startup phases, so that an external driver can
+// line them up with its own clock.
+struct Timeline {
+  vector<pair<const char*, long>> marks;
+  bool output = false;
+
+  static long now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+  }
+
+  void mark(const char* phase, long ns = now()) {
+    marks.emplace_back(phase, ns);
+  }
+
+  void print(ostream& out) const {
+    for (const auto& [phase, ns] : marks) {
+      out << "timing " << phase << " " << ns << endl;
+    }
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Config
+//-----------------------------------------------------------------------------
+
+// Settings of an interpreter, and of parsing and compiling the programs it
+// runs. Each instance has its own, so instances with different settings can
+// run side by side.
+struct Config {
+  Timeline* timeline = nullptr;  // marks the phases when set
+
+  // Deepest expression nesting accepted by parse()
+  size_t max_nesting = 10000000;
+
+  // FOR loops eval() runs move to the IR after `osr_after` iterations (0
+  // never)
+  size_t osr_after = 1000;
+
+  // FOR loops are unrolled by `unroll_factor` (1 only peels them, 0 leaves
+  // them alone) when their body has at most ir::max_loop_size instructions
+  size_t unroll_factor = 4;
+
+  // A function is specialized on its type feedback after `specialize_after`
+  // calls (0 never), and goes back to its generic code for good after
+  // `max_deopts` deoptimizations
+  size_t specialize_after = 1000;
+  size_t max_deopts = 100;
+
+  // Threads that big integer operations may use in total (0 for the CPUs
+  // the process may use), and the pool their workers come from
+  size_t threads = 0;
+  Affinity affinity = Affinity::none;
+};
+
+//-----------------------------------------------------------------------------
+// Tracepoints
+//-----------------------------------------------------------------------------
+
+// Statically defined tracepoints (USDT) in the format of <sys/sdt.h>, which
+// perf, bpftrace and SystemTap attach to as `usdt:fib:fiblang:<name>`. A
+// probe is a single nop that the tracer patches while it is attached; its
+// note in .note.stapsdt records the address of the nop and where the
+// arguments are, e.g. "-8@%rax" for a signed 8-byte value in %rax.
+#if defined(__x86_64__) || defined(__aarch64__)
+#define FIBLANG_PROBE_ASM(name, args)                                     \
+  "990: nop\n"                                                            \
+  ".pushsection .note.stapsdt,\"?\",\"note\"\n"                           \
+  ".balign 4\n"                                                           \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                      \
+  "991: .asciz \"stapsdt\"\n"                                             \
+  "992: .balign 4\n"                                                      \
+  "993: .8byte 990b\n"                                                    \
+  ".8byte _.stapsdt.base\n"                                               \
+  ".8byte 0\n"                                                            \
+  ".asciz \"fiblang\"\n"                                                  \
+  ".asciz \"" #name "\"\n"                                                \
+  ".asciz \"" args "\"\n"                                                 \
+  "994: .balign 4\n"                                                      \
+  ".popsection\n"                                                         \
+  ".ifndef _.stapsdt.base\n"                                              \
+  ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+  ".weak _.stapsdt.base\n"                                                \
+  ".hidden _.stapsdt.base\n"                                              \
+  "_.stapsdt.base: .space 1\n"                                            \
+  ".size _.stapsdt.base, 1\n"                                             \
+  ".popsection\n"                                                         \
+  ".endif\n"
+
+// Size of an argument, negative when it is signed
+#define FIBLANG_PROBE_SIZE(x) \
+  ((is_signed<decltype(x)>::value ? 1 : -1) * int(sizeof(x)))
+
+#define FIBLANG_PROBE1(name, a)                                 \
+  __asm__ __volatile__(FIBLANG_PROBE_ASM(name, "%n0@%1")        \
+                       :                                        \
+                       : "n"(FIBLANG_PROBE_SIZE(a)), "nor"(a))
+#define FIBLANG_PROBE2(name, a, b)                               \
+  __asm__ __volatile__(FIBLANG_PROBE_ASM(name, "%n0@%1 %n2@%3")  \
+                       :                                         \
+                       : "n"(FIBLANG_PROBE_SIZE(a)), "nor"(a),   \
+                         "n"(FIBLANG_PROBE_SIZE(b)), "nor"(b))
+#define FIBLANG_PROBE3(name, a, b, c)                                  \
+  __asm__ __volatile__(FIBLANG_PROBE_ASM(name, "%n0@%1 %n2@%3 %n4@%5") \
+                       :                                               \
+                       : "n"(FIBLANG_PROBE_SIZE(a)), "nor"(a),         \
+                         "n"(FIBLANG_PROBE_SIZE(b)), "nor"(b),         \
+                         "n"(FIBLANG_PROBE_SIZE(c)), "nor"(c))
+#else
+#define FIBLANG_PROBE1(name, a)
+#define FIBLANG_PROBE2(name, a, b)
+#define FIBLANG_PROBE3(name, a, b, c)
+#endif
+
+//-----------------------------------------------------------------------------
+// Parser
+//-----------------------------------------------------------------------------
+
+inline const char* grammar = R"(
+    # Syntax
+    START             ← STATEMENTS
+    STATEMENTS        ← (DEFINITION / EXPRESSION)*
+    DEFINITION        ← 'def' Identifier '(' Identifier ')' EXPRESSION
+    EXPRESSION        ← TERNARY
+    TERNARY           ← CONDITION ('?' EXPRESSION ':' EXPRESSION)?
+    CONDITION         ← INFIX (ConditionOperator INFIX)?
+    INFIX             ← CALL (InfixOperator CALL)*
+    CALL              ← PRIMARY ('(' EXPRESSION ')')?
+    PRIMARY           ← FOR / Identifier / '(' EXPRESSION ')' / Number
+    FOR               ← 'for' Identifier 'from' Number 'to' Number EXPRESSION
+
+    # Token
+    ConditionOperator ← '<'
+    InfixOperator     ← '+' / '-'
+    Identifier        ← !Keyword < [a-zA-Z][a-zA-Z0-9_]* >
+    Number            ← < [0-9]+ >
+    Keyword           ← 'def' / 'for' / 'from' / 'to'
+
+    %whitespace       ← [ \t\r\n]*
+    %word             ← [a-zA-Z]
+)";
+
+//-----------------------------------------------------------------------------
+// Global symbols
+//-----------------------------------------------------------------------------
+
+// A minimal perfect hash of a fixed set of names (hash and displace). The
+// hash of a name picks a bucket, and the displacement of the bucket, found
+// when the table is built, sends each of its names to a distinct slot in
+// [0, size()). A lookup hashes the name once and compares it with the one
+// name in its slot, so values can be kept in a dense array by slot.
+class PerfectHash {
+public:
+  static constexpr uint32_t npos = UINT32_MAX;
+
+  PerfectHash() = default;
+
+  // A name given more than once gets a single slot.
+  explicit PerfectHash(const vector<string_view>& names) {
+    if (!names.empty()) {
+      while (!build(names)) {
+        seed++;
+      }
+    }
+  }
+
+  // Slot of `name`, or npos
+  uint32_t find(string_view name) const {
+    if (keys.empty()) {
+      return npos;
+    }
+    auto h = hash(name);
+    auto slot = place(h, displacements[bucket(h)]);
+    return keys[slot] == name ? slot : npos;
+  }
+
+  size_t size() const { return keys.size(); }
+  string_view name(uint32_t slot) const { return keys[slot]; }
+
+private:
+  // Names per bucket on average: small buckets are quick to place even when
+  // most slots are taken.
+  static constexpr size_t bucket_size = 2;
+  static constexpr uint32_t max_displacement = 1 << 24;
+
+  vector<uint32_t> displacements;  // by bucket
+  vector<string_view> keys;        // by slot
+  uint64_t seed = 0;
+
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+  }
+
+  // `x` scaled to [0, n) without a division
+  static uint32_t scale(uint64_t x, size_t n) {
+    return uint32_t((__uint128_t(x) * n) >> 64);
+  }
+
+  uint64_t hash(string_view name) const {
+    return mix(std::hash<string_view>()(name) ^ seed);
+  }
+  uint32_t bucket(uint64_t h) const { return scale(h, displacements.size()); }
+  uint32_t place(uint64_t h, uint32_t d) const {
+    return scale(mix(h + d * 0x9e3779b97f4a7c15), keys.size());
+  }
+
+  // Places the largest buckets first, while most slots are free. Fails when
+  // a bucket can't be placed, to retry with another seed.
+  bool build(const vector<string_view>& names) {
+    auto n = uint32_t(names.size());
+    auto buckets = uint32_t((n + bucket_size - 1) / bucket_size);
+    displacements.assign(buckets, 0);
+
+    // Names by bucket, in `members` from `first[b]`
+    vector<uint64_t> hashes(n);
+    vector<uint32_t> first(buckets + 1);
+    for (uint32_t i = 0; i < n; i++) {
+      hashes[i] = hash(names[i]);
+      first[bucket(hashes[i]) + 1]++;
+    }
+    partial_sum(first.begin(), first.end(), first.begin());
+    vector<uint32_t> members(n);
+    auto fill = first;
+    for (uint32_t i = 0; i < n; i++) {
+      members[fill[bucket(hashes[i])]++] = i;
+    }
+
+    // A repeated name is in the bucket of its first occurrence: keep that
+    vector<uint32_t> sizes(buckets);
+    uint32_t distinct = 0;
+    for (uint32_t b = 0; b < buckets; b++) {
+      auto begin = members.begin() + first[b];
+      auto end = begin;
+      for (auto it = begin; it != members.begin() + first[b + 1]; ++it) {
+        auto same = [&](auto i) { return names[i] == names[*it]; };
+        if (none_of(begin, end, same)) {
+          *end++ = *it;
+        }
+      }
+      sizes[b] = uint32_t(end - begin);
+      distinct += sizes[b];
+    }
+    keys.assign(distinct, {});
+
+    // Buckets by decreasing size, with a counting sort
+    auto largest = *max_element(sizes.begin(), sizes.end());
+    vector<uint32_t> counts(largest + 2);
+    for (auto size : sizes) {
+      counts[largest - size + 1]++;
+    }
+    partial_sum(counts.begin(), counts.end(), counts.begin());
+    vector<uint32_t> order(buckets);
+    for (uint32_t b = 0; b < buckets; b++) {
+      order[counts[largest - sizes[b]]++] = b;
+    }
+
+    vector<uint8_t> taken(distinct);
+    vector<uint32_t> slots;
+    for (auto b : order) {
+      if (sizes[b] == 0) {
+        break;
+      }
+      auto begin = members.begin() + first[b];
+      auto end = begin + sizes[b];
+      uint32_t d = 0;
+      for (;; d++) {
+        if (d == max_displacement) {
+          return false;
+        }
+        slots.clear();
+        for (auto it = begin; it != end; ++it) {
+          auto slot = place(hashes[*it], d);
+          if (taken[slot] || count(slots.begin(), slots.end(), slot)) {
+            break;
+          }
+          slots.push_back(slot);
+        }
+        if (slots.size() == sizes[b]) {
+          break;
+        }
+      }
+      displacements[b] = d;
+      for (size_t k = 0; k < slots.size(); k++) {
+        taken[slots[k]] = true;
+        keys[slots[k]] = names[begin[k]];
+      }
+    }
+    return true;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Nodes
+//-----------------------------------------------------------------------------
+
+struct Node;
+
+namespace ir {
+struct Function;
+struct Module;
+class Executor;
+}  // namespace ir
+
+// Child pointers of a node, stored in the program's arena. A child may be
+// shared by several parents, so each parent also keeps where its children
+// start in the source, as offsets from its own start, after the pointers.
+struct Children {
+  const Node* const* data = nullptr;
+  uint32_t count = 0;
+
+  // Words of storage for `count` pointers and offsets
+  static size_t words(size_t count) {
+    auto bytes = count * sizeof(uint32_t);
+    return count + (bytes + sizeof(Node*) - 1) / sizeof(Node*);
+  }
+
+  uint32_t offset(size_t i) const {
+    auto offsets = reinterpret_cast<const char*>(data + count);
+    uint32_t offset;
+    memcpy(&offset, offsets + i * sizeof(offset), sizeof(offset));
+    return offset;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const Node* operator[](size_t i) const { return data[i]; }
+  const Node* back() const { return data[count - 1]; }
+  const Node* const* begin() const { return data; }
+  const Node* const* end() const { return data + count; }
+};
+
+// What eval() reads of a node and nothing more. Positions and rule names
+// are looked up in the SourceMap by `id` when a diagnostic needs them.
+struct Node {
+  unsigned int tag;
+  uint32_t id;
+  string_view token;
+  Children nodes;
+
+  template <typename T> T token_to_number() const {
+    T n = 0;
+    from_chars(token.data(), token.data() + token.size(), n);
+    return n;
+  }
+};
+
+// Source offsets of the nodes by ID. Nodes are numbered as they are lowered,
+// so neighbouring IDs are close in the source: offsets are stored as zigzag
+// varint deltas, with an absolute offset every `interval` nodes.
+class SourceMap {
+public:
+  static constexpr uint32_t interval = 64;
+
+  explicit SourceMap(string_view source) {
+    lines.push_back(0);
+    for (size_t i = 0; i < source.size(); i++) {
+      if (source[i] == '\n') {
+        lines.push_back(i + 1);
+      }
+    }
+  }
+
+  // Offset of a 1-based line and column
+  size_t offset(size_t line, size_t column) const {
+    return lines[line - 1] + column - 1;
+  }
+
+  uint32_t add(size_t offset) {
+    lock_guard<mutex> lock(writes);
+    auto id = count++;
+    if (id % interval == 0) {
+      checkpoints.push_back({offset, deltas.size()});
+    } else {
+      auto d = int64_t(offset) - int64_t(last);
+      auto z = (uint64_t(d) << 1) ^ uint64_t(d >> 63);
+      for (; z >= 0x80; z >>= 7) {
+        deltas.push_back(uint8_t(z) | 0x80);
+      }
+      deltas.push_back(uint8_t(z));
+    }
+    last = offset;
+    return id;
+  }
+
+  size_t offset(uint32_t id) const {
+    lock_guard<mutex> lock(writes);
+    const auto& c = checkpoints[id / interval];
+    auto offset = c.offset;
+    auto p = deltas.data() + c.delta;
+    for (auto i = id % interval; i > 0; i--) {
+      uint64_t z = 0;
+      for (auto shift = 0;; shift += 7) {
+        z |= uint64_t(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80)) {
+          break;
+        }
+      }
+      offset += int64_t(z >> 1) ^ -int64_t(z & 1);
+    }
+    return offset;
+  }
+
+  // 1-based line and column of `delta` bytes after node `id`, as in
+  // parse()'s log
+  pair<size_t, size_t> position(uint32_t id, uint32_t delta = 0) const {
+    return line_column(offset(id) + delta);
+  }
+
+  pair<size_t, size_t> line_column(size_t offset) const {
+    auto it = upper_bound(lines.begin(), lines.end(), offset) - 1;
+    return {size_t(it - lines.begin()) + 1, offset - *it + 1};
+  }
+
+  const string& name(unsigned int tag) const {
+    lock_guard<mutex> lock(writes);
+    return names.at(tag);
+  }
+
+  void add_name(unsigned int tag, const string& name) {
+    lock_guard<mutex> lock(writes);
+    names.emplace(tag, name);
+  }
+
+  size_t size() const {
+    lock_guard<mutex> lock(writes);
+    return count;
+  }
+
+  size_t bytes() const {
+    lock_guard<mutex> lock(writes);
+    return checkpoints.size() * sizeof(Checkpoint) + deltas.size() +
+           lines.size() * sizeof(size_t);
+  }
+
+private:
+  struct Checkpoint {
+    size_t offset;
+    size_t delta;  // where the deltas of the following nodes start
+  };
+
+  vector<Checkpoint> checkpoints;
+  vector<uint8_t> deltas;
+  vector<size_t> lines;  // offsets of the line starts
+  unordered_map<unsigned int, string> names;
+  uint32_t count = 0;
+  size_t last = 0;
+
+  // Bodies parsed lazily add their nodes while other threads look up
+  // positions and names
+  mutable mutex writes;
+};
+
+// A runtime error, raised `delta` bytes after the start of the node `id`.
+// A shared node only has the position of its first occurrence, so until the
+// error is `resolved` each node it unwinds through takes it over with
+// enter(). It is resolved at the definition of the function it was raised
+// in, whose position is its own.
+struct Error : runtime_error {
+  uint32_t id;
+  uint32_t delta;
+  bool resolved;
+
+  Error(uint32_t id, const string& msg, uint32_t delta = 0,
+        bool resolved = false)
+      : runtime_error(msg), id(id), delta(delta), resolved(resolved) {}
+
+  // Moves the error from child i of `parent` to `parent`
+  void enter(const Node& parent, size_t i) {
+    if (!resolved) {
+      id = parent.id;
+      delta += parent.nodes.offset(i);
+    }
+  }
+};
+
+struct InternStats {
+  size_t nodes = 0;   // before sharing
+  size_t unique = 0;  // after sharing
+
+  double ratio() const { return unique ? double(nodes) / unique : 1; }
+};
+
+// A lowered program. Nodes and child arrays live in arenas owned here, so a
+// program must outlive the functions defined from it.
+//
+// A program parsed lazily has a LAZY node, whose token is the source of the
+// body, in place of the body of each definition. body() parses it on first
+// use, adding its nodes under a lock; existing nodes never change, so they
+// can be read meanwhile, and the source map takes its own lock to add and
+// look up positions and names.
+struct Program {
+  const Node* root = nullptr;
+  string_view source;
+  SourceMap source_map;
+  InternStats stats;
+  size_t depth = 0;  // height of the node tree, bodies included
+  bool lazy = false;
+  size_t max_nesting = Config().max_nesting;  // for the bodies left LAZY
+  vector<string_view> loop_variables;         // of the bodies left LAZY
+  PerfectHash globals;  // names of the top-level definitions
+  shared_ptr<const ir::Module> module;  // set by ir::compile()
+
+  // Names bound anywhere in a lazy program, set by ir::compile() instead of
+  // `module`: the bodies are compiled on their first call
+  optional<set<string_view>> bound;
+
+  explicit Program(string_view source) : source(source), source_map(source) {}
+  Program(const Program&) = delete;
+
+  // `node`, or the body it stands for when it is a LAZY node
+  const Node& body(const Node& node) const;
+
+  // The code of `node`, a FOR loop moved to the IR by on-stack replacement
+  // or a LAZY body, made by `compile` the first time it is needed and kept
+  // with the program; null when the node can't be compiled
+  shared_ptr<const ir::Module> code(
+      const Node& node,
+      const function<shared_ptr<const ir::Module>()>& compile) const;
+
+  // Whether `token` is in the source of this program, as the tokens of its
+  // nodes are
+  bool has(string_view token) const {
+    auto begin = uintptr_t(source.data());
+    auto p = uintptr_t(token.data());
+    return begin <= p && p + token.size() <= begin + source.size();
+  }
+
+  // Definitions are only made at the top level, so once the program is
+  // parsed its global names are known.
+  void index_globals() {
+    vector<string_view> names;
+    auto add = [&](const Node& node) {
+      if (node.tag == "DEFINITION"_) {
+        names.push_back(node.nodes[0]->token);
+      }
+    };
+    if (root->tag == "STATEMENTS"_) {
+      for (auto node : root->nodes) {
+        add(*node);
+      }
+    } else {
+      add(*root);
+    }
+    globals = PerfectHash(names);
+  }
+
+  const Node* make_node(unsigned int tag, string_view token,
+                        Children children, size_t offset) {
+    auto& node = arena.emplace_back();
+    node.tag = tag;
+    node.id = source_map.add(offset);
+    node.token = token;
+    if (!children.empty()) {
+      auto words = Children::words(children.size());
+      auto data = make_unique<const Node*[]>(words);
+      memcpy(data.get(), children.data, words * sizeof(Node*));
+      node.nodes = {data.get(), children.count};
+      child_arrays.push_back(move(data));
+    }
+    return &node;
+  }
+
+  // Same format as peg::ast_to_s
+  void dump(ostream& out, const Node& node, int level = 0) const {
+    out << string(level * 2, ' ') << (node.nodes.empty() ? "- " : "+ ")
+        << source_map.name(node.tag);
+    if (node.nodes.empty()) {
+      out << " (" << node.token << ")";
+    }
+    out << endl;
+    for (auto child : node.nodes) {
+      dump(out, *child, level + 1);
+    }
+  }
+
+private:
+  deque<Node> arena;
+  vector<unique_ptr<const Node*[]>> child_arrays;
+  mutable mutex lazy_mutex;
+  mutable unordered_map<uint32_t, const Node*> bodies;  // by LAZY node ID
+  mutable mutex code_mutex;
+  mutable unordered_map<uint32_t, shared_ptr<const ir::Module>> codes;
+};
+
+// Creates the nodes of a program. Structurally identical subtrees, laid out
+// the same way in the source, are hash-consed into a single node, which
+// keeps the position of its first occurrence; the position of a node in
+// another occurrence is found from the enclosing nodes (see Error).
+// Top-level statements are never shared, since the analyzer reports their
+// positions and errors are resolved there.
+class NodeBuilder {
+public:
+  explicit NodeBuilder(Program& program)
+      : program(program), base(next_id()) {}
+
+  // A node starting at `offset` whose children start at `offsets`
+  const Node* make(unsigned int tag, const char* name, string_view token,
+                   const vector<const Node*>& children,
+                   const vector<size_t>& offsets, size_t offset) {
+    Node key{tag, 0, token, layout(children, offsets, offset)};
+    if (auto it = unique.find(&key); it != unique.end()) {
+      program.stats.nodes++;
+      return *it;
+    }
+    auto node = make_unique_node(tag, name, token, key.nodes, offset);
+    unique.insert(node);
+    return node;
+  }
+
+  const Node* make_unique_node(unsigned int tag, const char* name,
+                               string_view token,
+                               const vector<const Node*>& children,
+                               const vector<size_t>& offsets, size_t offset) {
+    return make_unique_node(tag, name, token,
+                            layout(children, offsets, offset), offset);
+  }
+
+  const Node* make_unique_node(unsigned int tag, const char* name,
+                               string_view token, Children children,
+                               size_t offset) {
+    program.stats.nodes++;
+    return create(tag, name, token, children, offset);
+  }
+
+  // `node` as a statement starting at `offset`. Nodes created before
+  // `first_id` belong to earlier statements and are copied.
+  const Node* statement(const Node* node, uint32_t first_id, size_t offset) {
+    if (node->id < first_id) {
+      const auto& name = program.source_map.name(node->tag);
+      node = create(node->tag, name.c_str(), node->token, node->nodes, offset);
+    }
+    return node;
+  }
+
+  uint32_t next_id() const { return uint32_t(program.source_map.size()); }
+
+private:
+  // Adds a node to the program without counting it as a node of the source,
+  // which a copied statement is already counted as
+  const Node* create(unsigned int tag, const char* name, string_view token,
+                     Children children, size_t offset) {
+    program.stats.unique++;
+    program.source_map.add_name(tag, name);
+    auto node = program.make_node(tag, token, children, offset);
+
+    uint32_t height = 0;
+    for (auto child : children) {
+      height = max(height, heights[child->id - base]);
+    }
+    heights.push_back(height + 1);
+    // Only written when it grows, which a body parsed lazily never does, as
+    // skimming counted it already and other threads may be reading it
+    if (height + 1 > program.depth) {
+      program.depth = height + 1;
+    }
+    return node;
+  }
+
+  struct Hash {
+    size_t operator()(const Node* node) const {
+      auto h = hash<string_view>()(node->token) ^ node->tag;
+      for (size_t i = 0; i < node->nodes.size(); i++) {
+        h = h * 31 + hash<const Node*>()(node->nodes[i]);
+        h = h * 31 + node->nodes.offset(i);
+      }
+      return h;
+    }
+  };
+
+  struct Equal {
+    bool operator()(const Node* a, const Node* b) const {
+      return a->tag == b->tag && a->token == b->token &&
+             a->nodes.size() == b->nodes.size() &&
+             memcmp(a->nodes.data, b->nodes.data,
+                    Children::words(a->nodes.size()) * sizeof(Node*)) == 0;
+    }
+  };
+
+  Program& program;
+  uint32_t base;  // ID of the first node created here
+  unordered_set<const Node*, Hash, Equal> unique;
+  vector<uint32_t> heights;  // by node ID - base
+  vector<const Node*> scratch;  // the children of the node being made
+
+  // `children` in the storage of Children, in `scratch`
+  Children layout(const vector<const Node*>& children,
+                  const vector<size_t>& offsets, size_t offset) {
+    auto count = children.size();
+    scratch.assign(Children::words(count), nullptr);
+    copy(children.begin(), children.end(), scratch.begin());
+    auto data = reinterpret_cast<char*>(scratch.data() + count);
+    for (size_t i = 0; i < count; i++) {
+      auto delta = uint32_t(offsets[i] - offset);
+      memcpy(data + i * sizeof(delta), &delta, sizeof(delta));
+    }
+    return {scratch.data(), uint32_t(count)};
+  }
+};
+
+// Converts an optimized peglib AST into nodes
+class Lowering {
+public:
+  explicit Lowering(Program& program) : program(program), builder(program) {}
+
+  void lower_program(const Ast& ast) {
+    if (ast.tag == "STATEMENTS"_) {
+      vector<const Node*> statements;
+      vector<size_t> offsets;
+      for (const auto& node : ast.nodes) {
+        auto first_id = builder.next_id();
+        offsets.push_back(offset(*node));
+        statements.push_back(
+            builder.statement(lower(*node), first_id, offsets.back()));
+      }
+      program.root = builder.make_unique_node(
+          ast.tag, ast.name.c_str(), ast.token, statements, offsets, 0);
+    } else {
+      program.root = lower(ast);
+    }
+  }
+
+private:
+  Program& program;
+  NodeBuilder builder;
+
+  // peg::Ast positions are not used, as AstOptimizer does not keep them for
+  // collapsed nodes.
+  size_t offset(const Ast& ast) const {
+    return program.source_map.offset(ast.line, ast.column);
+  }
+
+  const Node* lower(const Ast& ast) {
+    vector<const Node*> children;
+    vector<size_t> offsets;
+    for (const auto& node : ast.nodes) {
+      children.push_back(lower(*node));
+      offsets.push_back(offset(*node));
+    }
+    return builder.make(ast.tag, ast.name.c_str(), ast.token, children,
+                        offsets, offset(ast));
+  }
+};
+
+// Parses with peglib and the grammar above. The recursive descent uses the
+// C++ stack for nesting, so this is kept as the reference for parse().
+inline shared_ptr<Program> parse_peg(const string& source, ostream& out,
+                                     const Config& config = Config()) {
+  auto timeline = config.timeline;
+  parser pg(grammar);
+  if (timeline) {
+    timeline->mark("grammar");
+  }
+
+  pg.log = [&](size_t ln, size_t col, const string& msg) {
+    out << ln << ":" << col << ": " << msg << endl;
+  };
+
+  pg.enable_ast();
+
+  FIBLANG_PROBE2(parse__start, source.data(), source.size());
+  shared_ptr<Ast> ast;
+  if (pg.parse(source, ast)) {
+    ast = AstOptimizer(true).optimize(ast);
+
+    auto program = make_shared<Program>(source);
+    Lowering(*program).lower_program(*ast);
+    program->index_globals();
+    FIBLANG_PROBE1(parse__done, program->stats.nodes);
+
+    if (timeline) {
+      timeline->mark("parse");
+    }
+    return program;
+  }
+  FIBLANG_PROBE1(parse__done, size_t(0));
+  return nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// Explicit-stack parser
+//-----------------------------------------------------------------------------
+
+// Parses the grammar above into the same nodes as parse_peg(), keeping the
+// partially parsed rules on a heap stack instead of the C++ stack, so that
+// nesting is bounded by memory and Program::max_nesting only.
+//
+// When `lazy`, the bodies of definitions are only checked (skimmed), without
+// creating nodes, and each becomes a LAZY node for Program::body().
+class StackParser {
+public:
+  struct Failure {
+    size_t offset;
+    string message;
+  };
+
+  StackParser(string_view source, Program& program, bool lazy = false)
+      : source(source), program(program), builder(program), lazy(lazy) {}
+
+  // Parses from `begin` to the end of the source and returns the root node.
+  // Throws Failure on a syntax error.
+  const Node* parse(size_t begin = 0) {
+    pos = begin;
+    skip();
+    push(Rule::Statements);
+    mode = statement() ? Mode::Done : Mode::Expression;
+    while (mode != Mode::Done) {
+      switch (mode) {
+        case Mode::Expression:
+          // TERNARY ← CONDITION ('?' EXPRESSION ':' EXPRESSION)?
+          if (++depth > program.max_nesting) {
+            fail_at(pos, "nesting exceeds the maximum depth of " +
+                             to_string(program.max_nesting) + ".");
+          }
+          push(Rule::Ternary);
+          push(Rule::Condition);
+          [[fallthrough]];
+        case Mode::Infix:
+          push(Rule::Infix);
+          [[fallthrough]];
+        case Mode::Call:
+          push(Rule::Call);
+          primary();
+          break;
+        case Mode::Reduce:
+          reduce();
+          break;
+        case Mode::Done:
+          break;
+      }
+    }
+    return root;
+  }
+
+private:
+  enum class Rule {
+    Statements,
+    Definition,
+    Ternary,
+    Condition,
+    Infix,
+    Call,
+    Parens,
+    For
+  };
+
+  // What the loop does next: start parsing a rule, or hand `value` to the
+  // rule on top of the stack.
+  enum class Mode { Expression, Infix, Call, Reduce, Done };
+
+  struct Frame {
+    Rule rule;
+    int stage;
+    size_t offset;
+    vector<const Node*> nodes;
+    vector<size_t> offsets;  // where the nodes start
+  };
+
+  string_view source;
+  Program& program;
+  NodeBuilder builder;
+  vector<Frame> stack;  // frames above `top` are kept for their capacity
+  size_t top = 0;
+  size_t pos = 0;
+  size_t depth = 0;
+  Mode mode = Mode::Expression;
+  const Node* value = nullptr;
+  size_t value_offset = 0;  // where `value` starts
+  const Node* root = nullptr;
+  uint32_t statement_id = 0;
+  size_t statement_offset = 0;
+  size_t token_end = 0;  // end of the last token, before the whitespace
+  bool lazy;
+  bool skimming = false;  // in a body that gets a LAZY node
+  size_t body_offset = 0;
+  Node skimmed{};  // what skimmed rules produce
+
+  void push(Rule rule) {
+    if (top == stack.size()) {
+      stack.emplace_back();
+    }
+    auto& f = stack[top++];
+    f.rule = rule;
+    f.stage = 0;
+    f.offset = pos;
+    f.nodes.clear();
+    f.offsets.clear();
+    if (skimming) {
+      // A node is at most one level per rule deep, so the body parsed later
+      // fits in the stack with_stack() sets up for the program.
+      program.depth = max(program.depth, top);
+    }
+  }
+
+  Frame& frame() { return stack[top - 1]; }
+
+  // Adds a child to the rule on top of the stack
+  void add(const Node* node, size_t offset) {
+    frame().nodes.push_back(node);
+    frame().offsets.push_back(offset);
+  }
+
+  void pop() {
+    if (frame().rule == Rule::Ternary) {
+      depth--;
+    }
+    top--;
+  }
+
+  // STATEMENTS ← (DEFINITION / EXPRESSION)*
+  // Starts the next statement, or returns true at the end of the input.
+  bool statement() {
+    if (pos == source.size()) {
+      auto& f = frame();
+      root = f.nodes.size() == 1
+                 ? f.nodes[0]
+                 : builder.make_unique_node("STATEMENTS"_, "STATEMENTS", "",
+                                            f.nodes, f.offsets, 0);
+      return true;
+    }
+
+    statement_id = builder.next_id();
+    statement_offset = pos;
+    if (keyword(pos, "def")) {
+      // DEFINITION ← 'def' Identifier '(' Identifier ')' EXPRESSION
+      push(Rule::Definition);
+      literal("def");
+      identifier();
+      add(value, value_offset);
+      expect("(");
+      identifier();
+      add(value, value_offset);
+      expect(")");
+      if (lazy) {
+        skimming = true;
+        body_offset = pos;
+      }
+    }
+    return false;
+  }
+
+  // PRIMARY ← FOR / Identifier / '(' EXPRESSION ')' / Number
+  void primary() {
+    if (keyword(pos, "for")) {
+      // FOR ← 'for' Identifier 'from' Number 'to' Number EXPRESSION
+      push(Rule::For);
+      literal("for");
+      identifier();
+      if (skimming) {
+        // The IR needs the names bound anywhere, bodies included
+        program.loop_variables.push_back(
+            source.substr(value_offset, token_end - value_offset));
+      }
+      add(value, value_offset);
+      expect("from");
+      number();
+      add(value, value_offset);
+      expect("to");
+      number();
+      add(value, value_offset);
+      mode = Mode::Expression;
+    } else if (pos < source.size() && isalpha(source[pos])) {
+      identifier();
+      mode = Mode::Reduce;
+    } else if (literal("(")) {
+      push(Rule::Parens);
+      mode = Mode::Expression;
+    } else if (pos < source.size() && isdigit(source[pos])) {
+      number();
+      mode = Mode::Reduce;
+    } else {
+      fail("'for', Identifier, '(' or Number");
+    }
+  }
+
+  // Hands `value` to the rule on top of the stack, which either asks for
+  // the next operand or completes and passes its own node down.
+  void reduce() {
+    auto& f = frame();
+    switch (f.rule) {
+      case Rule::Statements:
+        add(builder.statement(value, statement_id, statement_offset),
+            statement_offset);
+        mode = statement() ? Mode::Done : Mode::Expression;
+        return;
+      case Rule::Definition:
+        if (skimming) {
+          skimming = false;
+          value = builder.make_unique_node(
+              "LAZY"_, "LAZY",
+              source.substr(body_offset, token_end - body_offset), {}, {},
+              body_offset);
+          value_offset = body_offset;
+        }
+        add(value, value_offset);
+        complete("DEFINITION"_, "DEFINITION");
+        return;
+      case Rule::Ternary:
+        // CONDITION ('?' EXPRESSION ':' EXPRESSION)?
+        if (f.stage == 0) {
+          if (literal("?")) {
+            add(value, value_offset);
+            f.stage = 1;
+            mode = Mode::Expression;
+          } else {
+            pop();
+          }
+        } else if (f.stage == 1) {
+          add(value, value_offset);
+          expect(":");
+          f.stage = 2;
+          mode = Mode::Expression;
+        } else {
+          add(value, value_offset);
+          complete("TERNARY"_, "TERNARY");
+        }
+        return;
+      case Rule::Condition:
+        // INFIX (ConditionOperator INFIX)?
+        if (f.stage == 0) {
+          auto offset = pos;
+          if (literal("<")) {
+            add(value, value_offset);
+            add(make("ConditionOperator"_, "ConditionOperator",
+                     source.substr(offset, 1), {}, {}, offset),
+                offset);
+            f.stage = 1;
+            mode = Mode::Infix;
+          } else {
+            pop();
+          }
+        } else {
+          add(value, value_offset);
+          complete("CONDITION"_, "CONDITION");
+        }
+        return;
+      case Rule::Infix: {
+        // CALL (InfixOperator CALL)*
+        add(value, value_offset);
+        auto offset = pos;
+        if (literal("+") || literal("-")) {
+          add(make("InfixOperator"_, "InfixOperator", source.substr(offset, 1),
+                   {}, {}, offset),
+              offset);
+          mode = Mode::Call;
+        } else if (f.nodes.size() == 1) {
+          pop();
+        } else {
+          complete("INFIX"_, "INFIX");
+        }
+        return;
+      }
+      case Rule::Call:
+        // PRIMARY ('(' EXPRESSION ')')?
+        if (f.stage == 0) {
+          if (literal("(")) {
+            add(value, value_offset);
+            f.stage = 1;
+            mode = Mode::Expression;
+          } else {
+            pop();
+          }
+        } else {
+          add(value, value_offset);
+          expect(")");
+          complete("CALL"_, "CALL");
+        }
+        return;
+      case Rule::Parens:
+        expect(")");
+        pop();
+        return;
+      case Rule::For:
+        add(value, value_offset);
+        complete("FOR"_, "FOR");
+        return;
+    }
+  }
+
+  // Builds the node of the rule on top of the stack and pops it
+  void complete(unsigned int tag, const char* name) {
+    const auto& f = frame();
+    value = make(tag, name, "", f.nodes, f.offsets, f.offset);
+    value_offset = f.offset;
+    pop();
+    mode = Mode::Reduce;
+  }
+
+  const Node* make(unsigned int tag, const char* name, string_view token,
+                   const vector<const Node*>& children,
+                   const vector<size_t>& offsets, size_t offset) {
+    if (skimming) {
+      return &skimmed;
+    }
+    return builder.make(tag, name, token, children, offsets, offset);
+  }
+
+  // Tokens
+
+  void skip() {
+    token_end = pos;
+    while (pos < source.size() && strchr(" \t\r\n", source[pos])) {
+      pos++;
+    }
+  }
+
+  // %word ← [a-zA-Z]: a keyword must not be followed by a word character.
+  bool keyword(size_t at, string_view word) const {
+    auto end = at + word.size();
+    return source.substr(at, word.size()) == word &&
+           (end == source.size() || !isalpha(source[end]));
+  }
+
+  bool literal(string_view s) {
+    if (isalpha(s[0]) ? !keyword(pos, s) : source.substr(pos, s.size()) != s) {
+      return false;
+    }
+    pos += s.size();
+    skip();
+    return true;
+  }
+
+  void expect(string_view s) {
+    if (!literal(s)) {
+      fail("'" + string(s) + "'");
+    }
+  }
+
+  // Identifier ← !Keyword < [a-zA-Z][a-zA-Z0-9_]* >, into `value`
+  void identifier() {
+    auto start = pos;
+    if (start == source.size() || !isalpha(source[start]) ||
+        keyword(start, "def") || keyword(start, "for") ||
+        keyword(start, "from") || keyword(start, "to")) {
+      fail("Identifier");
+    }
+    while (pos < source.size() &&
+           (isalnum(source[pos]) || source[pos] == '_')) {
+      pos++;
+    }
+    auto token = source.substr(start, pos - start);
+    skip();
+    value = make("Identifier"_, "Identifier", token, {}, {}, start);
+    value_offset = start;
+  }
+
+  // Number ← < [0-9]+ >, into `value`
+  void number() {
+    auto start = pos;
+    while (pos < source.size() && isdigit(source[pos])) {
+      pos++;
+    }
+    if (pos == start) {
+      fail("Number");
+    }
+    auto token = source.substr(start, pos - start);
+    skip();
+    value = make("Number"_, "Number", token, {}, {}, start);
+    value_offset = start;
+  }
+
+  [[noreturn]] void fail(const string& expecting) {
+    auto end = pos + 1;
+    while (end < source.size() && isalnum(source[pos]) &&
+           (isalnum(source[end]) || source[end] == '_')) {
+      end++;
+    }
+    auto unexpected = pos == source.size()
+                          ? string("end of input")
+                          : "'" + string(source.substr(pos, end - pos)) + "'";
+    fail_at(pos, "syntax error, unexpected " + unexpected + ", expecting " +
+                     expecting + ".");
+  }
+
+  [[noreturn]] void fail_at(size_t offset, const string& message) {
+    throw Failure{offset, message};
+  }
+};
+
+// Parses `source`, logging syntax errors to `out` as `line:col: message`.
+// A `lazy` program only checks the syntax of the bodies of its definitions,
+// and parses each on its first use.
+inline shared_ptr<Program> parse(const string& source, ostream& out,
+                                 bool lazy = false,
+                                 const Config& config = Config()) {
+  FIBLANG_PROBE2(parse__start, source.data(), source.size());
+  auto program = make_shared<Program>(source);
+  program->lazy = lazy;
+  program->max_nesting = config.max_nesting;
+  try {
+    program->root = StackParser(source, *program, lazy).parse();
+  } catch (const StackParser::Failure& e) {
+    FIBLANG_PROBE1(parse__done, size_t(0));
+    auto [line, column] = program->source_map.line_column(e.offset);
+    out << line << ":" << column << ": " << e.message << endl;
+    return nullptr;
+  }
+  program->index_globals();
+  FIBLANG_PROBE1(parse__done, program->stats.nodes);
+
+  if (config.timeline) {
+    config.timeline->mark("parse");
+  }
+  return program;
+}
+
+inline const Node& Program::body(const Node& node) const {
+  if (node.tag != "LAZY"_) {
+    return node;
+  }
+  lock_guard<mutex> lock(lazy_mutex);
+  auto& body = bodies[node.id];
+  if (!body) {
+    // The syntax was checked when skimming, so this can't fail. Only the
+    // source up to the end of the body is given to the parser.
+    auto& program = const_cast<Program&>(*this);
+    auto begin = size_t(node.token.data() - source.data());
+    body = StackParser(source.substr(0, begin + node.token.size()), program)
+               .parse(begin);
+  }
+  return *body;
+}
+
+inline shared_ptr<const ir::Module> Program::code(
+    const Node& node,
+    const function<shared_ptr<const ir::Module>()>& compile) const {
+  lock_guard<mutex> lock(code_mutex);
+  auto [it, added] = codes.emplace(node.id, nullptr);
+  if (added) {
+    it->second = compile();
+  }
+  return it->second;
+}
+
+// Stack needed by eval() and the analyzer for each level of nesting
+inline size_t stack_per_level = 2048;
+
+// Runs `f` on a thread with a stack large enough for `depth` levels of
+// nesting when the default stack may not be, rethrowing its exceptions.
+inline void with_stack(size_t depth, const function<void()>& f) {
+  const size_t default_stack = size_t(4) << 20;
+  auto size = depth * stack_per_level;
+  if (size < default_stack) {
+    f();
+    return;
+  }
+
+  struct Task {
+    const function<void()>& f;
+    exception_ptr error;
+  } task{f, nullptr};
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, size + default_stack);
+  pthread_t thread;
+  auto ret = pthread_create(
+      &thread, &attr,
+      [](void* p) -> void* {
+        auto& task = *static_cast<Task*>(p);
+        try {
+          task.f();
+        } catch (...) {
+          task.error = current_exception();
+        }
+        return nullptr;
+      },
+      &task);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    throw runtime_error("can't create a thread for deep nesting.");
+  }
+  pthread_join(thread, nullptr);
+  if (task.error) {
+    rethrow_exception(task.error);
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Value
+//-----------------------------------------------------------------------------
+
+// Intrusive reference count (`T::refs`) for objects that never leave the
+// thread that owns them, without the atomic updates of shared_ptr. An object
+// whose count is `shared` is owned by something else and its count is never
+// written, so handles to it may be copied on any thread.
+template <typename T> class Rc {
+public:
+  static constexpr size_t shared = SIZE_MAX;
+
+  Rc() = default;
+  Rc(nullptr_t) {}
+  explicit Rc(T* p) : p(p) { retain(); }
+  Rc(const Rc& rhs) : p(rhs.p) { retain(); }
+  Rc(Rc&& rhs) noexcept : p(rhs.p) { rhs.p = nullptr; }
+
+  Rc& operator=(Rc rhs) noexcept {
+    swap(p, rhs.p);
+    return *this;
+  }
+
+  ~Rc() {
+    if (p && p->refs != shared && --p->refs == 0) {
+      delete p;
+    }
+  }
+
+  T* get() const { return p; }
+  T* operator->() const { return p; }
+  T& operator*() const { return *p; }
+  explicit operator bool() const { return p != nullptr; }
+
+private:
+  T* p = nullptr;
+
+  void retain() {
+    if (p && p->refs != shared) {
+      p->refs++;
+    }
+  }
+};
+
+template <typename T, typename... Args> Rc<T> make_rc(Args&&... args) {
+  return Rc<T>(new T(forward<Args>(args)...));
+}
+
+struct Value;
+struct Environment;
+struct LazyBody;
+
+struct Function {
+  string_view param;
+  function<Value(Rc<Environment> env)> eval;
+  const ir::Function* code = nullptr;  // for calls from IR
+  shared_ptr<LazyBody> lazy;           // of a body parsed on the first call
+
+  Function(string_view param, function<Value(Rc<Environment> env)>&& eval)
+      : param(param), eval(eval) {}
+};
+
+// The storage of a function value, shared by the copies of the value
+struct Closure {
+  Function fn;
+  mutable size_t refs = 0;
+};
+
+struct Value {
+  enum class Type { Nil, Bool, Long, BigInt, Function };
+  Type type;
+  long n = 0;  // Long values live here, so they never touch `v`
+  any v;
+  //variant<nullptr_t, bool, long, string_view, Function> v;
+
+  // Constructor
+  Value() : type(Type::Nil) {}
+  explicit Value(bool b) : type(Type::Bool), v(b) {}
+  explicit Value(long l) : type(Type::Long), n(l) {}
+
+  // A BigInt that fits is demoted back to a Long, so a BigInt value is
+  // always out of the Long range.
+  explicit Value(BigInt&& b) : type(Type::Long) {
+    if (b.fits_long()) {
+      n = b.to_long();
+    } else {
+      type = Type::BigInt;
+      v = make_shared<const BigInt>(move(b));
+    }
+  }
+  // Shared, so copying a function value (a global load) doesn't allocate
+  explicit Value(Function&& f)
+      : type(Type::Function), v(make_rc<const Closure>(Closure{move(f)})) {}
+  explicit Value(Rc<const Closure> c) : type(Type::Function), v(move(c)) {}
+
+  // Cast value
+  bool to_bool() const {
+    switch (type) {
+      case Type::Bool:
+        return any_cast<bool>(v);
+      case Type::Long:
+        return n != 0;
+      case Type::BigInt:
+        return !big().is_zero();
+      default:
+        throw runtime_error("type error.");
+    }
+  }
+
+  long to_long() const {
+    switch (type) {
+      case Type::Long:
+        return n;
+      case Type::BigInt:
+        if (big().fits_long()) {
+          return big().to_long();
+        }
+        throw runtime_error("integer overflow.");
+      default:
+        throw runtime_error("type error.");
+    }
+  }
+
+  // Integer value as BigInt, converting a Long into `tmp`
+  const BigInt& to_bigint(BigInt& tmp) const {
+    switch (type) {
+      case Type::Long:
+        tmp = BigInt(n);
+        return tmp;
+      case Type::BigInt:
+        return big();
+      default:
+        throw runtime_error("type error.");
+    }
+  }
+
+  Function to_function() const {
+    switch (type) {
+      case Type::Function:
+        return closure()->fn;
+      default:
+        throw runtime_error("type error.");
+    }
+  }
+
+  const Function& as_function() const {
+    switch (type) {
+      case Type::Function:
+        return closure()->fn;
+      default:
+        throw runtime_error("type error.");
+    }
+  }
+
+  // Comparison
+  bool operator<(const Value& rhs) const {
+    switch (type) {
+      case Type::Nil:
+        return false;
+      case Type::Bool:
+        return to_bool() < rhs.to_bool();
+      case Type::Long:
+        if (rhs.type == Type::Long) {
+          return n < rhs.n;
+        }
+        [[fallthrough]];
+      case Type::BigInt: {
+        BigInt l, r;
+        return to_bigint(l) < rhs.to_bigint(r);
+      }
+      default:
+        throw logic_error("invalid internal condition.");
+    }
+    // NOTREACHED
+  }
+
+  // Arithmetic, promoting to BigInt when a Long would overflow and demoting
+  // when the result fits again
+  Value operator+(const Value& rhs) const {
+    long ret;
+    if (type == Type::Long && rhs.type == Type::Long &&
+        !__builtin_add_overflow(n, rhs.n, &ret)) {
+      return Value(ret);
+    }
+    BigInt l, r;
+    return Value(to_bigint(l) + rhs.to_bigint(r));
+  }
+
+  Value operator-(const Value& rhs) const {
+    long ret;
+    if (type == Type::Long && rhs.type == Type::Long &&
+        !__builtin_sub_overflow(n, rhs.n, &ret)) {
+      return Value(ret);
+    }
+    BigInt l, r;
+    return Value(to_bigint(l) - rhs.to_bigint(r));
+  }
+
+  // String representation
+  string str() const {
+    switch (type) {
+      case Type::Nil:
+        return "nil";
+      case Type::Bool:
+        return to_bool() ? "true" : "false";
+      case Type::Long:
+        return std::to_string(to_long());
+      case Type::BigInt:
+        return big().str();
+      case Type::Function:
+        return "[function]";
+      default:
+        throw logic_error("invalid internal condition.");
+    }
+  }
+
+  // Big integers are streamed rather than converted to a string first
+  friend ostream& operator<<(ostream& out, const Value& val) {
+    if (val.type == Type::BigInt) {
+      return out << val.big();
+    }
+    return out << val.str();
+  }
+
+  // Copies of a function value count their closure unless it is shared
+  const Rc<const Closure>& closure() const {
+    return *any_cast<Rc<const Closure>>(&v);
+  }
+
+private:
+  const BigInt& big() const {
+    return **any_cast<shared_ptr<const BigInt>>(&v);
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Global snapshots
+//-----------------------------------------------------------------------------
+
+// Global definitions shared by concurrent evaluations. Each version of the
+// table is immutable: publish() rebuilds the current version with the new
+// definitions and swaps it in, while readers keep using the version they
+// pinned without taking a lock. A replaced version is freed by the next
+// publish() once no reader slot holds it, so a long-lived pin only keeps its
+// own version. A function value read from a version stays valid while that
+// version is pinned.
+class Globals {
+public:
+  using Table = map<string_view, Value>;
+
+  // Values by slot of a perfect hash of their names
+  struct Snapshot {
+    PerfectHash names;
+    vector<Value> values;
+    uint64_t version = 0;
+
+    const Value* find(string_view s) const {
+      auto slot = names.find(s);
+      return slot != PerfectHash::npos ? &values[slot] : nullptr;
+    }
+  };
+
+  // Reader slots are added in blocks of this many as more pins are held at
+  // once
+  static constexpr size_t block_readers = 256;
+
+private:
+  struct alignas(64) Reader {
+    atomic<const Snapshot*> snapshot{nullptr};  // nullptr when free
+  };
+
+public:
+  // A snapshot in use, announced in a reader slot until released
+  class Pin {
+  public:
+    Pin() = default;
+    Pin(Pin&& rhs) { *this = move(rhs); }
+
+    Pin& operator=(Pin&& rhs) {
+      release();
+      swap(reader, rhs.reader);
+      swap(snapshot, rhs.snapshot);
+      return *this;
+    }
+
+    ~Pin() { release(); }
+
+    explicit operator bool() const { return snapshot != nullptr; }
+    const Snapshot* operator->() const { return snapshot; }
+    const Snapshot& operator*() const { return *snapshot; }
+
+  private:
+    friend class Globals;
+
+    Reader* reader = nullptr;
+    const Snapshot* snapshot = nullptr;
+
+    void release() {
+      if (reader) {
+        reader->snapshot.store(nullptr, memory_order_release);
+        reader = nullptr;
+        snapshot = nullptr;
+      }
+    }
+  };
+
+  Globals() : current(new Snapshot) {}
+
+  explicit Globals(Table&& values) : Globals() { publish(move(values)); }
+
+  Globals(const Globals&) = delete;
+
+  // All pins must have been released.
+  ~Globals() {
+    for (auto snapshot : retired) {
+      delete snapshot;
+    }
+    delete current.load();
+    for (auto block = readers.next.load(); block;) {
+      auto next = block->next.load();
+      delete block;
+      block = next;
+    }
+  }
+
+  // Takes a free reader slot, adding a block of them when all are held
+  Pin pin() const {
+    Pin pin;
+    auto start = hash<thread::id>()(this_thread::get_id());
+    for (auto block = &readers;;) {
+      for (size_t i = 0; i < block_readers; i++) {
+        auto& reader = block->slots[(start + i) % block_readers];
+        const Snapshot* free = nullptr;
+        auto snapshot = current.load();
+        if (!reader.snapshot.compare_exchange_strong(free, snapshot)) {
+          continue;
+        }
+        // The version may have been replaced (and freed) before the slot
+        // announced it; it is safe once it is still current afterwards.
+        while (current.load() != snapshot) {
+          snapshot = current.load();
+          reader.snapshot.store(snapshot);
+        }
+        pin.reader = &reader;
+        pin.snapshot = snapshot;
+        return pin;
+      }
+      auto next = block->next.load();
+      if (!next) {
+        auto added = new Readers;
+        if (block->next.compare_exchange_strong(next, added)) {
+          next = added;
+        } else {
+          delete added;
+        }
+      }
+      block = next;
+    }
+  }
+
+  // Publishes `values` as a new version. Names already defined are replaced.
+  void publish(Table&& values) {
+    lock_guard<mutex> lock(writer);
+    auto old = current.load();
+    for (uint32_t i = 0; i < old->values.size(); i++) {
+      values.emplace(old->names.name(i), old->values[i]);
+    }
+
+    vector<string_view> names;
+    for (const auto& [name, _] : values) {
+      names.push_back(name);
+    }
+    auto next = new Snapshot{PerfectHash(names), {}, old->version + 1};
+    next->values.resize(names.size());
+    for (auto& [name, value] : values) {
+      next->values[next->names.find(name)] = share(move(value));
+    }
+    current.store(next);
+    retired.push_back(old);
+    reclaim();
+  }
+
+  uint64_t version() const { return current.load()->version; }
+
+  // Versions replaced but still pinned
+  size_t pending() const {
+    lock_guard<mutex> lock(writer);
+    return retired.size();
+  }
+
+  // Function values held for the current and pinned versions
+  size_t closures() const {
+    lock_guard<mutex> lock(writer);
+    return shared.size();
+  }
+
+private:
+  struct Readers {
+    array<Reader, block_readers> slots;
+    atomic<Readers*> next{nullptr};
+  };
+
+  atomic<const Snapshot*> current;
+  mutable Readers readers;  // the first block, the others linked from it
+
+  mutable mutex writer;
+  vector<const Snapshot*> retired;
+  vector<unique_ptr<Closure>> shared;
+
+  // Any thread may copy the values of a version, so their functions are
+  // copied into closures whose counts are never written, freed with the
+  // last version that holds them
+  Value share(Value&& value) {
+    if (value.type != Value::Type::Function ||
+        value.closure()->refs == Rc<const Closure>::shared) {
+      return move(value);
+    }
+    shared.push_back(make_unique<Closure>(
+        Closure{value.as_function(), Rc<const Closure>::shared}));
+    return Value(Rc<const Closure>(shared.back().get()));
+  }
+
+  void reclaim() {
+    vector<const Snapshot*> pinned;
+    for (auto block = &readers; block; block = block->next.load()) {
+      for (const auto& reader : block->slots) {
+        if (auto snapshot = reader.snapshot.load()) {
+          pinned.push_back(snapshot);
+        }
+      }
+    }
+    sort(pinned.begin(), pinned.end());
+    auto it = remove_if(retired.begin(), retired.end(), [&](auto snapshot) {
+      if (binary_search(pinned.begin(), pinned.end(), snapshot)) {
+        return false;
+      }
+      delete snapshot;
+      return true;
+    });
+    retired.erase(it, retired.end());
+
+    vector<const Closure*> held;
+    auto hold = [&](const Snapshot* snapshot) {
+      for (const auto& value : snapshot->values) {
+        if (value.type == Value::Type::Function) {
+          held.push_back(value.closure().get());
+        }
+      }
+    };
+    hold(current.load());
+    for (auto snapshot : retired) {
+      hold(snapshot);
+    }
+    sort(held.begin(), held.end());
+    shared.erase(remove_if(shared.begin(), shared.end(),
+                           [&](const auto& closure) {
+                             return !binary_search(held.begin(), held.end(),
+                                                   closure.get());
+                           }),
+                 shared.end());
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Metrics
+//-----------------------------------------------------------------------------
+
+// A counter written by a single thread and read by scrapes, so it needs no
+// atomic read-modify-write
+struct LocalCounter {
+  atomic<uint64_t> n{0};
+
+  void add(uint64_t k = 1) {
+    n.store(n.load(memory_order_relaxed) + k, memory_order_relaxed);
+  }
+  uint64_t get() const { return n.load(memory_order_relaxed); }
+};
+
+// Durations in HDR-style buckets: one per nanosecond below 2^sub_bits, then
+// 2^sub_bits buckets per power of two, so the bounds of a bucket are within
+// 1/2^sub_bits of each other at any scale. Written by a single thread.
+struct Histogram {
+  static constexpr int sub_bits = 3;
+  static constexpr size_t size = size_t(64 - sub_bits + 1) << sub_bits;
+
+  array<LocalCounter, size> buckets;
+  LocalCounter sum;  // nanoseconds
+
+  void record(uint64_t ns) {
+    buckets[index(ns)].add();
+    sum.add(ns);
+  }
+
+  static size_t index(uint64_t ns) {
+    if (ns < (uint64_t(1) << sub_bits)) {
+      return size_t(ns);
+    }
+    auto e = 63 - __builtin_clzll(ns);
+    return (size_t(e - sub_bits + 1) << sub_bits) +
+           size_t((ns >> (e - sub_bits)) & ((1 << sub_bits) - 1));
+  }
+
+  // Nanoseconds that all durations in bucket i are below
+  static double upper(size_t i) {
+    if (i < (size_t(1) << sub_bits)) {
+      return double(i + 1);
+    }
+    auto e = int(i >> sub_bits) + sub_bits - 1;
+    auto m = i & ((size_t(1) << sub_bits) - 1);
+    return ldexp(double((size_t(1) << sub_bits) + m + 1), e - sub_bits);
+  }
+};
+
+// Counters of the interpreters that run with `metrics` set. Each thread
+// writes its own shard, registered on its first update, and a scrape adds
+// the shards up, so the hot path never shares a cache line with another
+// thread or takes a lock (except for a function's first call on a thread).
+class Metrics {
+public:
+  struct Shard {
+    LocalCounter started;
+    LocalCounter requests;  // finished
+    LocalCounter errors;
+    Histogram request_time;
+    LocalCounter environments;
+    LocalCounter outputs;
+
+    // Call durations by function, including nested calls. Only the owner
+    // inserts, under the lock, so its lookups don't take it.
+    map<string, Histogram, less<>> functions;
+    mutex functions_mutex;
+
+    Histogram& function(string_view name) {
+      auto it = functions.find(name);
+      if (it == functions.end()) {
+        lock_guard<mutex> lock(functions_mutex);
+        it = functions.try_emplace(string(name)).first;
+      }
+      return it->second;
+    }
+  };
+
+  Metrics() : id(++last_id), start(Timeline::now()) {}
+
+  // The shard of the calling thread. A thread remembers its shards of the
+  // last few instances; a miss finds the shard by thread under the lock, so
+  // a thread that alternates between more instances still has one shard in
+  // each.
+  Shard& local() {
+    thread_local array<pair<uint64_t, Shard*>, 4> cache{};
+    auto& slot = cache[id % cache.size()];
+    if (slot.first != id) {
+      lock_guard<mutex> lock(shards_mutex);
+      auto [it, inserted] = owners.try_emplace(this_thread::get_id());
+      if (inserted) {
+        it->second = &shards.emplace_back();
+      }
+      slot = {id, it->second};
+    }
+    return *slot.second;
+  }
+
+  // A value read at each scrape, e.g. the length of a work queue
+  void gauge(string name, string help, function<double()> value) {
+    lock_guard<mutex> lock(shards_mutex);
+    gauges.push_back({move(name), move(help), move(value)});
+  }
+
+  // Prometheus text exposition format
+  void write(ostream& os) {
+    ostringstream out;
+    out << setprecision(10);
+
+    uint64_t started = 0, requests = 0, errors = 0;
+    uint64_t environments = 0, outputs = 0;
+    Totals request_time;
+    map<string, Totals> functions;
+    size_t threads = 0;
+    {
+      lock_guard<mutex> lock(shards_mutex);
+      threads = shards.size();
+      for (auto& s : shards) {
+        started += s.started.get();
+        requests += s.requests.get();
+        errors += s.errors.get();
+        environments += s.environments.get();
+        outputs += s.outputs.get();
+        request_time.add(s.request_time);
+        lock_guard<mutex> functions_lock(s.functions_mutex);
+        for (const auto& [name, h] : s.functions) {
+          functions[name].add(h);
+        }
+      }
+    }
+
+    header(out, "fiblang_requests_total", "counter", "Programs run.");
+    out << "fiblang_requests_total " << requests << "\n";
+    header(out, "fiblang_requests_in_flight", "gauge",
+           "Programs running now.");
+    out << "fiblang_requests_in_flight " << started - requests << "\n";
+    header(out, "fiblang_request_errors_total", "counter",
+           "Programs that stopped with an error.");
+    out << "fiblang_request_errors_total " << errors << "\n";
+    header(out, "fiblang_request_duration_seconds", "histogram",
+           "Time to run a program.");
+    request_time.write(out, "fiblang_request_duration_seconds", "");
+
+    uint64_t calls = 0;
+    for (const auto& [name, t] : functions) {
+      calls += t.count();
+    }
+    header(out, "fiblang_calls_total", "counter", "Function calls.");
+    out << "fiblang_calls_total " << calls << "\n";
+    header(out, "fiblang_call_duration_seconds", "histogram",
+           "Time in a function call, including the calls it makes.");
+    for (const auto& [name, t] : functions) {
+      // Names are identifiers, so they need no escaping.
+      t.write(out, "fiblang_call_duration_seconds",
+              "function=\"" + name + "\"");
+    }
+
+    header(out, "fiblang_environments_total", "counter",
+           "Environments allocated, one per call and loop iteration.");
+    out << "fiblang_environments_total " << environments << "\n";
+    header(out, "fiblang_outputs_total", "counter", "Lines printed by puts.");
+    out << "fiblang_outputs_total " << outputs << "\n";
+
+    uint64_t hits = 0, misses = 0;
+    for (const auto& cache : bigint::power_of_ten_caches()) {
+      hits += cache.hits;
+      misses += cache.misses;
+    }
+    header(out, "fiblang_memo_hits_total", "counter",
+           "Lookups answered by a cache.");
+    out << "fiblang_memo_hits_total{memo=\"powers_of_ten\"} " << hits << "\n";
+    header(out, "fiblang_memo_misses_total", "counter",
+           "Lookups that computed their value.");
+    out << "fiblang_memo_misses_total{memo=\"powers_of_ten\"} " << misses
+        << "\n";
+
+    // One pool per pinning policy, by label
+    const Affinity policies[] = {Affinity::none, Affinity::compact,
+                                 Affinity::scatter};
+    vector<vector<ThreadPool::Usage>> usage;
+    for (auto affinity : policies) {
+      usage.push_back(pool(affinity).worker_usage());
+    }
+    auto label = [&](size_t p) {
+      return "{affinity=\""s + affinity_name(policies[p]) + "\"";
+    };
+    header(out, "fiblang_pool_workers", "gauge", "Workers of each thread pool.");
+    for (size_t p = 0; p < usage.size(); p++) {
+      out << "fiblang_pool_workers" << label(p) << "} " << usage[p].size()
+          << "\n";
+    }
+    header(out, "fiblang_pool_queue_depth", "gauge",
+           "Batches of parallel tasks waiting for a thread.");
+    for (size_t p = 0; p < usage.size(); p++) {
+      out << "fiblang_pool_queue_depth" << label(p) << "} "
+          << pool(policies[p]).queued() << "\n";
+    }
+    header(out, "fiblang_pool_tasks_total", "counter",
+           "Tasks run by each worker.");
+    for (size_t p = 0; p < usage.size(); p++) {
+      for (size_t i = 0; i < usage[p].size(); i++) {
+        out << "fiblang_pool_tasks_total" << label(p) << ",worker=\"" << i
+            << "\"} " << usage[p][i].tasks << "\n";
+      }
+    }
+    header(out, "fiblang_pool_busy_seconds_total", "counter",
+           "Time each worker spent running tasks.");
+    for (size_t p = 0; p < usage.size(); p++) {
+      for (size_t i = 0; i < usage[p].size(); i++) {
+        out << "fiblang_pool_busy_seconds_total" << label(p) << ",worker=\""
+            << i << "\"} " << usage[p][i].busy_ns * 1e-9 << "\n";
+      }
+    }
+
+    header(out, "fiblang_metrics_threads", "gauge",
+           "Threads that have updated the metrics.");
+    out << "fiblang_metrics_threads " << threads << "\n";
+    header(out, "fiblang_uptime_seconds", "gauge",
+           "Time since the metrics were created.");
+    out << "fiblang_uptime_seconds " << (Timeline::now() - start) * 1e-9
+        << "\n";
+
+    // Called without the lock, since a gauge may read these metrics
+    vector<Gauge> values;
+    {
+      lock_guard<mutex> lock(shards_mutex);
+      values = gauges;
+    }
+    for (const auto& g : values) {
+      header(out, g.name, "gauge", g.help);
+      out << g.name << " " << g.value() << "\n";
+    }
+    os << out.str();
+  }
+
+private:
+  struct Gauge {
+    string name;
+    string help;
+    function<double()> value;
+  };
+
+  // A merged histogram
+  struct Totals {
+    array<uint64_t, Histogram::size> buckets{};
+    uint64_t sum = 0;
+
+    void add(const Histogram& h) {
+      for (size_t i = 0; i < Histogram::size; i++) {
+        buckets[i] += h.buckets[i].get();
+      }
+      sum += h.sum.get();
+    }
+
+    uint64_t count() const {
+      return accumulate(buckets.begin(), buckets.end(), uint64_t(0));
+    }
+
+    // Only the buckets that have durations, as cumulative `le` bounds
+    void write(ostream& out, const string& name, const string& labels) const {
+      auto sep = labels.empty() ? "" : ",";
+      uint64_t n = 0;
+      for (size_t i = 0; i < Histogram::size; i++) {
+        if (buckets[i]) {
+          n += buckets[i];
+          out << name << "_bucket{" << labels << sep << "le=\""
+              << Histogram::upper(i) * 1e-9 << "\"} " << n << "\n";
+        }
+      }
+      out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << n
+          << "\n";
+      auto braced = labels.empty() ? "" : "{" + labels + "}";
+      out << name << "_sum" << braced << " " << sum * 1e-9 << "\n";
+      out << name << "_count" << braced << " " << n << "\n";
+    }
+  };
+
+  static void header(ostream& out, const string& name, const char* type,
+                     const string& help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+  }
+
+  static inline atomic<uint64_t> last_id{0};
+
+  uint64_t id;
+  long start;
+  mutex shards_mutex;
+  deque<Shard> shards;
+  map<thread::id, Shard*> owners;
+  vector<Gauge> gauges;
+};
+
+// Serves GET /metrics (Prometheus text format) and GET /health over HTTP on
+// a loopback port, or on a Unix socket when `address` is a path. Port 0
+// picks a free port. Requests are answered one at a time on a thread of
+// its own, since they only come from the odd scraper.
+class MetricsServer {
+public:
+  MetricsServer(Metrics& metrics, const string& address) : metrics(metrics) {
+    if (address.find('/') != string::npos) {
+      sockaddr_un sa{};
+      sa.sun_family = AF_UNIX;
+      if (address.size() >= sizeof(sa.sun_path)) {
+        throw runtime_error("metrics socket path is too long.");
+      }
+      memcpy(sa.sun_path, address.data(), address.size());
+      unlink(address.c_str());
+      fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      listen_on(reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+      path = address;
+      url = "unix:" + address;
+    } else {
+      if (address.empty() ||
+          address.find_first_not_of("0123456789") != string::npos) {
+        throw runtime_error("metrics address must be a port or a path.");
+      }
+      sockaddr_in sa{};
+      sa.sin_family = AF_INET;
+      sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      sa.sin_port = htons(uint16_t(stoul(address)));
+      fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      int one = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      listen_on(reinterpret_cast<sockaddr*>(&sa), sizeof(sa));
+      socklen_t len = sizeof(sa);
+      getsockname(fd, reinterpret_cast<sockaddr*>(&sa), &len);
+      url = "http://127.0.0.1:" + to_string(ntohs(sa.sin_port));
+    }
+    server = thread([this] { serve(); });
+  }
+
+  MetricsServer(const MetricsServer&) = delete;
+
+  ~MetricsServer() {
+    // Wakes up accept()
+    shutdown(fd, SHUT_RDWR);
+    server.join();
+    close(fd);
+    if (!path.empty()) {
+      unlink(path.c_str());
+    }
+  }
+
+  string url;
+
+private:
+  void listen_on(const sockaddr* sa, socklen_t len) {
+    if (fd < 0 || bind(fd, sa, len) < 0 || listen(fd, 16) < 0) {
+      auto error = string(strerror(errno));
+      if (fd >= 0) {
+        close(fd);
+      }
+      throw runtime_error("can't serve metrics: " + error + ".");
+    }
+  }
+
+  void serve() {
+    for (;;) {
+      auto client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        return;
+      }
+      respond(client);
+      close(client);
+    }
+  }
+
+  void respond(int client) {
+    timeval timeout{1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == string::npos && request.size() < 8192) {
+      auto n = recv(client, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        break;
+      }
+      request.append(buf, size_t(n));
+    }
+
+    // GET <target> HTTP/1.x
+    auto line = string_view(request).substr(0, request.find("\r\n"));
+    auto method = line.substr(0, line.find(' '));
+    auto target = line.substr(min(line.size(), method.size() + 1));
+    target = target.substr(0, target.find_first_of(" ?"));
+
+    auto status = "200 OK"s;
+    auto type = "text/plain; charset=utf-8"s;
+    string body;
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+      body = "method not allowed\n";
+    } else if (target == "/metrics") {
+      ostringstream out;
+      metrics.write(out);
+      body = out.str();
+      type = "text/plain; version=0.0.4; charset=utf-8";
+    } else if (target == "/health") {
+      body = "ok\n";
+    } else {
+      status = "404 Not Found";
+      body = "not found\n";
+    }
+
+    auto response = "HTTP/1.1 " + status + "\r\nContent-Type: " + type +
+                    "\r\nContent-Length: " + to_string(body.size()) +
+                    "\r\nConnection: close\r\n\r\n" + body;
+    for (size_t sent = 0; sent < response.size();) {
+      auto n = send(client, response.data() + sent, response.size() - sent,
+                    MSG_NOSIGNAL);
+      if (n <= 0) {
+        break;
+      }
+      sent += size_t(n);
+    }
+  }
+
+  Metrics& metrics;
+  int fd = -1;
+  string path;
+  thread server;
+};
+
+//-----------------------------------------------------------------------------
+// Environment
+//-----------------------------------------------------------------------------
+
+struct CallGraph;
+
+// The state of one running program: its settings, environments, output,
+// call graph and statistics. An instance and its environments belong to a
+// single thread at a time and must not outlive it, which lets environments
+// use non-atomic reference counts.
+//
+// Separate instances can run on separate threads. What they share is either
+// read-only (nodes, Globals snapshots) or synchronized:
+// - the IR of a program they both run, with its type feedback and the code
+//   specialized on it (Function::Profile), which any instance updates with
+//   atomics; the IR keeps the Config it was compiled with;
+// - big integer values, whose limbs are immutable and are shared through
+//   shared_ptr<const BigInt>, copied across instances with atomic reference
+//   counts, as by shared globals;
+// - the cached powers of ten, the thread pools and the counter that numbers
+//   Metrics, which lock or use atomics.
+class Interpreter {
+public:
+  struct Stats {
+    size_t calls = 0;
+    size_t environments = 0;
+    size_t outputs = 0;
+    size_t specializations = 0;  // functions specialized on type feedback
+    size_t deopts = 0;           // runs of specialized code abandoned
+    size_t osr = 0;              // FOR loops moved from eval() to the IR
+  };
+
+  ostream& out;
+  Config config;
+  CallGraph* callgraph = nullptr;
+  Metrics* metrics = nullptr;
+  const Program* program = nullptr;  // set by run(), to parse LAZY bodies
+  Stats stats;
+
+  // With its own copy of the builtins
+  explicit Interpreter(ostream& out = cout);
+
+  // Reading `globals` through a pinned snapshot. Definitions stay private
+  // to this instance until publish().
+  explicit Interpreter(Globals& globals, ostream& out = cout);
+
+  Interpreter(const Interpreter&) = delete;
+  ~Interpreter();
+
+  const Rc<Environment>& env() const { return root; }
+
+  // Runs the IR of the program when it has been compiled
+  Value run(const Program& program);
+  Value run(const Node& node);
+  void publish();
+
+private:
+  friend class ir::Executor;
+
+  Rc<Environment> root;
+  deque<Value> registers;  // of the IR executor
+
+  // Runs f() as one request in the metrics, with big integer operations
+  // on this thread following `config`
+  template <typename F> Value request(F&& f) {
+    struct Restore {
+      size_t threads = bigint::threads;
+      Affinity affinity = bigint::affinity;
+      ~Restore() {
+        bigint::threads = threads;
+        bigint::affinity = affinity;
+      }
+    } restore;
+    bigint::threads = config.threads;
+    bigint::affinity = config.affinity;
+    if (!metrics) {
+      return f();
+    }
+    struct Done {
+      Metrics::Shard& shard;
+      long start;
+      ~Done() {
+        shard.requests.add();
+        shard.request_time.record(uint64_t(Timeline::now() - start));
+      }
+    } done{metrics->local(), Timeline::now()};
+    done.shard.started.add();
+    try {
+      return f();
+    } catch (...) {
+      done.shard.errors.add();
+      throw;
+    }
+  }
+};
+
+struct Environment {
+  Rc<Environment> outer;
+  map<string_view, Value> values;
+  Interpreter* interpreter = nullptr;  // inherited from `outer`
+
+  // The outermost environment keeps the definitions of the program it runs
+  // by slot of the program's global names, nil until defined. A definition
+  // never binds nil.
+  const PerfectHash* symbols = nullptr;
+  vector<Value> slots;
+
+  // The outermost environment of an interpreter may read shared globals
+  Globals* globals = nullptr;
+  Globals::Pin pin;
+
+  size_t refs = 0;
+
+  Environment() = default;
+
+  explicit Environment(Interpreter* interpreter) : interpreter(interpreter) {
+    count();
+  }
+
+  explicit Environment(Rc<Environment> outer)
+      : outer(outer), interpreter(outer->interpreter) {
+    if (interpreter) {
+      count();
+    }
+  }
+
+  void count() {
+    interpreter->stats.environments++;
+    if (interpreter->metrics) {
+      interpreter->metrics->local().environments.add();
+    }
+  }
+
+  const Value& get_value(string_view s) const {
+    if (auto it = values.find(s); it != values.end()) {
+      return it->second;
+    } else if (outer) {
+      return outer->get_value(s);
+    } else if (auto val = global(s)) {
+      return *val;
+    } else if (auto val = pin ? pin->find(s) : nullptr) {
+      return *val;
+    }
+    throw runtime_error("undefined variable '" + string(s) + "'...");
+  }
+
+  // The first binding of a name stays, as in eval(). A name in `values`
+  // (a builtin, or defined before the program was indexed) keeps its slot
+  // nil, so a slot that is set is never shadowed in this environment.
+  void set_value(string_view s, Value&& val) {
+    if (symbols && !values.count(s)) {
+      if (auto slot = symbols->find(s); slot != PerfectHash::npos) {
+        if (slots[slot].type == Value::Type::Nil) {
+          slots[slot] = move(val);
+        }
+        return;
+      }
+    }
+    values.emplace(s, val);
+  }
+
+  const Value* global(string_view s) const {
+    auto slot = symbols ? symbols->find(s) : PerfectHash::npos;
+    if (slot != PerfectHash::npos && slots[slot].type != Value::Type::Nil) {
+      return &slots[slot];
+    }
+    return nullptr;
+  }
+
+  // Keeps the definitions of the program with these global names in slots.
+  // Those of a program run before move to `values`.
+  void index(const PerfectHash& globals) {
+    if (symbols == &globals) {
+      return;
+    }
+    for (uint32_t i = 0; i < slots.size(); i++) {
+      if (slots[i].type != Value::Type::Nil) {
+        values.emplace(symbols->name(i), move(slots[i]));
+      }
+    }
+    symbols = &globals;
+    slots.assign(globals.size(), Value());
+  }
+
+  // Publishes the definitions made here as a new version of the globals and
+  // moves on to that version.
+  void publish() {
+    globals->publish(move(values));
+    values.clear();
+    pin = Globals::Pin();  // released first, so this needs no second slot
+    pin = globals->pin();
+  }
+
+  // Builtins write to the interpreter of the environment they are called in,
+  // so the same table can be shared by all instances.
+  static Globals::Table builtins() {
+    Globals::Table values;
+    values.emplace("puts"sv, Value(Function("arg", [](Rc<Environment> env) {
+                     auto& interpreter = *env->interpreter;
+                     interpreter.out << env->get_value("arg") << endl;
+                     interpreter.stats.outputs++;
+                     if (interpreter.metrics) {
+                       interpreter.metrics->local().outputs.add();
+                     }
+                     FIBLANG_PROBE1(output__flush, interpreter.stats.outputs);
+                     auto timeline = interpreter.config.timeline;
+                     if (timeline && !timeline->output) {
+                       timeline->output = true;
+                       timeline->mark("first_output");
+                     }
+                     return Value();
+                   })));
+    return values;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Call graph
+//-----------------------------------------------------------------------------
+
+struct CallGraph {
+  struct Stats {
+    size_t calls = 0;
+    size_t repeated = 0;  // calls whose argument was already seen
+    size_t max_depth = 0;
+    size_t callers = 0;  // activations that made at least one call
+    size_t callees = 0;  // calls made by those activations
+    size_t max_callees = 0;
+    set<string> args;
+  };
+
+  struct Frame {
+    string_view name;
+    size_t callees = 0;
+  };
+
+  map<pair<string_view, string_view>, size_t> edges;
+  map<string_view, Stats> functions;
+  vector<Frame> stack{{"<toplevel>"}};
+
+  void enter(string_view name, const Value& arg) {
+    auto& caller = stack.back();
+    caller.callees++;
+    edges[{caller.name, name}]++;
+
+    auto& stats = functions[name];
+    stats.calls++;
+    if (!stats.args.insert(arg.str()).second) {
+      stats.repeated++;
+    }
+    stats.max_depth = max(stats.max_depth, stack.size());
+
+    stack.push_back({name});
+  }
+
+  void leave() {
+    auto frame = stack.back();
+    stack.pop_back();
+
+    auto& stats = functions[frame.name];
+    if (frame.callees) {
+      stats.callers++;
+    }
+    stats.callees += frame.callees;
+    stats.max_callees = max(stats.max_callees, frame.callees);
+  }
+
+  void print(ostream& out) const {
+    out << "function\tcalls\tunique\trepeated\tredundancy\tmax depth\t"
+           "branching (avg/max)"
+        << endl;
+    for (const auto& [name, s] : functions) {
+      out << name << "\t" << s.calls << "\t" << s.args.size() << "\t"
+          << s.repeated << "\t" << fixed << setprecision(1)
+          << redundancy(s) * 100 << "%\t" << s.max_depth << "\t"
+          << setprecision(2) << branching(s) << "/" << s.max_callees << endl;
+    }
+    out << endl << "caller\tcallee\tcount" << endl;
+    for (const auto& [edge, count] : edges) {
+      out << edge.first << "\t" << edge.second << "\t" << count << endl;
+    }
+  }
+
+  void print_dot(ostream& out) const {
+    out << "digraph callgraph {" << endl;
+    out << "  node [shape=box];" << endl;
+    for (const auto& [name, s] : functions) {
+      out << "  \"" << name << "\" [label=\"" << name << "\\ncalls: " << s.calls
+          << "\\nredundancy: " << fixed << setprecision(1)
+          << redundancy(s) * 100 << "%\\nmax depth: " << s.max_depth
+          << "\\nbranching: " << setprecision(2) << branching(s) << "\"];"
+          << endl;
+    }
+    for (const auto& [edge, count] : edges) {
+      out << "  \"" << edge.first << "\" -> \"" << edge.second
+          << "\" [label=\"" << count << "\"];" << endl;
+    }
+    out << "}" << endl;
+  }
+
+  static double redundancy(const Stats& s) {
+    return s.calls ? double(s.repeated) / s.calls : 0;
+  }
+
+  static double branching(const Stats& s) {
+    return s.callers ? double(s.callees) / s.callers : 0;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Static analysis
+//-----------------------------------------------------------------------------
+
+struct Analyzer {
+  enum class Recursion { None, Bounded, Linear, Tree };
+
+  struct Definition {
+    string_view name;
+    string_view param;
+    const Node* body;  // a LAZY node until classified
+    bool classified = false;
+    Recursion recursion = Recursion::None;
+    size_t self_calls = 0;    // most recursive calls on a single branch
+    bool decreasing = true;   // every recursive argument is `param - k`
+    unordered_map<long, double> costs;
+  };
+
+  // Arguments above this are extrapolated from the last two exact costs.
+  static constexpr long max_exact_arg = 1 << 16;
+  // Longer loops are estimated from this many evenly spaced iterations,
+  // and all loops from a single one once estimates have visited `max_work`
+  // nodes.
+  static constexpr long max_loop_samples = 64;
+  static constexpr size_t max_work = 1000000;
+  static constexpr size_t max_depth = 10000;
+
+  map<string_view, Definition> defs;
+  vector<const Node*> statements;
+  const Program& program;
+  const SourceMap& source_map;
+  bool exact = true;
+  size_t depth = 0;
+  size_t work = 0;
+  double limit = HUGE_VAL;  // estimates stop once they exceed this
+
+  // Definitions are classified when a cost needs them, so the bodies of a
+  // lazy program that its top-level statements don't call aren't parsed.
+  explicit Analyzer(const Program& program)
+      : program(program), source_map(program.source_map) {
+    const auto& root = *program.root;
+    if (root.tag == "STATEMENTS"_) {
+      statements.assign(root.nodes.begin(), root.nodes.end());
+    } else {
+      statements.push_back(&root);
+    }
+
+    for (const auto& node : statements) {
+      if (node->tag == "DEFINITION"_) {
+        Definition def;
+        def.name = node->nodes[0]->token;
+        def.param = node->nodes[1]->token;
+        def.body = node->nodes[2];
+        // The first definition wins, as in `Environment::set_value`.
+        defs.emplace(def.name, move(def));
+      }
+    }
+  }
+
+  // Estimated number of calls made by the whole program, or the first
+  // partial total above `limit`
+  double estimate(double limit = HUGE_VAL) {
+    this->limit = limit;
+    auto total = 0.0;
+    auto all_exact = true;
+    for (const auto& node : statements) {
+      exact = true;
+      total += cost(*node, {});
+      all_exact = all_exact && exact;
+      if (total > limit) {
+        all_exact = all_exact && node == statements.back();
+        break;
+      }
+    }
+    exact = all_exact;
+    return total;
+  }
+
+  void report(ostream& out) {
+    for (auto& [_, def] : defs) {
+      classify(def);
+      out << "def " << def.name << "(" << def.param
+          << "): " << to_string(def.recursion) << " recursion";
+      if (def.self_calls) {
+        out << " (" << def.self_calls << " recursive call"
+            << (def.self_calls > 1 ? "s" : "") << " per branch";
+        if (def.recursion != Recursion::Bounded && !def.decreasing) {
+          out << ", argument does not decrease";
+        }
+        out << ")";
+      }
+      out << endl;
+    }
+
+    auto total = 0.0;
+    auto all_exact = true;
+    for (const auto& node : statements) {
+      if (node->tag != "DEFINITION"_) {
+        exact = true;
+        auto c = cost(*node, {});
+        auto [line, column] = source_map.position(node->id);
+        out << line << ":" << column << ": " << format_cost(c) << endl;
+        total += c;
+        all_exact = all_exact && exact;
+      }
+    }
+    exact = all_exact;
+    out << "total: " << format_cost(total) << endl;
+  }
+
+  // `~` marks estimates that were extrapolated, sampled or cut off.
+  string format_cost(double c) const {
+    ostringstream ss;
+    ss << (exact ? "" : "~") << setprecision(3) << c << " calls";
+    return ss.str();
+  }
+
+  static const char* to_string(Recursion r) {
+    switch (r) {
+      case Recursion::None:
+        return "no";
+      case Recursion::Bounded:
+        return "bounded";
+      case Recursion::Linear:
+        return "linear";
+      case Recursion::Tree:
+        return "tree (exponential)";
+    }
+    return "";
+  }
+
+private:
+  using Bindings = map<string_view, long>;
+
+  void classify(Definition& def) {
+    if (def.classified) {
+      return;
+    }
+    def.classified = true;
+    def.body = &program.body(*def.body);
+    auto all_const = true;
+    def.self_calls = self_calls(def, *def.body, all_const);
+    if (def.self_calls == 0) {
+      def.recursion = Recursion::None;
+    } else if (all_const) {
+      def.recursion = Recursion::Bounded;
+    } else if (def.self_calls == 1) {
+      def.recursion = Recursion::Linear;
+    } else {
+      def.recursion = Recursion::Tree;
+    }
+  }
+
+  // Most recursive calls evaluated on any path through `ast`
+  size_t self_calls(Definition& def, const Node& ast, bool& all_const) {
+    switch (ast.tag) {
+      case "TERNARY"_: {
+        auto cond = self_calls(def, *ast.nodes[0], all_const);
+        return cond + max(self_calls(def, *ast.nodes[1], all_const),
+                          self_calls(def, *ast.nodes[2], all_const));
+      }
+      case "CALL"_: {
+        auto n = self_calls(def, *ast.nodes[1], all_const);
+        if (ast.nodes[0]->token == def.name) {
+          auto& arg = *ast.nodes[1];
+          if (arg.tag != "Number"_) {
+            all_const = false;
+            def.decreasing = def.decreasing && decrement(def, arg) > 0;
+          }
+          n++;
+        }
+        return n;
+      }
+      default: {
+        size_t n = 0;
+        for (const auto& node : ast.nodes) {
+          n += self_calls(def, *node, all_const);
+        }
+        return n;
+      }
+    }
+  }
+
+  static bool reads(const Node& ast, string_view var) {
+    if (ast.tag == "Identifier"_) {
+      return ast.token == var;
+    }
+    return any_of(ast.nodes.begin(), ast.nodes.end(),
+                  [&](const auto& node) { return reads(*node, var); });
+  }
+
+  // `k` when `ast` is `param - k`, otherwise 0
+  static long decrement(const Definition& def, const Node& ast) {
+    if (ast.tag == "INFIX"_ && ast.nodes.size() == 3 &&
+        ast.nodes[0]->tag == "Identifier"_ &&
+        ast.nodes[0]->token == def.param && ast.nodes[1]->token == "-" &&
+        ast.nodes[2]->tag == "Number"_) {
+      return ast.nodes[2]->token_to_number<long>();
+    }
+    return 0;
+  }
+
+  optional<long> value(const Node& ast, const Bindings& b) const {
+    switch (ast.tag) {
+      case "Number"_:
+        return ast.token_to_number<long>();
+      case "Identifier"_: {
+        auto it = b.find(ast.token);
+        if (it != b.end()) {
+          return it->second;
+        }
+        return nullopt;
+      }
+      case "INFIX"_: {
+        auto l = value(*ast.nodes[0], b);
+        for (size_t i = 1; l && i < ast.nodes.size(); i += 2) {
+          auto r = value(*ast.nodes[i + 1], b);
+          if (!r) {
+            return nullopt;
+          }
+          if (ast.nodes[i]->token == "+" ? __builtin_add_overflow(*l, *r, &*l)
+                                         : __builtin_sub_overflow(*l, *r, &*l)) {
+            return nullopt;
+          }
+        }
+        return l;
+      }
+      default:
+        return nullopt;
+    }
+  }
+
+  optional<bool> condition(const Node& ast, const Bindings& b) const {
+    if (ast.tag == "CONDITION"_) {
+      auto l = value(*ast.nodes[0], b);
+      auto r = value(*ast.nodes[2], b);
+      if (l && r) {
+        return *l < *r;
+      }
+    } else if (auto v = value(ast, b)) {
+      return *v != 0;
+    }
+    return nullopt;
+  }
+
+  // Estimated number of calls made while evaluating `ast`
+  double cost(const Node& ast, const Bindings& b) {
+    work++;
+    switch (ast.tag) {
+      case "DEFINITION"_:
+        return 0;
+      case "TERNARY"_: {
+        auto c = cost(*ast.nodes[0], b);
+        if (auto cond = condition(*ast.nodes[0], b)) {
+          return c + cost(*ast.nodes[*cond ? 1 : 2], b);
+        }
+        return c + max(cost(*ast.nodes[1], b), cost(*ast.nodes[2], b));
+      }
+      case "CALL"_: {
+        auto name = ast.nodes[0]->token;
+        auto c = 1 + cost(*ast.nodes[1], b);
+        auto it = defs.find(name);
+        if (it != defs.end() && !b.count(name)) {
+          if (auto arg = value(*ast.nodes[1], b)) {
+            c += call_cost(it->second, *arg);
+          } else {
+            exact = false;
+          }
+        }
+        return c;
+      }
+      case "FOR"_: {
+        auto var = ast.nodes[0]->token;
+        auto from = ast.nodes[1]->token_to_number<long>();
+        auto to = ast.nodes[2]->token_to_number<long>();
+        if (to < from) {
+          return 0;
+        }
+
+        auto inner = b;
+        auto iteration = [&](long i) {
+          inner[var] = i;
+          return cost(*ast.nodes[3], inner);
+        };
+
+        // The trip count times the average cost of the sampled iterations,
+        // which are all of them in a short loop. Iterations cost the same
+        // when the body doesn't read the variable.
+        auto c = 0.0;
+        auto n = double(to) - double(from) + 1;
+        auto varying = reads(*ast.nodes[3], var);
+        auto samples = !varying || work > max_work
+                           ? 1
+                           : long(min(n, double(max_loop_samples)));
+        if (varying && samples < n) {
+          exact = false;
+        }
+        auto step = n / samples;
+        for (long k = 0; k < samples; k++) {
+          c += iteration(from + long(k * step)) * step;
+          if (c > limit) {
+            exact = false;
+            break;
+          }
+        }
+        return c;
+      }
+      default: {
+        auto c = 0.0;
+        for (const auto& node : ast.nodes) {
+          c += cost(*node, b);
+        }
+        return c;
+      }
+    }
+  }
+
+  // Estimated number of calls made by the body of `def` for argument `n`
+  double call_cost(Definition& def, long n) {
+    classify(def);
+    if (auto it = def.costs.find(n); it != def.costs.end()) {
+      return it->second;
+    }
+
+    auto recursive = def.recursion == Recursion::Linear ||
+                     def.recursion == Recursion::Tree;
+    if (recursive && def.decreasing) {
+      if (n > max_exact_arg) {
+        auto a = call_cost(def, max_exact_arg);
+        auto p = call_cost(def, max_exact_arg - 1);
+        auto k = double(n - max_exact_arg);
+        exact = false;
+        if (def.recursion == Recursion::Linear) {
+          return a + k * (a - p);
+        }
+        return p > 0 ? a * pow(a / p, k) : a;
+      }
+      // Fill the table bottom-up so that the recursion below stays shallow.
+      for (long m = 0; m < n; m++) {
+        if (!def.costs.count(m)) {
+          body_cost(def, m);
+        }
+      }
+    }
+    return body_cost(def, n);
+  }
+
+  double body_cost(Definition& def, long n) {
+    if (depth >= max_depth) {
+      exact = false;
+      return 0;
+    }
+    // A call that comes back to the same argument never terminates.
+    def.costs[n] = HUGE_VAL;
+    depth++;
+    auto c = cost(*def.body, {{def.param, n}});
+    depth--;
+    def.costs[n] = c;
+    return c;
+  }
+};
+
+//-----------------------------------------------------------------------------
+// Interpreter
+//-----------------------------------------------------------------------------
+
+inline Value eval(const Node& ast, Rc<Environment> env);
+inline Value eval_child(const Node& ast, size_t i, Rc<Environment> env);
+inline Value eval_body(const Node& definition, const Node& body,
+                       Rc<Environment> env);
+
+namespace ir {
+// Moves a FOR loop to the IR after Config::osr_after iterations
+inline bool osr(const Node& loop, const Rc<Environment>& env, long from);
+
+// Sets the code of a body of a lazy program, unless it runs with eval()
+inline void compile_body(const Program& program, const Node& definition,
+                         LazyBody& body, const Config& config);
+inline Value run_body(const Module& module, const Rc<Environment>& env);
+}  // namespace ir
+
+// The body of a function of a lazy program, parsed and compiled on its
+// first call. Functions are copied by every call, so it is kept where the
+// copies share it.
+struct LazyBody {
+  once_flag once;
+  const Node* node = nullptr;
+  shared_ptr<const ir::Module> code;
+
+  // The function of `code` once it is set, for calls from the IR
+  atomic<const ir::Function*> compiled{nullptr};
+};
+
+// Ends a call in the call graph, the metrics and the tracepoints when the
+// call returns or unwinds
+struct CallScope {
+  CallGraph* callgraph;
+  Metrics* metrics;
+  string_view name;
+  long start = metrics ? Timeline::now() : 0;
+
+  ~CallScope() {
+    if (callgraph) {
+      callgraph->leave();
+    }
+    if (metrics) {
+      auto ns = uint64_t(Timeline::now() - start);
+      metrics->local().function(name).record(ns);
+    }
+    FIBLANG_PROBE2(call__return, name.data(), name.size());
+  }
+};
+
+inline Value eval_node(const Node& ast, Rc<Environment> env) {
+  switch (ast.tag) {
+    // Rules
+    case "STATEMENTS"_: {
+      // (DEFINITION / EXPRESSION)*
+      if (!ast.nodes.empty()) {
+        size_t i = 0;
+        while (i < ast.nodes.size() - 1) {
+          eval_child(ast, i, env);
+          i++;
+        }
+        return eval_child(ast, i, env);
+      }
+      return Value();
+    }
+    case "DEFINITION"_: {
+      // 'def' Identifier '(' Identifier ')' EXPRESSION
+      auto name = ast.nodes[0]->token;
+      auto param = ast.nodes[1]->token;
+      auto body = ast.nodes[2];
+
+      if (body->tag == "LAZY"_) {
+        auto program = env->interpreter->program;
+        auto lazy = make_shared<LazyBody>();
+        Function fn(param, [=, def = &ast](Rc<Environment> e) {
+          call_once(lazy->once, [&] {
+            lazy->node = &program->body(*body);
+            ir::compile_body(*program, *def, *lazy, e->interpreter->config);
+          });
+          if (lazy->code) {
+            return ir::run_body(*lazy->code, e);
+          }
+          return eval_body(*def, *lazy->node, e);
+        });
+        fn.lazy = move(lazy);
+        env->set_value(name, Value(move(fn)));
+        return Value();
+      }
+
+      env->set_value(
+          name, Value(Function(param, [=, def = &ast](Rc<Environment> e) {
+            return eval_body(*def, *body, e);
+          })));
+
+      return Value();
+    }
+    case "TERNARY"_: {
+      // CONDITION ('?' EXPRESSION ':' EXPRESSION)?
+      auto cond = eval_child(ast, 0, env).to_bool();
+      auto idx = cond ? 1 : 2;
+      return eval_child(ast, idx, env);
+    }
+    case "CONDITION"_: {
+      // INFIX (ConditionOperator INFIX)?
+      auto lhs = eval_child(ast, 0, env);
+      auto rhs = eval_child(ast, 2, env);
+      if (lhs.type == Value::Type::Long && rhs.type == Value::Type::Long) {
+        return Value(lhs.n < rhs.n);
+      }
+      auto ret = lhs < rhs;
+      return Value(ret);
+    }
+    case "INFIX"_: {
+      // CALL (InfixOperator CALL)*
+      auto l = eval_child(ast, 0, env);
+      for (size_t i = 1; i < ast.nodes.size(); i += 2) {
+        auto o = ast.nodes[i]->token;
+        auto r = eval_child(ast, i + 1, env);
+
+        // Both Long: update in place unless the result overflows
+        if (l.type == Value::Type::Long && r.type == Value::Type::Long) {
+          long ret;
+          auto overflow = o[0] == '+'
+                              ? __builtin_add_overflow(l.n, r.n, &ret)
+                              : __builtin_sub_overflow(l.n, r.n, &ret);
+          if (!overflow) {
+            l.n = ret;
+            continue;
+          }
+        }
+
+        if (o == "+") {
+          l = l + r;
+        } else if (o == "-") {
+          l = l - r;
+        }
+      }
+      return l;
+    }
+    case "CALL"_: {
+      // PRIMARY ('(' EXPRESSION ')')?
+      auto name = ast.nodes[0]->token;
+      auto fn = env->get_value(name).to_function();
+      auto val = eval_child(ast, 1, env);
+
+      auto& interpreter = *env->interpreter;
+      interpreter.stats.calls++;
+      FIBLANG_PROBE3(call__entry, name.data(), name.size(), val.n);
+      auto callgraph = interpreter.callgraph;
+      if (callgraph) {
+        callgraph->enter(name, val);
+      }
+      CallScope call_scope{callgraph, interpreter.metrics, name};
+
+      auto callEnv = make_rc<Environment>(env);
+      callEnv->set_value(fn.param, move(val));
+
+      try {
+        return fn.eval(callEnv);
+      } catch (const Value& e) {
+        return e;
+      }
+    }
+    case "FOR"_: {
+      // 'for' Identifier 'from' Number 'to' Number EXPRESSION
+      auto ident = ast.nodes[0]->token;
+      auto from = eval_child(ast, 1, env).to_long();
+      auto to = eval_child(ast, 2, env).to_long();
+      auto osr_after = env->interpreter->config.osr_after;
+
+      // Stops at `to` before incrementing, which may be LONG_MAX
+      for (auto i = from; i <= to; i++) {
+        if (osr_after && i - from == long(osr_after) &&
+            ir::osr(ast, env, i)) {
+          break;
+        }
+        FIBLANG_PROBE2(loop__iteration, i, to);
+        auto call_env = make_rc<Environment>(env);
+        call_env->set_value(ident, Value(i));
+        eval_child(ast, 3, call_env);
+        if (i == to) {
+          break;
+        }
+      }
+      return Value();
+    }
+
+    // Tokens
+    case "Identifier"_: {
+      // !Keyword < [a-zA-Z][a-zA-Z0-9_]* >
+      return Value(env->get_value(ast.token));
+    }
+    case "Number"_: {
+      // < [0-9]+ >
+      if (ast.token.size() > 18) {
+        return Value(BigInt(ast.token));
+      }
+      return Value(ast.token_to_number<long>());
+    }
+  }
+  return Value();
+}
+
+// Runtime errors are attributed to the innermost node they come from.
+inline Value eval(const Node& ast, Rc<Environment> env) {
+  try {
+    return eval_node(ast, move(env));
+  } catch (const Error&) {
+    throw;
+  } catch (const runtime_error& e) {
+    throw Error(ast.id, e.what());
+  }
+}
+
+// Evaluates child i of `ast`, to which an error raised in it moves
+inline Value eval_child(const Node& ast, size_t i, Rc<Environment> env) {
+  try {
+    return eval(*ast.nodes[i], move(env));
+  } catch (Error& e) {
+    e.enter(ast, i);
+    throw;
+  }
+}
+
+// Evaluates the body of a function, which is the definition's unless it was
+// parsed lazily, and resolves the errors raised in it at the definition
+inline Value eval_body(const Node& definition, const Node& body,
+                       Rc<Environment> env) {
+  try {
+    return eval(body, move(env));
+  } catch (Error& e) {
+    e.enter(definition, 2);
+    e.resolved = true;
+    throw;
+  }
+}
+
+//-----------------------------------------------------------------------------
+// Interpreter instance
+//-----------------------------------------------------------------------------
+
+inline Interpreter::Interpreter(ostream& out)
+    : out(out), root(make_rc<Environment>(this)) {
+  root->values = Environment::builtins();
+}
+
+inline Interpreter::Interpreter(Globals& globals, ostream& out)
+    : out(out), root(make_rc<Environment>(this)) {
+  root->globals = &globals;
+  root->pin = globals.pin();
+}
+
+inline Interpreter::~Interpreter() = default;
+
+inline Value Interpreter::run(const Node& node) {
+  return request([&] { return eval(node, root); });
+}
+
+inline void Interpreter::publish() { root->publish(); }
+
+//-----------------------------------------------------------------------------
+// IR
+//-----------------------------------------------------------------------------
+
+// A mid-level IR in SSA form. FibLang never reassigns a variable, so the
+// builder emits SSA directly: phis only appear where the branches of a
+// TERNARY join and at the headers of FOR loops.
+namespace ir {
+
+using Id = uint32_t;
+constexpr Id none = UINT32_MAX;
+
+// Largest body, in instructions, of a FOR loop that is unrolled
+constexpr size_t max_loop_size = 64;
+
+enum class Op : uint8_t {
+  Const,   // constants[aux]
+  Param,   // the argument
+  Copy,    // a
+  Global,  // `name`, looked up in the root environment
+  Callee,  // a, checked to be a function
+  Add,     // a + b
+  Sub,     // a - b
+  Less,    // a < b
+  LessEq,  // a <= b, the test of a FOR loop
+  // The same on longs known not to overflow, without checks
+  AddInt,
+  SubInt,
+  LessInt,
+  LessEqInt,
+  // The same on longs, deoptimizing on overflow (specialized code only)
+  AddLong,
+  SubLong,
+  Call,    // a(b), `name` is the callee as written; if aux, deoptimizes
+           // unless it returns a long (specialized code only)
+  CallDynamic,  // a(b) seeing the loop variables `inputs`, named by
+                // scopes[aux], bound as eval() would (OSR code only)
+  Define,  // defines `name` as functions[aux]
+  Iterate,  // starts iteration a of a FOR loop up to b (a tracepoint)
+  Phi,     // inputs[i] when coming from preds[i]
+  Pi,      // a, where the branch on b into this block (true if aux) holds
+  Jump,    // to targets[0]
+  Branch,  // to targets[0] if a, else targets[1]
+  Return,  // a
+};
+
+inline const char* op_name(Op op) {
+  static const char* names[] = {
+      "const",    "param", "copy",   "global", "callee", "add",
+      "sub",      "less",  "lesseq", "add.i",  "sub.i",  "less.i",
+      "lesseq.i", "add.l", "sub.l",  "call",   "call.d", "define",
+      "iterate",  "phi",   "pi",     "jump",   "branch", "return"};
+  return names[size_t(op)];
+}
+
+struct Inst {
+  Op op;
+  Id a = none;
+  Id b = none;
+  uint32_t aux = 0;
+  array<uint32_t, 2> targets{};
+  // For diagnostics: where the instruction comes from, `delta` bytes after
+  // the start of the node `node`
+  uint32_t node = 0;
+  uint32_t delta = 0;
+  string_view name;
+  vector<Id> inputs;  // of a Phi or a CallDynamic
+
+  Inst(Op op, Id a = none, Id b = none, uint32_t aux = 0)
+      : op(op), a(a), b(b), aux(aux) {}
+
+  bool terminator() const { return op >= Op::Jump; }
+};
+
+struct Block {
+  vector<Id> insts;  // phis first, a terminator last
+  vector<uint32_t> preds;
+  uint32_t loop = none;  // header of the unrolled loop it belongs to
+  bool dead = false;
+};
+
+// What the optimizer knows about the type of a value
+enum class Type : uint8_t { None, Int, Bool, Nil, Any };
+
+// What the range analysis knows about a value: nothing yet, a long within
+// [lo, hi], or anything
+struct Range {
+  enum Kind : uint8_t { None, Long, Any } kind = None;
+  long lo = 0;
+  long hi = 0;
+
+  static Range of(long lo, long hi) {
+    return lo <= hi ? Range{Long, lo, hi} : Range{};
+  }
+  static Range any() { return {Any, 0, 0}; }
+
+  bool is_long() const { return kind == Long; }
+
+  Range join(const Range& r) const {
+    if (kind == None || r.kind == Any) {
+      return r;
+    }
+    if (r.kind == None || kind == Any) {
+      return *this;
+    }
+    return of(min(lo, r.lo), max(hi, r.hi));
+  }
+
+  bool operator==(const Range& r) const {
+    return kind == r.kind && lo == r.lo && hi == r.hi;
+  }
+  bool operator!=(const Range& r) const { return !(*this == r); }
+};
+
+// The types a value was seen with, a bit per Value::Type
+inline uint8_t type_bit(const Value& value) {
+  return uint8_t(1 << int(value.type));
+}
+constexpr uint8_t long_bit = 1 << int(Value::Type::Long);
+
+// Adds `bit` to `types` without a read-modify-write once it is there
+inline void observe(atomic<uint8_t>& types, uint8_t bit) {
+  if (!(types.load(memory_order_relaxed) & bit)) {
+    types.fetch_or(bit, memory_order_relaxed);
+  }
+}
+
+// Increments a counter that only drives heuristics and reports, so an
+// update lost to another thread doesn't matter
+inline size_t bump(atomic<size_t>& counter) {
+  auto n = counter.load(memory_order_relaxed) + 1;
+  counter.store(n, memory_order_relaxed);
+  return n;
+}
+
+struct Site {
+  atomic<uint8_t> args{0};
+  atomic<uint8_t> results{0};
+};
+
+struct Function {
+  string_view name;  // empty for the top level
+  string_view param;
+  const Node* definition = nullptr;
+  const Node* body = nullptr;
+  vector<Inst> insts;
+  vector<Block> blocks;  // blocks[0] is the entry
+  vector<Value> constants;
+  vector<vector<string_view>> scopes;  // of the CallDynamics
+  bool pure = false;  // no output or definitions, however deep
+
+  // The code of a loop moved from eval(), whose instructions are placed from
+  // the loop, so errors raised in it still move up to the nodes around it
+  bool osr = false;
+
+  // The code assumes the argument is a long within these bounds. Other
+  // arguments run the body with eval().
+  optional<pair<long, long>> guard;
+
+  // Type feedback, and the code specialized on it, shared by the instances
+  // that run the function
+  struct Profile {
+    atomic<size_t> calls{0};
+    atomic<size_t> deopts{0};
+    atomic<uint8_t> args{0};
+    unique_ptr<Site[]> sites;  // by ID of the call
+    atomic<bool> tried{false};
+    atomic<const Function*> specialized{nullptr};
+    unique_ptr<Function> code;  // owns `specialized`, even once dropped
+  };
+  mutable Profile profile;
+
+  // Specialized code, which may deoptimize, and assumes the argument is a
+  // long if `long_arg`
+  bool speculative = false;
+  bool long_arg = false;
+
+  Id emit(uint32_t block, Inst inst) {
+    auto id = Id(insts.size());
+    insts.push_back(move(inst));
+    blocks[block].insts.push_back(id);
+    return id;
+  }
+
+  uint32_t add_block() {
+    blocks.emplace_back();
+    return uint32_t(blocks.size() - 1);
+  }
+
+  void link(uint32_t from, uint32_t to) { blocks[to].preds.push_back(from); }
+
+  void dump(ostream& out) const;
+};
+
+struct Stats {
+  size_t folded = 0;       // constant expressions and branches
+  size_t unreachable = 0;  // blocks
+  size_t copies = 0;       // copies propagated
+  size_t cse = 0;          // redundant computations
+  size_t hoisted = 0;      // loop-invariant computations
+  size_t dce = 0;          // dead instructions
+  size_t loops = 0;        // peeled and unrolled
+
+  // Range analysis
+  size_t overflow = 0;    // overflow checks removed
+  size_t guards = 0;      // type guards removed
+  size_t conditions = 0;  // conditions decided
+  size_t guarded = 0;     // functions specialized on their argument
+};
+
+struct Module {
+  vector<unique_ptr<Function>> functions;  // functions[0] is the top level
+  const PerfectHash* globals = nullptr;  // slots of Global instructions
+  Stats stats;
+
+  void dump(ostream& out) const {
+    for (const auto& fn : functions) {
+      fn->dump(out);
+    }
+    out << "; folded " << stats.folded << ", unreachable blocks "
+        << stats.unreachable << ", copies " << stats.copies << ", cse "
+        << stats.cse << ", hoisted " << stats.hoisted << ", dce "
+        << stats.dce << ", loops " << stats.loops << endl
+        << "; overflow checks " << stats.overflow << ", type guards "
+        << stats.guards << ", conditions " << stats.conditions
+        << ", guarded functions " << stats.guarded << endl;
+  }
+
+  // The type feedback of the functions and their call sites, and the code
+  // specialized on it. Not while instances run the module.
+  void print_profile(ostream& out, const SourceMap& source_map) const {
+    auto types = [](uint8_t bits) {
+      static const char* names[] = {"nil", "bool", "long", "bigint",
+                                    "function"};
+      string s;
+      for (size_t i = 0; i < size(names); i++) {
+        if (bits & (1 << i)) {
+          s += (s.empty() ? "" : "|") + string(names[i]);
+        }
+      }
+      return s.empty() ? "-" : s;
+    };
+
+    size_t specializations = 0, deopts = 0;
+    out << "function\tcalls\targument\tspecialized\tdeopts" << endl;
+    for (size_t i = 1; i < functions.size(); i++) {
+      const auto& profile = functions[i]->profile;
+      auto specialized = profile.code != nullptr;
+      specializations += specialized;
+      deopts += profile.deopts;
+      out << functions[i]->name << "\t" << profile.calls << "\t"
+          << types(profile.args) << "\t"
+          << (!specialized                    ? "no"
+              : profile.specialized.load() ? "yes"
+                                              : "dropped")
+          << "\t" << profile.deopts << endl;
+    }
+
+    // Unrolled loops have several copies of a call site
+    out << endl << "call site\tcallee\targument\tresult" << endl;
+    for (const auto& fn : functions) {
+      map<pair<size_t, size_t>, tuple<string_view, uint8_t, uint8_t>> sites;
+      for (Id id = 0; id < fn->insts.size(); id++) {
+        const auto& inst = fn->insts[id];
+        const auto& site = fn->profile.sites[id];
+        if (inst.op != Op::Call || !site.args) {
+          continue;
+        }
+        auto& [name, args, results] =
+            sites[source_map.position(inst.node, inst.delta)];
+        name = inst.name;
+        args |= site.args;
+        results |= site.results;
+      }
+      for (const auto& [position, site] : sites) {
+        const auto& [name, args, results] = site;
+        out << position.first << ":" << position.second << "\t" << name
+            << "\t" << types(args) << "\t" << types(results) << endl;
+      }
+    }
+
+    out << endl;
+    for (const auto& fn : functions) {
+      if (fn->profile.code) {
+        fn->profile.code->dump(out);
+      }
+    }
+    out << "; specializations " << specializations << ", deopts " << deopts
+        << endl;
+  }
+};
+
+inline void Function::dump(ostream& out) const {
+  if (name.empty()) {
+    out << "toplevel";
+  } else {
+    out << "def " << name << "(" << param << ")";
+  }
+  out << (pure ? " pure" : "");
+  if (guard) {
+    out << " [" << guard->first << ", " << guard->second << "]";
+  }
+  if (speculative) {
+    out << (long_arg ? " specialized on long" : " specialized");
+  }
+  out << endl;
+
+  for (uint32_t b = 0; b < blocks.size(); b++) {
+    const auto& block = blocks[b];
+    if (block.dead) {
+      continue;
+    }
+    out << "b" << b << ":";
+    if (!block.preds.empty()) {
+      out << "  ; preds";
+      for (auto p : block.preds) {
+        out << " b" << p;
+      }
+    }
+    out << endl;
+    for (auto id : block.insts) {
+      const auto& inst = insts[id];
+      out << "  ";
+      if (!inst.terminator() && inst.op != Op::Define &&
+          inst.op != Op::Iterate) {
+        out << "%" << id << " = ";
+      }
+      out << op_name(inst.op);
+      switch (inst.op) {
+        case Op::Const:
+          out << " " << constants[inst.aux];
+          break;
+        case Op::Global:
+        case Op::Define:
+          out << " " << inst.name;
+          break;
+        case Op::Phi:
+          for (size_t i = 0; i < inst.inputs.size(); i++) {
+            out << (i ? ", " : " ") << "[%" << inst.inputs[i] << ", b"
+                << block.preds[i] << "]";
+          }
+          break;
+        case Op::Call:
+          out << (inst.aux ? ".l" : "") << " %" << inst.a << ", %" << inst.b;
+          break;
+        case Op::CallDynamic:
+          out << " %" << inst.a << ", %" << inst.b;
+          for (size_t i = 0; i < inst.inputs.size(); i++) {
+            out << (i ? ", " : " ; ") << scopes[inst.aux][i] << " = %"
+                << inst.inputs[i];
+          }
+          break;
+        case Op::Jump:
+          out << " b" << inst.targets[0];
+          break;
+        case Op::Branch:
+          out << " %" << inst.a << ", b" << inst.targets[0] << ", b"
+              << inst.targets[1];
+          break;
+        default:
+          if (inst.a != none) {
+            out << " %" << inst.a;
+          }
+          if (inst.b != none) {
+            out << ", %" << inst.b;
+          }
+          break;
+      }
+      out << endl;
+    }
+  }
+  out << endl;
+}
+
+//-----------------------------------------------------------------------------
+// IR builder
+//-----------------------------------------------------------------------------
+
+// Builds the IR of a program. Only programs whose dynamic scoping cannot be
+// observed are compiled: definitions are at the top level and unique, and no
+// function body refers to a name that is bound as a parameter or a loop
+// variable anywhere, so every free name is a global. The rest of the programs
+// are left to eval().
+class Builder {
+public:
+  static unique_ptr<Module> build(const Program& program) {
+    // The top level of a lazy program runs with eval(), its bodies are
+    // compiled by build_body() as they are called
+    if (program.lazy) {
+      return nullptr;
+    }
+    Builder builder;
+    builder.module->globals = &program.globals;
+    try {
+      return builder.build_module(*program.root);
+    } catch (const Unsupported&) {
+      return nullptr;
+    }
+  }
+
+  // The rest of a FOR loop eval() is running, from the iteration given as
+  // the argument, for on-stack replacement. The argument is within the
+  // bounds of the loop, which are numbers, so the code is the same for
+  // every run of the loop. Free names are read from the environment of the
+  // loop, which can't change while it runs, and calls see the loop
+  // variables as eval() would bind them.
+  static unique_ptr<Module> build_loop(const Node& loop) {
+    Builder builder;
+    builder.dynamic = true;
+    try {
+      auto& module = builder.module;
+      module->functions.push_back(make_unique<Function>());
+      builder.fn = module->functions[0].get();
+      builder.fn->osr = true;
+      builder.block = builder.fn->add_block();
+      builder.anchor = loop.id;
+      auto from = number(*loop.nodes[1]);
+      auto to = number(*loop.nodes[2]);
+      if (from.type != Value::Type::Long || to.type != Value::Type::Long) {
+        throw Unsupported{};
+      }
+      builder.fn->guard = pair(from.n, to.n);
+      auto first = builder.emit({Op::Param});
+      auto last = builder.const_value(move(to));
+      builder.emit({Op::Return, builder.build_for(loop, first, last)});
+      return move(module);
+    } catch (const Unsupported&) {
+      return nullptr;
+    }
+  }
+
+  // The body of a definition of a lazy program, on its first call. Its free
+  // names must not be bound anywhere in the program, which the skimmer
+  // records for the bodies it left unparsed. Calls see the parameter as
+  // eval() would bind it.
+  static unique_ptr<Module> build_body(const Program& program,
+                                       const Node& definition,
+                                       const Node& body) {
+    Builder builder;
+    builder.dynamic = true;
+    builder.bound = *program.bound;
+    try {
+      auto& module = builder.module;
+      module->globals = &program.globals;
+      module->functions.push_back(make_unique<Function>());
+      auto& fn = *module->functions[0];
+      fn.name = definition.nodes[0]->token;
+      fn.param = definition.nodes[1]->token;
+      fn.body = &body;
+      fn.definition = &definition;
+      builder.fn = &fn;
+      builder.block = fn.add_block();
+      builder.anchor = definition.id;
+      builder.at = definition.nodes.offset(2);
+      builder.scope = {{fn.param, builder.emit({Op::Param})}};
+      builder.emit({Op::Return, builder.build(body)});
+      return move(module);
+    } catch (const Unsupported&) {
+      return nullptr;
+    }
+  }
+
+  // Names bound by `program` outside the bodies left LAZY
+  static set<string_view> bound_names(const Program& program) {
+    Builder builder;
+    builder.collect_bound(*program.root);
+    builder.bound.insert(program.loop_variables.begin(),
+                         program.loop_variables.end());
+    return move(builder.bound);
+  }
+
+private:
+  struct Unsupported {};
+
+  unique_ptr<Module> module = make_unique<Module>();
+  Function* fn = nullptr;
+  uint32_t block = 0;
+  vector<pair<string_view, Id>> scope;  // parameters and loop variables
+  set<string_view> bound;               // bound anywhere in the program
+  bool dynamic = false;                 // calls see the loop variables
+
+  // Instructions come from `at` bytes after the start of the node `anchor`,
+  // a statement or the loop of build_loop(): the node being built, as
+  // nodes may be shared.
+  uint32_t anchor = 0;
+  uint32_t at = 0;
+
+  unique_ptr<Module> build_module(const Node& root) {
+    vector<const Node*> statements;
+    if (root.tag == "STATEMENTS"_) {
+      statements.assign(root.nodes.begin(), root.nodes.end());
+    } else {
+      statements.push_back(&root);
+    }
+
+    set<string_view> defined;
+    for (auto node : statements) {
+      collect_bound(*node);
+      if (node->tag == "DEFINITION"_ &&
+          !defined.insert(node->nodes[0]->token).second) {
+        throw Unsupported{};
+      }
+    }
+
+    module->functions.push_back(make_unique<Function>());
+    fn = module->functions[0].get();
+    block = fn->add_block();
+
+    anchor = root.id;
+    auto ret = const_value(Value());
+    for (auto node : statements) {
+      anchor = node->id;
+      ret = node->tag == "DEFINITION"_ ? define(*node) : build(*node);
+    }
+    anchor = root.id;
+    emit({Op::Return, ret});
+    return move(module);
+  }
+
+  void collect_bound(const Node& node) {
+    if (node.tag == "DEFINITION"_) {
+      bound.insert(node.nodes[1]->token);
+    } else if (node.tag == "FOR"_) {
+      bound.insert(node.nodes[0]->token);
+    }
+    for (auto child : node.nodes) {
+      collect_bound(*child);
+    }
+  }
+
+  Id emit(Inst inst) {
+    inst.node = anchor;
+    inst.delta = at;
+    return fn->emit(block, move(inst));
+  }
+
+  Id const_value(Value&& value) {
+    fn->constants.push_back(move(value));
+    return emit({Op::Const, none, none, uint32_t(fn->constants.size() - 1)});
+  }
+
+  Id define(const Node& node) {
+    auto index = uint32_t(module->functions.size());
+    module->functions.push_back(make_unique<Function>());
+    auto& callee = *module->functions.back();
+    callee.name = node.nodes[0]->token;
+    callee.param = node.nodes[1]->token;
+    callee.body = node.nodes[2];
+    callee.definition = &node;
+
+    auto saved = make_tuple(fn, block, move(scope));
+    fn = &callee;
+    block = fn->add_block();
+    scope = {{callee.param, emit({Op::Param})}};
+    emit({Op::Return, build_child(node, 2)});
+    tie(fn, block, scope) = move(saved);
+
+    Inst inst{Op::Define, none, none, index};
+    inst.name = callee.name;
+    emit(move(inst));
+    return const_value(Value());
+  }
+
+  // Free names of function bodies must not be rebound by a caller
+  Id lookup(string_view name) {
+    for (auto it = scope.rbegin(); it != scope.rend(); ++it) {
+      if (it->first == name) {
+        return emit({Op::Copy, it->second});
+      }
+    }
+    if (!fn->name.empty() && bound.count(name)) {
+      throw Unsupported{};
+    }
+    auto globals = module->globals;
+    Inst inst{Op::Global, none, none,
+              globals ? globals->find(name) : PerfectHash::npos};
+    inst.name = name;
+    return emit(move(inst));
+  }
+
+  // Builds child i of `node`
+  Id build_child(const Node& node, size_t i) {
+    auto saved = at;
+    at += node.nodes.offset(i);
+    auto id = build(*node.nodes[i]);
+    at = saved;
+    return id;
+  }
+
+  Id build(const Node& node) {
+    switch (node.tag) {
+      case "TERNARY"_: {
+        auto cond = build_child(node, 0);
+        auto then_block = fn->add_block();
+        auto else_block = fn->add_block();
+        auto join = fn->add_block();
+        Inst branch{Op::Branch, cond};
+        branch.targets = {then_block, else_block};
+        emit(move(branch));
+        fn->link(block, then_block);
+        fn->link(block, else_block);
+
+        Inst phi{Op::Phi};
+        for (auto [target, i] : {pair(then_block, 1), pair(else_block, 2)}) {
+          block = target;
+          phi.inputs.push_back(build_child(node, i));
+          Inst jump{Op::Jump};
+          jump.targets[0] = join;
+          emit(move(jump));
+          fn->link(block, join);
+        }
+        block = join;
+        return emit(move(phi));
+      }
+      case "CONDITION"_:
+        return emit({Op::Less, build_child(node, 0), build_child(node, 2)});
+      case "INFIX"_: {
+        auto l = build_child(node, 0);
+        for (size_t i = 1; i < node.nodes.size(); i += 2) {
+          auto op = node.nodes[i]->token == "+" ? Op::Add : Op::Sub;
+          l = emit({op, l, build_child(node, i + 1)});
+        }
+        return l;
+      }
+      case "CALL"_: {
+        const auto& callee = *node.nodes[0];
+        auto fn_value = emit({Op::Callee, lookup(callee.token)});
+        Inst call{dynamic ? Op::CallDynamic : Op::Call, fn_value,
+                  build_child(node, 1)};
+        call.name = callee.token;
+        if (dynamic) {
+          call.aux = uint32_t(fn->scopes.size());
+          auto& names = fn->scopes.emplace_back();
+          for (auto [name, value] : scope) {
+            names.push_back(name);
+            call.inputs.push_back(value);
+          }
+        }
+        return emit(move(call));
+      }
+      case "FOR"_: {
+        auto from = bound_value(*node.nodes[1]);
+        auto to = bound_value(*node.nodes[2]);
+        return build_for(node, from, to);
+      }
+      case "Identifier"_:
+        return lookup(node.token);
+      case "Number"_:
+        return const_value(number(node));
+      default:
+        // Definitions below the top level
+        throw Unsupported{};
+    }
+  }
+
+  Id build_for(const Node& node, Id from, Id to) {
+    auto one = const_value(Value(1L));
+    auto header = fn->add_block();
+    auto body = fn->add_block();
+    auto exit = fn->add_block();
+
+    Inst jump{Op::Jump};
+    jump.targets[0] = header;
+    emit(jump);
+    fn->link(block, header);
+
+    block = header;
+    auto i = emit({Op::Phi});
+    fn->insts[i].inputs.push_back(from);
+    Inst test{Op::Branch, emit({Op::LessEq, i, to})};
+    test.targets = {body, exit};
+    emit(move(test));
+    fn->link(header, body);
+    fn->link(header, exit);
+
+    block = body;
+    emit({Op::Iterate, i, to});
+    scope.emplace_back(node.nodes[0]->token, i);
+    build_child(node, 3);
+    scope.pop_back();
+    auto next = emit({Op::Add, i, one});
+    fn->insts[i].inputs.push_back(next);
+    emit(jump);
+    fn->link(block, header);
+
+    block = exit;
+    return const_value(Value());
+  }
+
+  static Value number(const Node& node) {
+    if (node.token.size() > 18) {
+      return Value(BigInt(node.token));
+    }
+    return Value(node.token_to_number<long>());
+  }
+
+  // FOR bounds are converted with to_long() before the loop starts
+  Id bound_value(const Node& node) {
+    auto value = number(node);
+    if (value.type != Value::Type::Long) {
+      throw Unsupported{};
+    }
+    return const_value(move(value));
+  }
+};
+
+//-----------------------------------------------------------------------------
+// IR optimizer
+//-----------------------------------------------------------------------------
+
+class Optimizer {
+public:
+  Optimizer(Module& module, size_t unroll_factor)
+      : module(module), stats(module.stats), unroll_factor(unroll_factor) {}
+
+  void run() {
+    analyze_purity();
+    for (auto& fn : module.functions) {
+      optimize(*fn);
+    }
+    narrow_ranges();
+    for (auto& fn : module.functions) {
+      fn->profile.sites = make_unique<Site[]>(fn->insts.size());
+    }
+  }
+
+  // Code for `fn` specialized on its type feedback, or nullptr when the
+  // feedback removes no check. An argument and call results only seen as
+  // longs are assumed to be longs, and arithmetic on longs deoptimizes on
+  // overflow instead of making a BigInt. The specialized code runs the same
+  // instructions in the same blocks, so the executor can continue in `fn`
+  // from where it deoptimized.
+  static unique_ptr<Function> specialize(const Function& fn) {
+    const auto& profile = fn.profile;
+    auto code = make_unique<Function>();
+    code->name = fn.name;
+    code->param = fn.param;
+    code->definition = fn.definition;
+    code->body = fn.body;
+    code->insts = fn.insts;
+    code->blocks = fn.blocks;
+    code->constants = fn.constants;
+    code->scopes = fn.scopes;
+    code->pure = fn.pure;
+    code->guard = fn.guard;
+    code->speculative = true;
+    code->long_arg = profile.args.load(memory_order_relaxed) == long_bit;
+    for (Id id = 0; id < fn.insts.size(); id++) {
+      if (fn.insts[id].op == Op::Call &&
+          profile.sites[id].results.load(memory_order_relaxed) == long_bit) {
+        code->insts[id].aux = 1;
+      }
+    }
+
+    auto param = !code->long_arg ? Range::any()
+                 : fn.guard      ? Range::of(fn.guard->first, fn.guard->second)
+                                 : Range::of(LONG_MIN, LONG_MAX);
+    insert_pis(*code);
+    auto ranges = infer_ranges(*code, param, true);
+    Stats stats;
+    if (!narrow(*code, ranges, &stats, true)) {
+      return nullptr;
+    }
+
+    // Pis are only needed by the analysis: their uses read the original
+    // values again and the blocks go back to those of `fn`
+    for_each_inst(*code, [&](Id id, const Inst& inst) {
+      if (inst.op == Op::Pi) {
+        to_copy(code->insts[id], inst.a);
+      }
+    });
+    for (auto& block : code->blocks) {
+      for (auto id : block.insts) {
+        auto& inst = code->insts[id];
+        inst.a = resolve(*code, inst.a);
+        inst.b = resolve(*code, inst.b);
+        for (auto& input : inst.inputs) {
+          input = resolve(*code, input);
+        }
+      }
+    }
+    code->blocks = fn.blocks;
+    return code;
+  }
+
+private:
+  Module& module;
+  Stats& stats;
+  size_t unroll_factor;
+  map<string_view, Function*> functions;  // by name, from analyze_purity()
+
+  static Id resolve(const Function& fn, Id id) {
+    while (id != none && fn.insts[id].op == Op::Copy) {
+      id = fn.insts[id].a;
+    }
+    return id;
+  }
+
+  // A function is pure when every call it makes is to a pure function of the
+  // module. Start from all pure and drop the impure ones until nothing
+  // changes, so recursion stays pure.
+  void analyze_purity() {
+    for (size_t i = 1; i < module.functions.size(); i++) {
+      auto& fn = *module.functions[i];
+      fn.pure = true;
+      functions[fn.name] = &fn;
+    }
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (auto [_, fn] : functions) {
+        if (fn->pure && !calls_pure(*fn, functions)) {
+          fn->pure = false;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  static bool calls_pure(const Function& fn,
+                         const map<string_view, Function*>& functions) {
+    for (const auto& inst : fn.insts) {
+      if (inst.op == Op::Call && !pure_call(fn, inst, functions)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool pure_call(const Function& fn, const Inst& call,
+                        const map<string_view, Function*>& functions) {
+    const auto& callee = fn.insts[resolve(fn, fn.insts[resolve(fn, call.a)].a)];
+    if (callee.op != Op::Global) {
+      return false;
+    }
+    auto it = functions.find(callee.name);
+    return it != functions.end() && it->second->pure;
+  }
+
+  void optimize(Function& fn) {
+    propagate_copies(fn);
+    fold(fn);
+    propagate_copies(fn);
+    if (unroll_factor > 0) {
+      for (uint32_t b = 0, n = uint32_t(fn.blocks.size()); b < n; b++) {
+        if (auto loop = find_loop(fn, b)) {
+          unroll(fn, *loop);
+        }
+      }
+      fold(fn);
+    }
+    number_values(fn);
+    propagate_copies(fn);
+    eliminate_dead_code(fn);
+  }
+
+  // Operands read through copies read the copied value instead.
+  void propagate_copies(Function& fn) {
+    for (auto& block : fn.blocks) {
+      if (block.dead) {
+        continue;
+      }
+      for (auto id : block.insts) {
+        auto& inst = fn.insts[id];
+        if (inst.op == Op::Copy) {
+          // Counted once, when the copy is first bypassed
+          if (inst.aux == 0) {
+            stats.copies++;
+            inst.aux = 1;
+          }
+          continue;
+        }
+        inst.a = resolve(fn, inst.a);
+        inst.b = resolve(fn, inst.b);
+        for (auto& input : inst.inputs) {
+          input = resolve(fn, input);
+        }
+      }
+    }
+  }
+
+  // Replaces `inst` by a copy of `value`, marked as counted
+  static void to_copy(Inst& inst, Id value) { replace(inst, {Op::Copy, value, none, 1}); }
+
+  static void replace(Inst& inst, Inst&& with) {
+    with.node = inst.node;
+    with.delta = inst.delta;
+    inst = move(with);
+  }
+
+  // Folds arithmetic on constants and branches on constant conditions, and
+  // drops the blocks that become unreachable.
+  void fold(Function& fn) {
+    for (uint32_t b = 0; b < fn.blocks.size(); b++) {
+      if (fn.blocks[b].dead) {
+        continue;
+      }
+      for (auto id : fn.blocks[b].insts) {
+        auto& inst = fn.insts[id];
+        auto constant = [&](Id v) -> const Value* {
+          return v != none && fn.insts[v].op == Op::Const
+                     ? &fn.constants[fn.insts[v].aux]
+                     : nullptr;
+        };
+        auto l = constant(inst.a);
+        auto r = constant(inst.b);
+        try {
+          optional<Value> value;
+          switch (inst.op) {
+            case Op::Add:
+              if (l && r) value = *l + *r;
+              break;
+            case Op::Sub:
+              if (l && r) value = *l - *r;
+              break;
+            case Op::Less:
+              if (l && r) value = Value(*l < *r);
+              break;
+            case Op::LessEq:
+              if (l && r) value = Value(!(*r < *l));
+              break;
+            case Op::Phi:
+              // All inputs the same
+              if (all_of(inst.inputs.begin(), inst.inputs.end(),
+                         [&](Id v) { return v == inst.inputs[0] || v == id; })) {
+                to_copy(inst, inst.inputs[0]);
+                inst.aux = 0;
+              }
+              break;
+            case Op::Branch:
+              if (l) {
+                auto taken = inst.targets[l->to_bool() ? 0 : 1];
+                auto other = inst.targets[l->to_bool() ? 1 : 0];
+                Inst jump{Op::Jump};
+                jump.targets[0] = taken;
+                replace(inst, move(jump));
+                if (other != taken) {
+                  remove_edge(fn, b, other);
+                }
+                stats.folded++;
+              }
+              break;
+            default:
+              break;
+          }
+          if (value) {
+            fn.constants.push_back(move(*value));
+            replace(inst, {Op::Const, none, none,
+                           uint32_t(fn.constants.size() - 1)});
+            stats.folded++;
+          }
+        } catch (const runtime_error&) {
+          // Left for the runtime to report
+        }
+      }
+    }
+
+    vector<bool> reachable(fn.blocks.size());
+    for (auto b : reverse_postorder(fn)) {
+      reachable[b] = true;
+    }
+    for (uint32_t b = 0; b < fn.blocks.size(); b++) {
+      if (!reachable[b] && !fn.blocks[b].dead) {
+        fn.blocks[b].dead = true;
+        stats.unreachable++;
+        for (auto s : successors(fn, b)) {
+          if (reachable[s]) {
+            remove_edge(fn, b, s);
+          }
+        }
+      }
+    }
+  }
+
+  void remove_edge(Function& fn, uint32_t from, uint32_t to) {
+    auto& block = fn.blocks[to];
+    auto it = find(block.preds.begin(), block.preds.end(), from);
+    auto index = it - block.preds.begin();
+    block.preds.erase(it);
+    for (auto id : block.insts) {
+      auto& inst = fn.insts[id];
+      if (inst.op == Op::Phi) {
+        inst.inputs.erase(inst.inputs.begin() + index);
+        if (inst.inputs.size() == 1) {
+          to_copy(inst, inst.inputs[0]);
+          inst.aux = 0;
+        }
+      }
+    }
+  }
+
+  // A FOR loop the builder made: the header holds only the loop variable, the
+  // test and the branch, and the variable steps by one from a constant to a
+  // constant.
+  struct Loop {
+    uint32_t header;
+    uint32_t entry;  // of the body
+    uint32_t latch;  // jumps back to the header
+    uint32_t exit;
+    vector<uint32_t> blocks;  // of the body
+    Id var;
+    Id next;  // var + 1
+    unsigned long trips;
+  };
+
+  static bool is_loop_header(const Function& fn, uint32_t b) {
+    const auto& term = fn.insts[fn.blocks[b].insts.back()];
+    return term.op == Op::Branch && fn.insts[term.a].op == Op::LessEq;
+  }
+
+  // The loop at `h`, if it has a known trip count, no nested loop and a
+  // body of at most `max_loop_size` instructions
+  static optional<Loop> find_loop(const Function& fn, uint32_t h) {
+    const auto& header = fn.blocks[h];
+    if (header.dead || header.preds.size() != 2 || header.insts.size() != 3 ||
+        !is_loop_header(fn, h)) {
+      return nullopt;
+    }
+    Loop loop;
+    loop.header = h;
+    loop.var = header.insts[0];
+    const auto& var = fn.insts[loop.var];
+    const auto& test = fn.insts[header.insts[1]];
+    const auto& branch = fn.insts[header.insts[2]];
+    if (var.op != Op::Phi || test.a != loop.var) {
+      return nullopt;
+    }
+    loop.entry = branch.targets[0];
+    loop.exit = branch.targets[1];
+    loop.latch = header.preds[1];
+    loop.next = var.inputs[1];
+
+    auto constant = [&](Id id) -> optional<long> {
+      const auto& inst = fn.insts[id];
+      if (inst.op != Op::Const ||
+          fn.constants[inst.aux].type != Value::Type::Long) {
+        return nullopt;
+      }
+      return fn.constants[inst.aux].n;
+    };
+    const auto& next = fn.insts[loop.next];
+    auto from = constant(var.inputs[0]);
+    auto to = constant(test.b);
+    if (next.op != Op::Add || next.a != loop.var || constant(next.b) != 1 ||
+        !from || !to || *to < *from) {
+      return nullopt;
+    }
+    loop.trips = (unsigned long)*to - (unsigned long)*from + 1;
+    if (loop.trips == 0) {
+      return nullopt;
+    }
+
+    // The body is what reaches the latch without going through the header
+    vector<uint32_t> work{loop.latch};
+    set<uint32_t> seen{h, loop.latch};
+    size_t size = 0;
+    while (!work.empty()) {
+      auto b = work.back();
+      work.pop_back();
+      if (is_loop_header(fn, b)) {
+        return nullopt;
+      }
+      loop.blocks.push_back(b);
+      size += fn.blocks[b].insts.size();
+      if (size > max_loop_size) {
+        return nullopt;
+      }
+      for (auto p : fn.blocks[b].preds) {
+        if (seen.insert(p).second) {
+          work.push_back(p);
+        }
+      }
+    }
+    sort(loop.blocks.begin(), loop.blocks.end());
+    return loop;
+  }
+
+  // Peels the first iterations of `loop` and unrolls the rest. Value
+  // numbering then replaces the loop-invariant computations of the loop by
+  // those of a peeled iteration, which hoists them without running anything
+  // eval() wouldn't, or in another order. The number of remaining iterations
+  // is a multiple of the unroll factor, so the copies of the body need no
+  // test between them.
+  void unroll(Function& fn, const Loop& loop) {
+    auto factor = unroll_factor;
+    auto peeled = 1 + (loop.trips - 1) % factor;
+
+    // Copies are made before the body is changed. Each one follows the
+    // previous one and starts from its `next`.
+    vector<Copy> copies;
+    for (size_t i = 0; i < peeled + factor - 1; i++) {
+      copies.push_back(clone(fn, loop));
+    }
+    auto last = fn.blocks[loop.header].preds[0];
+    auto var = fn.insts[loop.var].inputs[0];
+    auto chain = [&](const Copy& copy) {
+      retarget(fn, last, loop.header, copy.entry);
+      fn.blocks[copy.entry].preds = {last};
+      auto rename = [&](Id& v) { v = v == loop.var ? var : v; };
+      for (auto id : copy.uses) {
+        auto& inst = fn.insts[id];
+        rename(inst.a);
+        rename(inst.b);
+        for (auto& input : inst.inputs) {
+          rename(input);
+        }
+      }
+      last = copy.latch;
+      var = copy.next;
+    };
+    for (size_t i = 0; i < peeled; i++) {
+      chain(copies[i]);
+    }
+    stats.loops++;
+
+    if (peeled == loop.trips) {
+      // Nothing is left for the loop, which the next fold() drops
+      retarget(fn, last, loop.header, loop.exit);
+      fn.blocks[loop.exit].preds.push_back(last);
+      return;
+    }
+    fn.blocks[loop.header].preds[0] = last;
+    fn.insts[loop.var].inputs[0] = var;
+
+    auto blocks = loop.blocks;
+    blocks.push_back(loop.header);
+    last = loop.latch;
+    var = loop.next;
+    for (auto i = peeled; i < copies.size(); i++) {
+      chain(copies[i]);
+      blocks.insert(blocks.end(), copies[i].blocks.begin(),
+                    copies[i].blocks.end());
+    }
+    fn.blocks[loop.header].preds[1] = last;
+    fn.insts[loop.var].inputs[1] = var;
+    for (auto b : blocks) {
+      fn.blocks[b].loop = loop.header;
+    }
+  }
+
+  struct Copy {
+    uint32_t entry;
+    uint32_t latch;
+    Id next;
+    vector<uint32_t> blocks;
+    vector<Id> uses;  // of the loop variable
+  };
+
+  // Copies the body of `loop`. The copy still reads the loop variable and
+  // jumps back to the header.
+  static Copy clone(Function& fn, const Loop& loop) {
+    map<uint32_t, uint32_t> blocks;
+    map<Id, Id> values;
+    auto id = Id(fn.insts.size());
+    for (auto b : loop.blocks) {
+      blocks[b] = fn.add_block();
+      for (auto inst : fn.blocks[b].insts) {
+        values[inst] = id++;
+      }
+    }
+    auto value = [&](Id v) {
+      auto it = values.find(v);
+      return it == values.end() ? v : it->second;
+    };
+    auto block = [&](uint32_t b) {
+      auto it = blocks.find(b);
+      return it == blocks.end() ? b : it->second;
+    };
+
+    vector<Id> uses;
+    for (auto b : loop.blocks) {
+      for (auto p : fn.blocks[b].preds) {
+        fn.blocks[blocks[b]].preds.push_back(block(p));
+      }
+      for (auto original : fn.blocks[b].insts) {
+        auto inst = fn.insts[original];
+        inst.a = value(inst.a);
+        inst.b = value(inst.b);
+        for (auto& input : inst.inputs) {
+          input = value(input);
+        }
+        if (inst.op == Op::Jump || inst.op == Op::Branch) {
+          for (auto& target : inst.targets) {
+            target = block(target);
+          }
+        }
+        if (inst.a == loop.var || inst.b == loop.var ||
+            count(inst.inputs.begin(), inst.inputs.end(), loop.var)) {
+          uses.push_back(Id(fn.insts.size()));
+        }
+        fn.blocks[blocks[b]].insts.push_back(Id(fn.insts.size()));
+        fn.insts.push_back(move(inst));
+      }
+    }
+
+    Copy copy{blocks[loop.entry], blocks[loop.latch], value(loop.next), {},
+              move(uses)};
+    for (auto [_, b] : blocks) {
+      copy.blocks.push_back(b);
+    }
+    return copy;
+  }
+
+
+  static void retarget(Function& fn, uint32_t b, uint32_t from, uint32_t to) {
+    auto& term = fn.insts[fn.blocks[b].insts.back()];
+    for (auto& target : term.targets) {
+      if (target == from) {
+        target = to;
+      }
+    }
+  }
+
+  // Blocks in reverse postorder, and the immediate dominator of each
+  static vector<uint32_t> reverse_postorder(const Function& fn) {
+    vector<uint32_t> order;
+    vector<bool> seen(fn.blocks.size());
+    vector<pair<uint32_t, size_t>> stack{{0, 0}};
+    seen[0] = true;
+    while (!stack.empty()) {
+      auto& [b, i] = stack.back();
+      auto succs = successors(fn, b);
+      if (i < succs.size()) {
+        auto s = succs[i++];
+        if (!seen[s]) {
+          seen[s] = true;
+          stack.emplace_back(s, 0);
+        }
+      } else {
+        order.push_back(b);
+        stack.pop_back();
+      }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+  }
+
+  static vector<uint32_t> successors(const Function& fn, uint32_t b) {
+    const auto& term = fn.insts[fn.blocks[b].insts.back()];
+    switch (term.op) {
+      case Op::Jump:
+        return {term.targets[0]};
+      case Op::Branch:
+        return {term.targets[0], term.targets[1]};
+      default:
+        return {};
+    }
+  }
+
+  // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+  static vector<uint32_t> dominators(const Function& fn,
+                                     const vector<uint32_t>& order) {
+    vector<uint32_t> index(fn.blocks.size(), none);
+    for (uint32_t i = 0; i < order.size(); i++) {
+      index[order[i]] = i;
+    }
+    vector<uint32_t> idom(fn.blocks.size(), none);
+    idom[0] = 0;
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (auto b : order) {
+        if (b == 0) {
+          continue;
+        }
+        auto dom = none;
+        for (auto p : fn.blocks[b].preds) {
+          if (idom[p] == none) {
+            continue;
+          }
+          if (dom == none) {
+            dom = p;
+            continue;
+          }
+          auto x = p;
+          while (x != dom) {
+            while (index[x] > index[dom]) x = idom[x];
+            while (index[dom] > index[x]) dom = idom[dom];
+          }
+        }
+        if (idom[b] != dom) {
+          idom[b] = dom;
+          changed = true;
+        }
+      }
+    }
+    return idom;
+  }
+
+  // Global value numbering over the dominator tree: an instruction that
+  // computes the same thing as one in a dominating position is replaced by
+  // it. Calls are numbered only when the callee is pure.
+  void number_values(Function& fn) {
+    auto order = reverse_postorder(fn);
+    auto idom = dominators(fn, order);
+    vector<vector<uint32_t>> children(fn.blocks.size());
+    for (auto b : order) {
+      if (b != 0) {
+        children[idom[b]].push_back(b);
+      }
+    }
+
+    vector<uint32_t> block_of(fn.insts.size(), none);
+    for (auto b : order) {
+      for (auto id : fn.blocks[b].insts) {
+        block_of[id] = b;
+      }
+    }
+
+    // Globals defined on the dominator path; every name is defined once
+    unordered_set<string_view> defined;
+    unordered_map<string, Id> table;
+    auto key = [&](const Inst& inst) -> optional<string> {
+      ostringstream out;
+      out << int(inst.op) << "," << inst.a << "," << inst.b << ",";
+      switch (inst.op) {
+        case Op::Const:
+          out << fn.constants[inst.aux].str();
+          break;
+        case Op::Global:
+          // The top level defines globals as it goes.
+          out << inst.name;
+          if (fn.name.empty()) {
+            out << "," << defined.count(inst.name);
+          }
+          break;
+        case Op::Call:
+          if (!pure_call(fn, inst, functions)) {
+            return nullopt;
+          }
+          break;
+        case Op::Callee:
+        case Op::Add:
+        case Op::Sub:
+        case Op::Less:
+        case Op::LessEq:
+          break;
+        default:
+          return nullopt;
+      }
+      return out.str();
+    };
+
+    // Iterative preorder walk, undoing each block's entries on the way out
+    struct Scope {
+      uint32_t block;
+      vector<string> added;
+      vector<string_view> defined;
+    };
+    vector<Scope> stack;
+    auto enter = [&](uint32_t b) {
+      Scope scope{b, {}, {}};
+      for (auto id : fn.blocks[b].insts) {
+        auto& inst = fn.insts[id];
+        inst.a = resolve(fn, inst.a);
+        inst.b = resolve(fn, inst.b);
+        if (inst.op == Op::Define && defined.insert(inst.name).second) {
+          scope.defined.push_back(inst.name);
+        }
+        auto k = key(inst);
+        if (!k) {
+          continue;
+        }
+        auto [it, inserted] = table.emplace(*k, id);
+        if (inserted) {
+          scope.added.push_back(move(*k));
+        } else {
+          // Replaced by a value from before the loop it is in: hoisted
+          if (inst.op != Op::Const) {
+            auto loop = fn.blocks[b].loop;
+            auto hoisted = loop != none &&
+                           fn.blocks[block_of[it->second]].loop != loop;
+            (hoisted ? stats.hoisted : stats.cse)++;
+          }
+          to_copy(inst, it->second);
+        }
+      }
+      stack.push_back(move(scope));
+    };
+    vector<pair<uint32_t, size_t>> walk{{0, 0}};
+    enter(0);
+    while (!walk.empty()) {
+      auto& [b, i] = walk.back();
+      if (i < children[b].size()) {
+        auto c = children[b][i++];
+        walk.emplace_back(c, 0);
+        enter(c);
+      } else {
+        for (const auto& k : stack.back().added) {
+          table.erase(k);
+        }
+        for (auto name : stack.back().defined) {
+          defined.erase(name);
+        }
+        stack.pop_back();
+        walk.pop_back();
+      }
+    }
+  }
+
+  static Type join(Type a, Type b) {
+    return a == Type::None ? b : b == Type::None || a == b ? a : Type::Any;
+  }
+
+  // Replaces checked arithmetic and comparisons by unchecked ones where the
+  // operands are longs in ranges that can't overflow, and decides the
+  // conditions the ranges imply. Ranges come from constants, from the
+  // comparisons that branch into a block, and for arguments from the calls
+  // the module makes. A function whose code relies on the range of its
+  // argument checks it on entry, since other instances may call it too.
+  void narrow_ranges() {
+    auto& functions = module.functions;
+    map<string_view, size_t> index;
+    for (size_t i = 1; i < functions.size(); i++) {
+      index[functions[i]->name] = i;
+    }
+    // The function of the module `id` loads, or 0
+    auto function_of = [&](const Function& fn, Id id) -> size_t {
+      const auto& inst = fn.insts[id];
+      auto it = inst.op == Op::Global ? index.find(inst.name) : index.end();
+      return it == index.end() ? 0 : it->second;
+    };
+
+    // Functions used as values may be called with anything. The code of a
+    // loop moved by OSR starts within the bounds of the loop.
+    vector<Range> params(functions.size());
+    if (auto& guard = functions[0]->guard) {
+      params[0] = Range::of(guard->first, guard->second);
+    }
+    for (const auto& fn : functions) {
+      insert_pis(*fn);
+      for_each_inst(*fn, [&](Id, const Inst& inst) {
+        auto operands = inst.inputs;
+        if (inst.op != Op::Callee) {
+          operands.push_back(inst.a);
+        }
+        operands.push_back(inst.b);
+        for (auto v : operands) {
+          if (v != none && function_of(*fn, v)) {
+            params[function_of(*fn, v)] = Range::any();
+          }
+        }
+      });
+    }
+
+    // Arguments of the calls the module makes, to a fixed point. Ranges
+    // that keep growing are widened to the end of the long range.
+    for (size_t round = 0, changed = true; changed; round++) {
+      changed = false;
+      for (size_t i = 0; i < functions.size(); i++) {
+        const auto& fn = *functions[i];
+        auto ranges = infer_ranges(fn, params[i]);
+        for_each_inst(fn, [&](Id, const Inst& inst) {
+          auto callee = inst.op == Op::Call
+                            ? function_of(fn, fn.insts[inst.a].a)
+                            : 0;
+          if (!callee) {
+            return;
+          }
+          auto& param = params[callee];
+          auto joined = widen(param, param.join(ranges[inst.b]), round);
+          if (joined != param) {
+            param = joined;
+            changed = true;
+          }
+        });
+      }
+    }
+
+    for (size_t i = 0; i < functions.size(); i++) {
+      auto& fn = *functions[i];
+      auto ranges = infer_ranges(fn, Range::any());
+      if (params[i].is_long()) {
+        auto guarded = infer_ranges(fn, params[i]);
+        if (narrow(fn, guarded) > narrow(fn, ranges)) {
+          fn.guard = pair(params[i].lo, params[i].hi);
+          stats.guarded++;
+          ranges = move(guarded);
+        }
+      }
+      narrow(fn, ranges, &stats);
+
+      for_each_inst(fn, [&](Id id, const Inst& inst) {
+        if (inst.op == Op::Pi) {
+          to_copy(fn.insts[id], inst.a);
+        }
+      });
+      propagate_copies(fn);
+      fold(fn);
+      propagate_copies(fn);
+      eliminate_dead_code(fn);
+    }
+  }
+
+  template <typename F> static void for_each_inst(const Function& fn, F f) {
+    for (const auto& block : fn.blocks) {
+      if (block.dead) {
+        continue;
+      }
+      for (auto id : block.insts) {
+        f(id, fn.insts[id]);
+      }
+    }
+  }
+
+  // Widens the bounds of `next` that moved since `prev` once `round` says
+  // they may keep moving
+  static Range widen(const Range& prev, Range next, size_t round) {
+    if (round >= 3 && prev.is_long() && next.is_long()) {
+      if (next.lo < prev.lo) {
+        next.lo = LONG_MIN;
+      }
+      if (next.hi > prev.hi) {
+        next.hi = LONG_MAX;
+      }
+    }
+    return next;
+  }
+
+  // Inserts pis of the operands of each comparison at the start of the
+  // blocks its branch leads to, and renames the uses these blocks dominate
+  static void insert_pis(Function& fn) {
+    auto order = reverse_postorder(fn);
+    for (auto b : order) {
+      auto term = fn.insts[fn.blocks[b].insts.back()];
+      if (term.op != Op::Branch) {
+        continue;
+      }
+      auto cond = fn.insts[term.a];
+      if (cond.op != Op::Less && cond.op != Op::LessEq) {
+        continue;
+      }
+      for (uint32_t taken : {1, 0}) {
+        auto& target = fn.blocks[term.targets[taken ? 0 : 1]];
+        if (target.preds.size() != 1) {
+          continue;
+        }
+        for (uint32_t right : {0, 1}) {
+          auto v = right ? cond.b : cond.a;
+          if (fn.insts[v].op == Op::Const) {
+            continue;
+          }
+          // aux: bit 0 for the true edge, bit 1 for the right operand
+          Inst pi{Op::Pi, v, term.a, taken | right << 1};
+          pi.node = cond.node;
+          pi.delta = cond.delta;
+          auto it = find_if(target.insts.begin(), target.insts.end(),
+                            [&](Id id) { return fn.insts[id].op != Op::Phi; });
+          target.insts.insert(it, Id(fn.insts.size()));
+          fn.insts.push_back(move(pi));
+        }
+      }
+    }
+
+    auto idom = dominators(fn, order);
+    vector<vector<uint32_t>> children(fn.blocks.size());
+    for (auto b : order) {
+      if (b != 0) {
+        children[idom[b]].push_back(b);
+      }
+    }
+
+    // Preorder walk over the dominator tree, with the current name of each
+    // value that has pis
+    unordered_map<Id, vector<Id>> names;
+    auto name = [&](Id v) {
+      auto it = v == none ? names.end() : names.find(v);
+      return it == names.end() || it->second.empty() ? v : it->second.back();
+    };
+    vector<vector<Id>> renamed;
+    auto enter = [&](uint32_t b) {
+      renamed.emplace_back();
+      for (auto id : fn.blocks[b].insts) {
+        auto& inst = fn.insts[id];
+        if (inst.op == Op::Pi) {
+          auto v = inst.a;
+          inst.a = name(v);
+          names[v].push_back(id);
+          renamed.back().push_back(v);
+        } else if (inst.op != Op::Phi) {
+          inst.a = name(inst.a);
+          inst.b = name(inst.b);
+        }
+      }
+      for (auto s : successors(fn, b)) {
+        const auto& succ = fn.blocks[s];
+        for (size_t k = 0; k < succ.preds.size(); k++) {
+          if (succ.preds[k] != b) {
+            continue;
+          }
+          for (auto id : succ.insts) {
+            auto& inst = fn.insts[id];
+            if (inst.op == Op::Phi) {
+              inst.inputs[k] = name(inst.inputs[k]);
+            }
+          }
+        }
+      }
+    };
+    vector<pair<uint32_t, size_t>> walk{{0, 0}};
+    enter(0);
+    while (!walk.empty()) {
+      auto& [b, i] = walk.back();
+      if (i < children[b].size()) {
+        auto c = children[b][i++];
+        walk.emplace_back(c, 0);
+        enter(c);
+      } else {
+        for (auto v : renamed.back()) {
+          names[v].pop_back();
+        }
+        renamed.pop_back();
+        walk.pop_back();
+      }
+    }
+  }
+
+  // Ranges of the values of `fn` for an argument in `param`, iterated to a
+  // fixed point with widening at the phis, then narrowed by two more rounds.
+  // When `speculate`, arithmetic on longs stays a long, since specialized
+  // code deoptimizes rather than overflow.
+  static vector<Range> infer_ranges(const Function& fn, const Range& param,
+                                    bool speculate = false) {
+    auto order = reverse_postorder(fn);
+    vector<Range> ranges(fn.insts.size());
+    auto eval = [&](Id id) -> Range {
+      const auto& inst = fn.insts[id];
+      switch (inst.op) {
+        case Op::Const: {
+          const auto& value = fn.constants[inst.aux];
+          return value.type == Value::Type::Long ? Range::of(value.n, value.n)
+                                                 : Range::any();
+        }
+        case Op::Param:
+          return param;
+        case Op::Copy:
+          return ranges[inst.a];
+        case Op::Pi:
+          return refine(fn, inst, ranges);
+        case Op::Call:
+          return inst.aux ? Range::of(LONG_MIN, LONG_MAX) : Range::any();
+        case Op::Add:
+        case Op::Sub:
+        case Op::AddInt:
+        case Op::SubInt:
+        case Op::AddLong:
+        case Op::SubLong: {
+          const auto& l = ranges[inst.a];
+          const auto& r = ranges[inst.b];
+          if (l.kind == Range::None || r.kind == Range::None) {
+            return {};
+          }
+          auto range = arithmetic(inst.op, l, r);
+          if (!range.is_long() && speculate && l.is_long() && r.is_long()) {
+            return Range::of(LONG_MIN, LONG_MAX);
+          }
+          return range;
+        }
+        case Op::Phi: {
+          Range range;
+          for (auto input : inst.inputs) {
+            range = range.join(ranges[input]);
+          }
+          return range;
+        }
+        default:
+          return Range::any();
+      }
+    };
+
+    for (size_t round = 0, changed = true; changed; round++) {
+      changed = false;
+      for (auto b : order) {
+        for (auto id : fn.blocks[b].insts) {
+          auto range = eval(id);
+          if (fn.insts[id].op == Op::Phi) {
+            range = widen(ranges[id], range, round);
+          }
+          if (range != ranges[id]) {
+            ranges[id] = range;
+            changed = true;
+          }
+        }
+      }
+    }
+    for (auto round = 0; round < 2; round++) {
+      for (auto b : order) {
+        for (auto id : fn.blocks[b].insts) {
+          ranges[id] = eval(id);
+        }
+      }
+    }
+    return ranges;
+  }
+
+  // The range of `l + r` or `l - r`, anything when it may become a BigInt
+  static Range arithmetic(Op op, const Range& l, const Range& r) {
+    if (!l.is_long() || !r.is_long()) {
+      return Range::any();
+    }
+    auto add = op == Op::Add || op == Op::AddInt || op == Op::AddLong;
+    auto lo = add ? __int128(l.lo) + r.lo : __int128(l.lo) - r.hi;
+    auto hi = add ? __int128(l.hi) + r.hi : __int128(l.hi) - r.lo;
+    if (lo < LONG_MIN || hi > LONG_MAX) {
+      return Range::any();
+    }
+    return Range::of(long(lo), long(hi));
+  }
+
+  // The range of the operand of a pi, given that the comparison of the
+  // branch into its block was true (or false)
+  static Range refine(const Function& fn, const Inst& pi,
+                      const vector<Range>& ranges) {
+    auto range = ranges[pi.a];
+    const auto& cond = fn.insts[pi.b];
+    bool right = pi.aux & 2;
+    const auto& other = ranges[right ? cond.a : cond.b];
+    if (!range.is_long() || !other.is_long()) {
+      return range;
+    }
+
+    // `l < r` or `l <= r` holds, with the operands swapped when it was false
+    auto strict = cond.op == Op::Less;
+    auto left = !right;
+    if (!(pi.aux & 1)) {
+      strict = !strict;
+      left = !left;
+    }
+    __int128 lo = range.lo, hi = range.hi;
+    if (left) {
+      hi = min(hi, __int128(other.hi) - strict);
+    } else {
+      lo = max(lo, __int128(other.lo) + strict);
+    }
+    return lo > hi ? Range() : Range::of(long(lo), long(hi));
+  }
+
+  // Counts the checks `ranges` make unnecessary, and removes them when
+  // given `stats` to count them in. When `speculate`, arithmetic that may
+  // overflow becomes arithmetic that deoptimizes when it does.
+  static size_t narrow(Function& fn, const vector<Range>& ranges,
+                       Stats* stats = nullptr, bool speculate = false) {
+    auto apply = stats != nullptr;
+    size_t removed = 0;
+    for_each_inst(fn, [&](Id id, const Inst& inst) {
+      if (inst.op < Op::Add || inst.op > Op::LessEq ||
+          !ranges[inst.a].is_long() || !ranges[inst.b].is_long()) {
+        return;
+      }
+      const auto& l = ranges[inst.a];
+      const auto& r = ranges[inst.b];
+      auto& target = fn.insts[id];
+      switch (inst.op) {
+        case Op::Add:
+        case Op::Sub: {
+          auto add = inst.op == Op::Add;
+          if (arithmetic(inst.op, l, r).is_long()) {
+            removed++;
+            if (apply) {
+              target.op = add ? Op::AddInt : Op::SubInt;
+              stats->overflow++;
+            }
+          } else if (speculate) {
+            removed++;
+            if (apply) {
+              target.op = add ? Op::AddLong : Op::SubLong;
+              stats->guards++;
+            }
+          }
+          break;
+        }
+        default: {
+          removed++;
+          if (!apply) {
+            break;
+          }
+          auto strict = inst.op == Op::Less;
+          optional<bool> value;
+          if (strict ? l.hi < r.lo : l.hi <= r.lo) {
+            value = true;
+          } else if (strict ? l.lo >= r.hi : l.lo > r.hi) {
+            value = false;
+          }
+          if (value) {
+            fn.constants.push_back(Value(*value));
+            replace(target, {Op::Const, none, none,
+                             uint32_t(fn.constants.size() - 1)});
+            stats->conditions++;
+          } else {
+            target.op = strict ? Op::LessInt : Op::LessEqInt;
+            stats->guards++;
+          }
+          break;
+        }
+      }
+    });
+    return removed;
+  }
+
+  // Static types of the values, iterated to a fixed point over the loops
+  static vector<Type> infer_types(const Function& fn) {
+    vector<Type> types(fn.insts.size(), Type::None);
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (const auto& block : fn.blocks) {
+        if (block.dead) {
+          continue;
+        }
+        for (auto id : block.insts) {
+          const auto& inst = fn.insts[id];
+          auto type = Type::Any;
+          switch (inst.op) {
+            case Op::Const: {
+              auto t = fn.constants[inst.aux].type;
+              type = t == Value::Type::Long || t == Value::Type::BigInt
+                         ? Type::Int
+                     : t == Value::Type::Bool ? Type::Bool
+                     : t == Value::Type::Nil  ? Type::Nil
+                                              : Type::Any;
+              break;
+            }
+            case Op::Copy:
+            case Op::Pi:
+              type = types[inst.a];
+              break;
+            case Op::Add:
+            case Op::Sub:
+            case Op::AddInt:
+            case Op::SubInt:
+            case Op::AddLong:
+            case Op::SubLong:
+              type = Type::Int;
+              break;
+            case Op::Less:
+            case Op::LessEq:
+            case Op::LessInt:
+            case Op::LessEqInt:
+              type = Type::Bool;
+              break;
+            case Op::Phi:
+              type = Type::None;
+              for (auto input : inst.inputs) {
+                type = join(type, types[input]);
+              }
+              break;
+            default:
+              break;
+          }
+          if (types[id] != type) {
+            types[id] = type;
+            changed = true;
+          }
+        }
+      }
+    }
+    return types;
+  }
+
+  // Removes instructions whose results are unused and that can neither fail
+  // nor have an effect. Arithmetic only qualifies on known integers, so the
+  // errors eval() would raise are preserved.
+  void eliminate_dead_code(Function& fn) {
+    auto types = infer_types(fn);
+    auto removable = [&](const Inst& inst) {
+      switch (inst.op) {
+        case Op::Const:
+        case Op::Param:
+        case Op::Copy:
+        case Op::Phi:
+        case Op::Pi:
+        case Op::AddInt:
+        case Op::SubInt:
+        case Op::LessInt:
+        case Op::LessEqInt:
+          return true;
+        case Op::Add:
+        case Op::Sub:
+        case Op::Less:
+        case Op::LessEq:
+          return types[inst.a] == Type::Int && types[inst.b] == Type::Int;
+        default:
+          return false;
+      }
+    };
+
+    vector<bool> live(fn.insts.size());
+    vector<Id> work;
+    auto mark = [&](Id id) {
+      if (id != none && !live[id]) {
+        live[id] = true;
+        work.push_back(id);
+      }
+    };
+    for (const auto& block : fn.blocks) {
+      if (block.dead) {
+        continue;
+      }
+      for (auto id : block.insts) {
+        if (!removable(fn.insts[id])) {
+          mark(id);
+        }
+      }
+    }
+    while (!work.empty()) {
+      const auto& inst = fn.insts[work.back()];
+      work.pop_back();
+      mark(inst.a);
+      mark(inst.b);
+      for (auto input : inst.inputs) {
+        mark(input);
+      }
+    }
+
+    for (auto& block : fn.blocks) {
+      if (block.dead) {
+        continue;
+      }
+      auto it = remove_if(block.insts.begin(), block.insts.end(), [&](Id id) {
+        if (live[id]) {
+          return false;
+        }
+        // Copies are counted by propagate_copies() and CSE
+        stats.dce += fn.insts[id].op != Op::Copy;
+        return true;
+      });
+      block.insts.erase(it, block.insts.end());
+    }
+  }
+};
+
+// Builds and optimizes the IR of `program`, if it can be compiled. A lazy
+// program is never compiled as a whole; its bodies are by compile_body().
+inline bool compile(Program& program, const Config& config = Config()) {
+  if (program.lazy) {
+    program.bound = Builder::bound_names(program);
+  }
+  auto module = Builder::build(program);
+  if (module) {
+    Optimizer(*module, config.unroll_factor).run();
+    program.module = move(module);
+  }
+  if (config.timeline) {
+    config.timeline->mark("compile");
+  }
+  return program.module != nullptr;
+}
+
+//-----------------------------------------------------------------------------
+// IR executor
+//-----------------------------------------------------------------------------
+
+// Runs the IR of a module on an interpreter. Values live in registers, one
+// per instruction, on a stack owned by the interpreter. It is a deque, so
+// registers stay in place while callees push their frames.
+class Executor {
+public:
+  explicit Executor(Interpreter& interpreter)
+      : interpreter(interpreter),
+        registers(interpreter.registers),
+        scope(interpreter.env()) {}
+
+  Value run(const Module& module, Value arg = Value()) {
+    this->module = &module;
+    if (module.globals && scope->symbols == module.globals) {
+      globals = scope->slots.data();
+    }
+    return call(*module.functions[0], move(arg));
+  }
+
+  // Runs the code of Builder::build_loop() from iteration `from`, with the
+  // names it doesn't bind read from `env`
+  Value run_loop(const Module& module, Rc<Environment> env, long from) {
+    scope = move(env);
+    return run(module, Value(from));
+  }
+
+  // Runs the code of Builder::build_body() on the environment of a call
+  Value run_body(const Module& module, Rc<Environment> env) {
+    auto arg = env->get_value(module.functions[0]->param);
+    if (module.globals && scope->symbols == module.globals) {
+      globals = scope->slots.data();
+    }
+    this->module = &module;
+    scope = move(env);
+    return call(*module.functions[0], move(arg));
+  }
+
+  Value call(const Function& fn, Value arg) {
+    if (fn.guard && !(arg.type == Value::Type::Long &&
+                      fn.guard->first <= arg.n && arg.n <= fn.guard->second)) {
+      auto env = make_rc<Environment>(interpreter.env());
+      env->set_value(fn.param, move(arg));
+      return eval_body(*fn.definition, *fn.body, env);
+    }
+
+    // Both the generic and the specialized code record type feedback
+    const Function* code = &fn;
+    auto& profile = fn.profile;
+    observe(profile.args, type_bit(arg));
+    auto specialize_after = interpreter.config.specialize_after;
+    if (bump(profile.calls) >= specialize_after && specialize_after &&
+        !fn.name.empty() && !profile.tried.load(memory_order_relaxed)) {
+      specialize(fn);
+    }
+    if (auto specialized = profile.specialized.load(memory_order_acquire)) {
+      if (!specialized->long_arg || arg.type == Value::Type::Long) {
+        code = specialized;
+      } else {
+        deoptimized(fn);
+      }
+    }
+
+    auto base = registers.size();
+    registers.resize(base + code->insts.size());
+    struct Pop {
+      deque<Value>& registers;
+      size_t base;
+      ~Pop() { registers.resize(base); }
+    } pop{registers, base};
+    auto r = [&](Id id) -> Value& { return registers[base + id]; };
+
+    const Inst* inst = nullptr;
+    try {
+      uint32_t b = 0;
+      size_t j = 0;
+      auto jump = [&](uint32_t to) {
+        enter(*code, b, to, base);
+        b = to;
+        j = 0;
+      };
+      // Continues in the generic code where the specialized code stopped,
+      // from the same registers
+      auto deoptimize = [&] {
+        code = &fn;
+        deoptimized(fn);
+      };
+      for (;;) {
+        auto id = code->blocks[b].insts[j++];
+        inst = &code->insts[id];
+        switch (inst->op) {
+          case Op::Const:
+            r(id) = code->constants[inst->aux];
+            break;
+          case Op::Param:
+            r(id) = arg;
+            break;
+          case Op::Copy:
+          case Op::Pi:
+            r(id) = r(inst->a);
+            break;
+          case Op::Global:
+            // A slot that is set is the definition get_value() would find
+            if (globals && inst->aux != PerfectHash::npos &&
+                globals[inst->aux].type != Value::Type::Nil) {
+              r(id) = globals[inst->aux];
+            } else {
+              r(id) = scope->get_value(inst->name);
+            }
+            break;
+          case Op::Callee:
+            if (r(inst->a).type != Value::Type::Function) {
+              throw runtime_error("type error.");
+            }
+            r(id) = r(inst->a);
+            break;
+          case Op::Add:
+            r(id) = add(r(inst->a), r(inst->b));
+            break;
+          case Op::Sub:
+            r(id) = sub(r(inst->a), r(inst->b));
+            break;
+          case Op::Less:
+            r(id) = less(r(inst->a), r(inst->b));
+            break;
+          case Op::LessEq:
+            r(id) = Value(!less(r(inst->b), r(inst->a)).to_bool());
+            break;
+          case Op::AddInt:
+            r(id) = Value(r(inst->a).n + r(inst->b).n);
+            break;
+          case Op::SubInt:
+            r(id) = Value(r(inst->a).n - r(inst->b).n);
+            break;
+          case Op::LessInt:
+            r(id) = Value(r(inst->a).n < r(inst->b).n);
+            break;
+          case Op::LessEqInt:
+            r(id) = Value(r(inst->a).n <= r(inst->b).n);
+            break;
+          case Op::AddLong:
+          case Op::SubLong: {
+            long ret;
+            auto l = r(inst->a).n;
+            auto overflow = inst->op == Op::AddLong
+                                ? __builtin_add_overflow(l, r(inst->b).n, &ret)
+                                : __builtin_sub_overflow(l, r(inst->b).n, &ret);
+            if (overflow) {
+              j--;  // redone by the generic code
+              deoptimize();
+              break;
+            }
+            r(id) = Value(ret);
+            break;
+          }
+          case Op::Call: {
+            auto& site = fn.profile.sites[id];
+            observe(site.args, type_bit(r(inst->b)));
+            auto ret = invoke(*inst, r(inst->a), r(inst->b));
+            observe(site.results, type_bit(ret));
+            if (inst->aux && ret.type != Value::Type::Long) {
+              deoptimize();
+            }
+            r(id) = move(ret);
+            break;
+          }
+          case Op::CallDynamic: {
+            // One environment for all of them; the innermost binding of a
+            // name goes in first and stays
+            auto env = make_rc<Environment>(scope);
+            const auto& names = code->scopes[inst->aux];
+            for (auto k = names.size(); k-- > 0;) {
+              env->set_value(names[k], Value(r(inst->inputs[k])));
+            }
+            r(id) = invoke(*inst, r(inst->a), r(inst->b), &env);
+            break;
+          }
+          case Op::Define:
+            define(*inst);
+            break;
+          case Op::Iterate:
+            FIBLANG_PROBE2(loop__iteration, r(inst->a).n, r(inst->b).n);
+            break;
+          case Op::Phi:
+            break;
+          case Op::Jump:
+            jump(inst->targets[0]);
+            break;
+          case Op::Branch:
+            jump(inst->targets[r(inst->a).to_bool() ? 0 : 1]);
+            break;
+          case Op::Return:
+            return r(inst->a);
+        }
+      }
+    } catch (const Error&) {
+      throw;
+    } catch (const runtime_error& e) {
+      throw Error(inst->node, e.what(), inst->delta, !fn.osr);
+    }
+  }
+
+private:
+  Interpreter& interpreter;
+  deque<Value>& registers;
+  const Module* module = nullptr;
+  Rc<Environment> scope;  // where globals are looked up
+  const Value* globals = nullptr;  // slots of `scope` for the module's names
+  vector<Value> phis;
+
+  static Value add(const Value& l, const Value& r) {
+    long ret;
+    if (l.type == Value::Type::Long && r.type == Value::Type::Long &&
+        !__builtin_add_overflow(l.n, r.n, &ret)) {
+      return Value(ret);
+    }
+    return l + r;
+  }
+
+  static Value sub(const Value& l, const Value& r) {
+    long ret;
+    if (l.type == Value::Type::Long && r.type == Value::Type::Long &&
+        !__builtin_sub_overflow(l.n, r.n, &ret)) {
+      return Value(ret);
+    }
+    return l - r;
+  }
+
+  static Value less(const Value& l, const Value& r) {
+    if (l.type == Value::Type::Long && r.type == Value::Type::Long) {
+      return Value(l.n < r.n);
+    }
+    return Value(l < r);
+  }
+
+  // Specializes `fn` once, on the first thread that gets there
+  void specialize(const Function& fn) {
+    auto& profile = fn.profile;
+    if (profile.tried.exchange(true)) {
+      return;
+    }
+    profile.code = Optimizer::specialize(fn);
+    if (profile.code) {
+      profile.specialized.store(profile.code.get(), memory_order_release);
+      interpreter.stats.specializations++;
+    }
+  }
+
+  // Code that keeps deoptimizing is dropped for the generic code. Frames
+  // still running it keep it alive in the profile.
+  void deoptimized(const Function& fn) {
+    interpreter.stats.deopts++;
+    if (bump(fn.profile.deopts) >= interpreter.config.max_deopts) {
+      fn.profile.specialized.store(nullptr, memory_order_relaxed);
+    }
+  }
+
+  // Assigns the phis of `to` from the edge `from` -> `to`, all at once
+  void enter(const Function& fn, uint32_t from, uint32_t to, size_t base) {
+    const auto& block = fn.blocks[to];
+    auto index = find(block.preds.begin(), block.preds.end(), from) -
+                 block.preds.begin();
+    phis.clear();
+    for (auto id : block.insts) {
+      const auto& inst = fn.insts[id];
+      if (inst.op != Op::Phi) {
+        break;
+      }
+      phis.push_back(registers[base + inst.inputs[index]]);
+    }
+    for (size_t i = 0; i < phis.size(); i++) {
+      registers[base + block.insts[i]] = move(phis[i]);
+    }
+  }
+
+  // Calls from OSR code run in `parent`, the environment eval() would have
+  Value invoke(const Inst& inst, const Value& callee, const Value& arg,
+               const Rc<Environment>* parent = nullptr) {
+    const auto& fn = callee.as_function();
+    interpreter.stats.calls++;
+    FIBLANG_PROBE3(call__entry, inst.name.data(), inst.name.size(), arg.n);
+    auto callgraph = interpreter.callgraph;
+    if (callgraph) {
+      callgraph->enter(inst.name, arg);
+    }
+    CallScope call_scope{callgraph, interpreter.metrics, inst.name};
+
+    if (fn.code && !parent) {
+      return call(*fn.code, arg);
+    }
+    // The environment of a CallDynamic is made for this call only, and the
+    // parameter shadows what it binds
+    auto env = parent ? *parent : make_rc<Environment>(interpreter.env());
+    env->values.insert_or_assign(fn.param, arg);
+
+    // A lazy body compiled on the same globals runs here, in the environment
+    // eval() would give it
+    auto code = fn.lazy ? fn.lazy->compiled.load(memory_order_acquire)
+                        : nullptr;
+    if (code && fn.lazy->code->globals == module->globals) {
+      swap(scope, env);
+      struct Restore {
+        Rc<Environment>& scope;
+        Rc<Environment>& saved;
+        ~Restore() { swap(scope, saved); }
+      } restore{scope, env};
+      return call(*code, arg);
+    }
+    return fn.eval(env);
+  }
+
+  void define(const Inst& inst) {
+    const auto& code = *module->functions[inst.aux];
+    auto definition = code.definition;
+    auto body = code.body;
+    fiblang::Function value(code.param, [=](Rc<Environment> env) {
+      return eval_body(*definition, *body, env);
+    });
+    value.code = &code;
+    interpreter.env()->set_value(inst.name, Value(move(value)));
+  }
+};
+
+// The code of a loop is compiled once, the first time the loop moves to the
+// IR, and kept with the program being run. A loop in a function another
+// program defined is compiled every time.
+inline bool osr(const Node& loop, const Rc<Environment>& env, long from) {
+  auto& interpreter = *env->interpreter;
+  auto compile = [&]() -> shared_ptr<const Module> {
+    auto module = Builder::build_loop(loop);
+    if (module) {
+      Optimizer(*module, interpreter.config.unroll_factor).run();
+    }
+    return module;
+  };
+  auto program = interpreter.program;
+  auto module = program && program->has(loop.nodes[0]->token)
+                    ? program->code(loop, compile)
+                    : compile();
+  if (!module) {
+    return false;
+  }
+  interpreter.stats.osr++;
+  Executor(interpreter).run_loop(*module, env, from);
+  return true;
+}
+
+// A body is compiled once, the first time it is called, and kept with its
+// program. Bodies of programs ir::compile() didn't see run with eval().
+inline void compile_body(const Program& program, const Node& definition,
+                         LazyBody& body, const Config& config) {
+  if (!program.bound) {
+    return;
+  }
+  body.code = program.code(*definition.nodes[2], [&] {
+    auto module = Builder::build_body(program, definition, *body.node);
+    if (module) {
+      Optimizer(*module, config.unroll_factor).run();
+    }
+    return shared_ptr<const Module>(move(module));
+  });
+  if (body.code) {
+    body.compiled.store(body.code->functions[0].get(), memory_order_release);
+  }
+}
+
+inline Value run_body(const Module& module, const Rc<Environment>& env) {
+  return Executor(*env->interpreter).run_body(module, env);
+}
+
+}  // namespace ir
+
+inline Value Interpreter::run(const Program& program) {
+  this->program = &program;
+  // Shared globals are published by name, so they stay in `values`.
+  if (!root->globals) {
+    root->index(program.globals);
+  }
+  return request([&] {
+    if (program.module) {
+      return ir::Executor(*this).run(*program.module);
+    }
+    return eval(*program.root, root);
+  });
+}
+
+}  // namespace fiblang
@@ -0,0 +1,71 @@
+//
+//  Checks that shared globals hold up with many instances and publishes
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+// More instances pin one Globals at once than a block of reader slots has,
+// each publishing its own definition, and then one definition is published
+// over and over. Exits non-zero on the first check that fails.
+
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "fiblang.h"
+
+using namespace std;
+using namespace fiblang;
+
+int main() {
+  Globals globals(Environment::builtins());
+  // Definitions point into their programs, which point into their sources
+  deque<string> sources;
+  vector<shared_ptr<Program>> programs;
+  auto run = [&](Interpreter& interpreter, string source) {
+    sources.push_back(move(source));
+    programs.push_back(parse(sources.back(), cerr));
+    interpreter.run(*programs.back()->root);
+  };
+
+  auto instances = 2 * Globals::block_readers + 1;
+  {
+    vector<unique_ptr<Interpreter>> held;
+    for (size_t i = 0; i < instances; i++) {
+      held.push_back(make_unique<Interpreter>(globals));
+      run(*held.back(), "def f" + to_string(i) + "(x) x + " + to_string(i));
+      held.back()->publish();
+    }
+  }
+
+  ostringstream out;
+  Interpreter reader(globals, out);
+  run(reader, "puts(f0(1) + f" + to_string(instances - 1) + "(1))");
+  if (out.str() != to_string(instances + 1) + "\n") {
+    cerr << "wrong output: " << out.str();
+    return 1;
+  }
+
+  // Replaced function values go with the last version that holds them. The
+  // version a publish replaces is still pinned by the writer until the next.
+  Interpreter writer(globals);
+  size_t closures = 0;
+  for (size_t i = 0; i < 100; i++) {
+    run(writer, "def g(x) x + " + to_string(i));
+    writer.publish();
+    if (i <= 1) {
+      closures = globals.closures();
+    } else if (globals.closures() != closures) {
+      cerr << "publish " << i << ": " << globals.closures()
+           << " closures, expected " << closures << endl;
+      return 1;
+    }
+  }
+  if (globals.pending() > 2) {
+    cerr << globals.pending() << " versions pending" << endl;
+    return 1;
+  }
+  return 0;
+}
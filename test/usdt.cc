@@ -0,0 +1,195 @@
+//
+//  Counts the hits of a USDT probe
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+// usdt <probe> <program> [args...]
+//
+// Runs the program and prints on stderr how many times the probe of provider
+// `fiblang` fired. Attaches the way a tracer does: the nop of every site of
+// the probe, found in the program's .note.stapsdt, is replaced by a
+// breakpoint. x86-64 only.
+
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Elf {
+  string data;
+
+  explicit Elf(const string& path) {
+    ifstream f{path, ios::binary};
+    data.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+  }
+
+  const Elf64_Ehdr& header() const {
+    return *reinterpret_cast<const Elf64_Ehdr*>(data.data());
+  }
+
+  const Elf64_Shdr* section(const string& name) const {
+    auto sections =
+        reinterpret_cast<const Elf64_Shdr*>(data.data() + header().e_shoff);
+    auto names = data.data() + sections[header().e_shstrndx].sh_offset;
+    for (size_t i = 0; i < header().e_shnum; i++) {
+      if (name == names + sections[i].sh_name) {
+        return &sections[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Lowest address of a loaded segment
+  uint64_t first_vaddr() const {
+    auto segments =
+        reinterpret_cast<const Elf64_Phdr*>(data.data() + header().e_phoff);
+    auto vaddr = UINT64_MAX;
+    for (size_t i = 0; i < header().e_phnum; i++) {
+      if (segments[i].p_type == PT_LOAD) {
+        vaddr = min<uint64_t>(vaddr, segments[i].p_vaddr & ~0xfffUL);
+      }
+    }
+    return vaddr;
+  }
+
+  // Link-time addresses of the sites of a probe, adjusted as in <sys/sdt.h>
+  // for a .stapsdt.base section that moved
+  vector<uint64_t> probe(const string& provider, const string& name) const {
+    vector<uint64_t> sites;
+    auto notes = section(".note.stapsdt");
+    auto base = section(".stapsdt.base");
+    if (!notes || !base) {
+      return sites;
+    }
+    auto align = [](size_t n) { return (n + 3) & ~size_t(3); };
+    auto p = data.data() + notes->sh_offset;
+    auto end = p + notes->sh_size;
+    while (p + sizeof(Elf64_Nhdr) <= end) {
+      auto& note = *reinterpret_cast<const Elf64_Nhdr*>(p);
+      auto desc = p + sizeof(Elf64_Nhdr) + align(note.n_namesz);
+      p = desc + align(note.n_descsz);
+      if (note.n_type != 3) {
+        continue;
+      }
+      uint64_t pc, link_base;
+      memcpy(&pc, desc, 8);
+      memcpy(&link_base, desc + 8, 8);
+      auto strings = desc + 24;
+      auto probe = strings + strlen(strings) + 1;
+      if (provider == strings && name == probe) {
+        sites.push_back(pc + base->sh_addr - link_base);
+      }
+    }
+    return sites;
+  }
+};
+
+// Where the first segment of `path` is mapped in process `pid`
+uint64_t load_address(pid_t pid, const string& path) {
+  ifstream maps{"/proc/" + to_string(pid) + "/maps"};
+  char real[PATH_MAX];
+  if (!realpath(path.c_str(), real)) {
+    return 0;
+  }
+  for (string line; getline(maps, line);) {
+    if (line.size() >= strlen(real) &&
+        line.compare(line.size() - strlen(real), string::npos, real) == 0) {
+      return stoull(line.substr(0, line.find('-')), nullptr, 16);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, const char** argv) {
+  if (argc < 3) {
+    cerr << "usage: usdt probe program [args...]" << endl;
+    return 2;
+  }
+  string probe = argv[1];
+  string path = argv[2];
+
+  Elf elf(path);
+  auto sites = elf.probe("fiblang", probe);
+  if (sites.empty()) {
+    cerr << path << ": no probe " << probe << endl;
+    return 2;
+  }
+
+  auto child = fork();
+  if (child == 0) {
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    execv(path.c_str(), const_cast<char**>(argv + 2));
+    _exit(127);
+  }
+
+  // Stopped at the exec; the breakpoints go in before anything runs
+  int status;
+  waitpid(child, &status, 0);
+  ptrace(PTRACE_SETOPTIONS, child, nullptr,
+         PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+  auto bias = elf.header().e_type == ET_DYN
+                  ? load_address(child, path) - elf.first_vaddr()
+                  : 0;
+  set<uint64_t> breakpoints;
+  for (auto site : sites) {
+    auto addr = site + bias;
+    errno = 0;
+    auto word = ptrace(PTRACE_PEEKTEXT, child, addr, nullptr);
+    if (errno || (word & 0xff) != 0x90) {
+      cerr << probe << " at 0x" << hex << site << ": not a nop" << endl;
+      kill(child, SIGKILL);
+      return 2;
+    }
+    ptrace(PTRACE_POKETEXT, child, addr, (word & ~0xffL) | 0xcc);
+    breakpoints.insert(addr);
+  }
+
+  // A hit stops at the byte after the breakpoint, which replaced a one-byte
+  // nop, so the thread just continues. Threads are traced as they start.
+  size_t hits = 0;
+  ptrace(PTRACE_CONT, child, nullptr, nullptr);
+  for (;;) {
+    auto pid = waitpid(-1, &status, __WALL);
+    if (pid < 0) {
+      break;
+    }
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      if (pid == child) {
+        break;
+      }
+      continue;
+    }
+    auto sig = WSTOPSIG(status);
+    if (sig == SIGTRAP && (status >> 16) == 0) {
+      user_regs_struct regs;
+      ptrace(PTRACE_GETREGS, pid, nullptr, &regs);
+      if (breakpoints.count(regs.rip - 1)) {
+        hits++;
+        sig = 0;
+      }
+    } else if (sig == SIGTRAP || sig == SIGSTOP) {
+      sig = 0;  // a clone event, or a new thread starting
+    }
+    ptrace(PTRACE_CONT, pid, nullptr, sig);
+  }
+
+  cerr << hits << endl;
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
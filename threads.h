@@ -0,0 +1,498 @@
+//
+//  threads.h
+//
+//  Copyright (c) 2021 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#pragma once
+
+#include <sched.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace fiblang {
+
+//-----------------------------------------------------------------------------
+// Topology
+//-----------------------------------------------------------------------------
+
+// CPU list in the format of /sys, e.g. "0-3,8-11"
+inline std::vector<int> parse_cpulist(std::string_view s) {
+  std::vector<int> cpus;
+  while (!s.empty()) {
+    auto comma = std::min(s.find(','), s.size());
+    auto range = s.substr(0, comma);
+    auto dash = range.find('-');
+    try {
+      auto first = std::stoi(std::string(range.substr(0, dash)));
+      auto last = dash == std::string_view::npos
+                      ? first
+                      : std::stoi(std::string(range.substr(dash + 1)));
+      for (auto cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception&) {
+    }
+    s.remove_prefix(std::min(comma + 1, s.size()));
+  }
+  return cpus;
+}
+
+inline std::string format_cpulist(const std::vector<int>& cpus) {
+  std::string s;
+  for (size_t i = 0; i < cpus.size();) {
+    auto j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+      j++;
+    }
+    s += (s.empty() ? "" : ",") + std::to_string(cpus[i]);
+    if (j > i) {
+      s += "-" + std::to_string(cpus[j]);
+    }
+    i = j + 1;
+  }
+  return s;
+}
+
+// CPUs granted by the CFS quota of a cgroup directory, 0 when there is none
+inline double read_cpu_quota(const std::string& dir, bool v2) {
+  if (v2) {
+    std::ifstream max{dir + "/cpu.max"};
+    std::string quota;
+    double period = 0;
+    if (!(max >> quota >> period) || quota == "max" || period <= 0) {
+      return 0;
+    }
+    return std::stod(quota) / period;
+  }
+
+  std::ifstream cfs_quota{dir + "/cpu.cfs_quota_us"};
+  long quota = 0, period = 0;
+  if (!(cfs_quota >> quota) || quota <= 0) {
+    return 0;
+  }
+  std::ifstream cfs_period{dir + "/cpu.cfs_period_us"};
+  if (!(cfs_period >> period) || period <= 0) {
+    return 0;
+  }
+  return double(quota) / period;
+}
+
+// What the process may actually run on: the CPUs of its affinity mask,
+// grouped by NUMA node, and the CPU quota of its cgroup. A container on a
+// large host sees all of the host's CPUs in hardware_concurrency() but may
+// only be granted a few of them.
+struct Topology {
+  std::vector<int> online;
+  std::vector<int> cpus;                // allowed by the affinity mask
+  std::vector<std::vector<int>> nodes;  // allowed CPUs of each NUMA node
+  std::vector<int> cpu_node;
+  double quota = 0;    // CPUs, 0 when unlimited
+  std::string cgroup;  // where the quota comes from
+
+  Topology() {
+    std::ifstream f{"/sys/devices/system/cpu/online"};
+    std::string line;
+    std::getline(f, line);
+    online = parse_cpulist(line);
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    if (cpus.empty()) {
+      for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+
+    read_nodes();
+    read_cgroup();
+  }
+
+  // Threads worth running at once
+  size_t concurrency() const {
+    auto n = std::max<size_t>(1, cpus.size());
+    if (quota > 0) {
+      n = std::min(n, size_t(std::ceil(quota - 1e-9)));
+    }
+    return std::max<size_t>(1, n);
+  }
+
+  size_t node_of(int cpu) const {
+    return cpu >= 0 && size_t(cpu) < cpu_node.size() ? cpu_node[cpu] : 0;
+  }
+
+  void print(std::ostream& out) const {
+    out << "cpus: " << format_cpulist(cpus) << " (" << cpus.size() << " of "
+        << online.size() << " online)" << std::endl;
+    out << "cgroup quota: ";
+    if (quota > 0) {
+      out << quota << " cpus (" << cgroup << ")" << std::endl;
+    } else {
+      out << "none" << std::endl;
+    }
+    for (size_t node = 0; node < nodes.size(); node++) {
+      out << "node " << node << ": " << format_cpulist(nodes[node])
+          << std::endl;
+    }
+    out << "concurrency: " << concurrency() << std::endl;
+  }
+
+private:
+  void read_nodes() {
+    for (size_t node = 0;; node++) {
+      std::ifstream f{"/sys/devices/system/node/node" + std::to_string(node) +
+                      "/cpulist"};
+      if (!f) {
+        break;
+      }
+      std::string line;
+      std::getline(f, line);
+      nodes.emplace_back();
+      for (auto cpu : parse_cpulist(line)) {
+        if (std::binary_search(cpus.begin(), cpus.end(), cpu)) {
+          nodes.back().push_back(cpu);
+        }
+      }
+    }
+    if (nodes.empty()) {
+      nodes.push_back(cpus);
+    }
+
+    cpu_node.assign(cpus.back() + 1, 0);
+    for (size_t node = 0; node < nodes.size(); node++) {
+      for (auto cpu : nodes[node]) {
+        cpu_node[cpu] = int(node);
+      }
+    }
+  }
+
+  // The quota of the process's cgroup or any of its ancestors, whichever
+  // is the smallest. Within a container the cgroup root is usually the
+  // container's own.
+  void read_cgroup() {
+    std::ifstream f{"/proc/self/cgroup"};
+    for (std::string line; std::getline(f, line);) {
+      // id:controllers:path
+      auto first = line.find(':');
+      auto second = line.find(':', first + 1);
+      if (first == std::string::npos || second == std::string::npos) {
+        continue;
+      }
+      auto controllers = line.substr(first + 1, second - first - 1);
+      auto path = line.substr(second + 1);
+
+      auto v2 = controllers.empty();
+      std::string mount;
+      if (v2) {
+        mount = "/sys/fs/cgroup";
+      } else if (("," + controllers + ",").find(",cpu,") !=
+                 std::string::npos) {
+        mount = "/sys/fs/cgroup/" + controllers;
+      } else {
+        continue;
+      }
+
+      for (auto dir = path;;) {
+        while (!dir.empty() && dir.back() == '/') {
+          dir.pop_back();
+        }
+        auto q = read_cpu_quota(mount + dir, v2);
+        if (q > 0 && (quota == 0 || q < quota)) {
+          quota = q;
+          cgroup = mount + dir;
+        }
+        if (dir.empty()) {
+          break;
+        }
+        auto slash = dir.rfind('/');
+        dir.resize(slash == std::string::npos ? 0 : slash);
+      }
+    }
+  }
+};
+
+inline const Topology& topology() {
+  static Topology topology;
+  return topology;
+}
+
+//-----------------------------------------------------------------------------
+// Affinity
+//-----------------------------------------------------------------------------
+
+// How workers are pinned: not at all, filling one NUMA node before the next,
+// or spread round-robin over the nodes
+enum class Affinity { none, compact, scatter };
+
+inline bool parse_affinity(std::string_view s, Affinity& affinity) {
+  if (s == "none") {
+    affinity = Affinity::none;
+  } else if (s == "compact") {
+    affinity = Affinity::compact;
+  } else if (s == "scatter") {
+    affinity = Affinity::scatter;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+inline const char* affinity_name(Affinity affinity) {
+  switch (affinity) {
+    case Affinity::none:
+      return "none";
+    case Affinity::compact:
+      return "compact";
+    case Affinity::scatter:
+      return "scatter";
+  }
+  return "";
+}
+
+// CPU of the `index`-th pinned thread, -1 when it isn't pinned
+inline int affinity_cpu(const Topology& t, Affinity affinity, size_t index) {
+  std::vector<const std::vector<int>*> nodes;
+  for (const auto& cpus : t.nodes) {
+    if (!cpus.empty()) {
+      nodes.push_back(&cpus);
+    }
+  }
+  if (affinity == Affinity::none || nodes.empty()) {
+    return -1;
+  }
+
+  if (affinity == Affinity::scatter) {
+    const auto& cpus = *nodes[index % nodes.size()];
+    return cpus[index / nodes.size() % cpus.size()];
+  }
+  index %= t.cpus.size();
+  for (auto cpus : nodes) {
+    if (index < cpus->size()) {
+      return (*cpus)[index];
+    }
+    index -= cpus->size();
+  }
+  return -1;
+}
+
+inline bool pin_to_cpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// NUMA node of a pinned worker, -1 on other threads
+inline thread_local int worker_node = -1;
+
+// NUMA node the calling thread runs on
+inline size_t current_node() {
+  if (worker_node >= 0) {
+    return size_t(worker_node);
+  }
+  return topology().node_of(sched_getcpu());
+}
+
+//-----------------------------------------------------------------------------
+// Thread pool
+//-----------------------------------------------------------------------------
+
+// Persistent workers shared by all parallel operations. Each batch of tasks
+// is also worked on by the thread that submits it, so that a nested
+// parallel_for() in a task never waits for a free worker, and the pool
+// never runs more threads than it has workers plus the submitters.
+//
+// Pinned workers allocate the buffers of their tasks themselves, so the
+// kernel's first-touch policy places that memory on the worker's node.
+class ThreadPool {
+public:
+  explicit ThreadPool(Affinity affinity = Affinity::none)
+      : affinity(affinity) {}
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  // Work done by a worker so far
+  struct Usage {
+    uint64_t tasks = 0;
+    uint64_t busy_ns = 0;
+  };
+
+  // Starts workers until there are `n`
+  void reserve(size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    while (workers.size() < n) {
+      auto index = workers.size();
+      auto cpu = affinity_cpu(topology(), affinity, index);
+      usage.emplace_back();
+      workers.emplace_back([this, index, cpu] { work(index, cpu); });
+    }
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return workers.size();
+  }
+
+  // Batches with tasks that no thread has taken yet
+  size_t queued() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return batches.size();
+  }
+
+  std::vector<Usage> worker_usage() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return usage;
+  }
+
+  // Runs f(0) ... f(n - 1) on the calling thread and at most `helpers`
+  // workers at a time, and returns once all of them are done.
+  template <typename F>
+  void parallel_for(size_t n, size_t helpers, F&& f) {
+    using Fn = std::remove_reference_t<F>;
+    Batch batch;
+    batch.call = [](void* f, size_t i) { (*static_cast<Fn*>(f))(i); };
+    batch.f = const_cast<void*>(static_cast<const void*>(&f));
+    batch.n = n;
+    batch.helpers = helpers;
+
+    if (n > 1 && helpers > 0) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        batches.push_back(&batch);
+      }
+      for (size_t i = 1; i < std::min(n, helpers + 1); i++) {
+        wake.notify_one();
+      }
+    }
+
+    for (size_t i; (i = batch.next++) < n;) {
+      f(i);
+      batch.done++;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = std::find(batches.begin(), batches.end(), &batch);
+    if (it != batches.end()) {
+      batches.erase(it);
+    }
+    finished.wait(lock, [&] { return batch.done == n; });
+  }
+
+private:
+  struct Batch {
+    void (*call)(void*, size_t) = nullptr;
+    void* f = nullptr;
+    size_t n = 0;
+    size_t helpers = 0;
+    size_t running = 0;  // workers in a task of this batch
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+  };
+
+  // Takes a task from the oldest batch that may use another worker, and
+  // drops the batches that have none left. Called with the lock held.
+  bool claim(Batch*& batch, size_t& i) {
+    for (size_t j = 0; j < batches.size();) {
+      auto b = batches[j];
+      if (b->running >= b->helpers) {
+        j++;
+        continue;
+      }
+      i = b->next++;
+      if (i >= b->n) {
+        batches.erase(batches.begin() + j);
+        continue;
+      }
+      b->running++;
+      batch = b;
+      return true;
+    }
+    return false;
+  }
+
+  void work(size_t index, int cpu) {
+    if (cpu >= 0 && pin_to_cpu(cpu)) {
+      worker_node = int(topology().node_of(cpu));
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      Batch* batch = nullptr;
+      size_t i = 0;
+      wake.wait(lock, [&] { return stop || claim(batch, i); });
+      if (stop) {
+        return;
+      }
+      lock.unlock();
+      auto start = std::chrono::steady_clock::now();
+      batch->call(batch->f, i);
+      auto busy = std::chrono::steady_clock::now() - start;
+      lock.lock();
+      usage[index].tasks++;
+      usage[index].busy_ns += uint64_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count());
+      // The submitter checks `done` with the lock held, so the batch
+      // outlives this update.
+      batch->running--;
+      if (++batch->done == batch->n) {
+        finished.notify_all();
+      }
+    }
+  }
+
+  Affinity affinity;
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+  std::deque<Batch*> batches;
+  std::vector<std::thread> workers;
+  std::vector<Usage> usage;  // by worker
+  bool stop = false;
+};
+
+// The shared pool of the workers placed by `affinity`. There is one per
+// policy, so that interpreters with different policies run side by side;
+// each starts its workers on first use.
+inline ThreadPool& pool(Affinity affinity = Affinity::none) {
+  static ThreadPool none(Affinity::none);
+  static ThreadPool compact(Affinity::compact);
+  static ThreadPool scatter(Affinity::scatter);
+  switch (affinity) {
+    case Affinity::compact:
+      return compact;
+    case Affinity::scatter:
+      return scatter;
+    default:
+      return none;
+  }
+}
+
+}  // namespace fiblang